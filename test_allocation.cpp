@@ -0,0 +1,61 @@
+//
+// Counts heap allocations made on the insert and read paths.
+//
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "catch_amalgamated.hpp"
+#include "tsdb/series.h"
+
+using namespace tsdb;
+using namespace tsdb::literals;
+
+static thread_local size_t n_allocations = 0;
+
+void* operator new(size_t size) {
+  n_allocations++;
+  if (auto p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+TEST_CASE("no allocation per insert") {
+  SectorMemoryIO io{4096};
+  Series series{io, Partition::create(0, 4096), SeriesConfig{100, 4_kb}};
+
+  std::vector<uint8_t> data(700, 0x5a);
+  uint64_t timestamp = 1;
+  // Warm up, so the header sector write batch has its capacity.
+  for (int i = 0; i < 2 * HeaderSector::n_entries; ++i) {
+    series.insert(data.data(), data.size(), 0, timestamp++);
+  }
+
+  const size_t n_inserts = 1000;
+  auto before = n_allocations;
+  for (int i = 0; i < n_inserts; ++i) {
+    series.insert(data.data(), data.size(), 0, timestamp++);
+  }
+  auto allocations_per_insert = double(n_allocations - before) / n_inserts;
+  INFO("allocations per insert: " << allocations_per_insert);
+  REQUIRE(allocations_per_insert == 0);
+
+  size_t read_allocations = 0;
+  std::vector<uint8_t> recv(data.size());
+  series.iterate([&](auto& data_log_entry) {
+    auto before = n_allocations;
+    data_log_entry.read(recv.data(), recv.size());
+    read_allocations += n_allocations - before;
+    return true;
+  });
+  REQUIRE(read_allocations == 0);
+}
@@ -0,0 +1,201 @@
+//
+// Coroutine API: tasks, async generator, async insert and read.
+//
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "catch_amalgamated.hpp"
+#include "tsdb/async.h"
+#include "tsdb/series.h"
+
+using namespace tsdb;
+using namespace tsdb::literals;
+
+// Reads requested asynchronously only complete when poll() is called, like a backend whose event loop reaps them.
+struct DeferredIO : IO<DeferredIO> {
+  constexpr static bool native_async = true;
+
+  explicit DeferredIO(uint32_t n_sectors) : mem(n_sectors) {}
+
+  SectorMemoryIO mem;
+  std::mutex lock;
+  std::deque<std::function<void()>> queued;
+  std::atomic<size_t> n_deferred{0};
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  void async_read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector, IOCompletion done) {
+    std::lock_guard g(lock);
+    n_deferred++;
+    queued.push_back([=, this, done = std::move(done)] { run_synchronously([&] { read_sectors(out, begin_sector, n_sector); }, done); });
+  }
+
+  /// Complete the queued requests. \return how many
+  size_t poll() {
+    std::deque<std::function<void()>> ready;
+    {
+      std::lock_guard g(lock);
+      ready.swap(queued);
+    }
+    for (auto& r : ready) {
+      r();
+    }
+    return ready.size();
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
+
+static std::vector<uint8_t> payload_of(uint64_t ts) {
+  std::vector<uint8_t> data(1 + ts * 97 % 3000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = (uint8_t)(ts + i * 13);
+  }
+  return data;
+}
+
+template <typename TSeries>
+static Task<size_t> insert_all(TSeries& series, uint64_t n) {
+  for (uint64_t ts = 1; ts <= n; ++ts) {
+    auto data = payload_of(ts);
+    co_await series.async_insert(data.data(), data.size(), 0, ts);
+  }
+  co_return n;
+}
+
+// Reads every entry in chunks of `chunk` bytes and checks it. \return number of entries read
+template <typename TSeries>
+static Task<size_t> read_all(TSeries& series, uint32_t chunk) {
+  size_t n = 0;
+  auto entries = series.async_iterate(false);
+  while (auto* entry = co_await entries.next()) {
+    auto expected = payload_of(entry->log_entry.timestamp);
+    std::vector<uint8_t> recv(entry->log_entry.size);
+    uint32_t offset = 0;
+    while (auto got = co_await entry->async_read(recv.data() + offset, std::min<uint32_t>(chunk, recv.size() - offset))) {
+      offset += got;
+    }
+    if (offset != expected.size() || recv != expected || entry->get_accumulated_crc() != entry->log_entry.checksum) {
+      throw CorruptedDataError("mismatch");
+    }
+    n++;
+  }
+  co_return n;
+}
+
+TEST_CASE("coroutine tasks") {
+  auto add = [](int a, int b) -> Task<int> { co_return a + b; };
+  auto twice = [&](int a) -> Task<int> { co_return co_await add(a, a) + co_await offload([] { return 0; }); };
+  REQUIRE(sync_wait(twice(21)) == 42);
+
+  auto fail = []() -> Task<> {
+    co_await offload([] { throw IOError("device gone"); });
+  };
+  REQUIRE_THROWS_AS(sync_wait(fail()), IOError);
+
+  auto count = [](int n) -> AsyncGenerator<int> {
+    for (int i = 0; i < n; ++i) {
+      co_await offload([] {});
+      co_yield i;
+    }
+  };
+  auto sum = [&]() -> Task<int> {
+    int total = 0;
+    auto g = count(10);
+    while (auto* i = co_await g.next()) {
+      total += *i;
+    }
+    // Abandoned half way, the frame is destroyed with the generator.
+    auto partial = count(10);
+    co_await partial.next();
+    co_return total;
+  };
+  REQUIRE(sync_wait(sum()) == 45);
+}
+
+TEST_CASE("async series") {
+  SECTION("synchronous io is offloaded") {
+    SectorMemoryIO io{4096};
+    Series series{io, Partition::create(0, 4096), SeriesConfig{200, 4_kb}};
+    REQUIRE(sync_wait(insert_all(series, 150)) == 150);
+    REQUIRE(sync_wait(read_all(series, sector_size)) == 150);
+    REQUIRE(sync_wait(read_all(series, 4_kb)) == 150);
+  }
+
+  SECTION("native async io suspends until completion") {
+    DeferredIO io{4096};
+    Series series{io, Partition::create(0, 4096), SeriesConfig{200, 4_kb}};
+    sync_wait(insert_all(series, 100));
+
+    std::atomic<bool> done{false};
+    std::thread poller([&] {
+      while (!done) {
+        if (!io.poll()) {
+          std::this_thread::yield();
+        }
+      }
+    });
+    auto n = sync_wait(read_all(series, 2 * sector_size));
+    done = true;
+    poller.join();
+    REQUIRE(n == 100);
+    REQUIRE(io.n_deferred >= 100);
+  }
+
+  SECTION("compressed entries") {
+    DeferredIO io{4096};
+    SeriesConfig cfg{200, 8_kb};
+    cfg.compress = true;
+    Series series{io, Partition::create(0, 4096), cfg};
+    std::vector<uint8_t> text(5000);
+    for (size_t i = 0; i < text.size(); ++i) {
+      text[i] = "periodic report "[i % 16];
+    }
+    series.insert(text.data(), text.size(), 0, 1);
+
+    auto read = [&]() -> Task<std::vector<uint8_t>> {
+      auto entries = series.async_iterate();
+      auto* entry = co_await entries.next();
+      std::vector<uint8_t> recv(entry->size());
+      uint32_t offset = 0;
+      while (auto got = co_await entry->async_read(recv.data() + offset, std::min<uint32_t>(sector_size, recv.size() - offset))) {
+        offset += got;
+      }
+      REQUIRE(co_await entries.next() == nullptr);
+      co_return recv;
+    };
+    REQUIRE(sync_wait(read()) == text);
+    // Decompression goes through the blocking path.
+    REQUIRE(io.n_deferred == 0);
+  }
+
+  SECTION("overwritten entries") {
+    SectorMemoryIO io{256};
+    Series series{io, Partition::create(0, 256), SeriesConfig{400, 4_kb}};
+    sync_wait(insert_all(series, 100));
+    auto read = [&]() -> Task<size_t> {
+      size_t n_overwritten = 0;
+      auto entries = series.async_iterate();
+      auto* first = co_await entries.next();
+      // Wraps the data ring: the rest of the snapshot is gone.
+      co_await insert_all(series, 200);
+      std::vector<uint8_t> recv(first->log_entry.size);
+      try {
+        co_await first->async_read(recv.data(), recv.size());
+      } catch (const EntryOverwrittenError&) {
+        n_overwritten++;
+      }
+      REQUIRE(co_await entries.next() == nullptr);
+      co_return n_overwritten;
+    };
+    REQUIRE(sync_wait(read()) == 1);
+  }
+}
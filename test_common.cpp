@@ -16,4 +16,11 @@ TEST_CASE("common") {
     REQUIRE(min_sector_for_size(8191) == 16);
     REQUIRE(min_sector_for_size(8193) == 17);
   }
-}
\ No newline at end of file
+}
+TEST_CASE("common 4 KiB sectors") {
+  REQUIRE(min_sector_for_size<4096>(1) == 1);
+  REQUIRE(min_sector_for_size<4096>(4096) == 1);
+  REQUIRE(min_sector_for_size<4096>(4097) == 2);
+  REQUIRE(min_sector_for_size<4096>(8192) == 2);
+  REQUIRE(min_sector_for_size<4096>(8193) == 3);
+}
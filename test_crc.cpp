@@ -1,10 +1,15 @@
 //
 // Created by wuyua on 2023/1/17.
 //
+#include <chrono>
+#include <random>
+
 #include "catch_amalgamated.hpp"
+#include "fmt/format.h"
 #include "tsdb/crc.h"
 
 using namespace tsdb;
+using namespace std::chrono_literals;
 TEST_CASE("crc") {
   CRCDefault crc;
   SECTION("full") {
@@ -19,3 +24,135 @@ TEST_CASE("crc") {
     REQUIRE(crc.get() == 0x89a1897f);
   }
 }
+
+TEMPLATE_TEST_CASE("table crc matches bitwise crc", "", CRCTable<4>, CRCTable<8>, CRCTable<16>) {
+  SECTION("check value") {
+    TestType crc;
+    const char* data = "123456789";
+    crc.update(data, strlen(data));
+    REQUIRE(crc.get() == 0x89a1897f);
+  }
+
+  SECTION("random buffers and splits") {
+    std::mt19937 rng(42);
+    std::vector<uint8_t> buffer(1100);
+    for (auto& b : buffer) {
+      b = rng();
+    }
+    for (size_t len = 0; len < buffer.size(); len += 7) {
+      CRCDefault expected;
+      expected.update(buffer.data(), len);
+
+      auto split = len ? rng() % len : 0;
+      TestType crc;
+      crc.update(buffer.data(), split);
+      crc.update(buffer.data() + split, len - split);
+      REQUIRE(crc.get() == expected.get());
+    }
+  }
+}
+
+template <typename TCRC>
+static double crc_throughput_mbps(const std::vector<uint8_t>& buffer, size_t len) {
+  using namespace std::chrono;
+  size_t total = 0;
+  uint32_t sink = 0;
+  auto begin = steady_clock::now();
+  do {
+    TCRC crc;
+    crc.update(buffer.data(), len);
+    sink ^= crc.get();
+    total += len;
+  } while (steady_clock::now() - begin < 200ms);
+  auto elapsed = duration<double>(steady_clock::now() - begin).count();
+  REQUIRE(sink != 0xdeadbeef);  // keep the result alive
+  return total / elapsed / (1 << 20);
+}
+
+TEST_CASE("crc throughput", "[.][benchmark]") {
+  std::vector<uint8_t> buffer(2 << 20);
+  std::mt19937 rng(1);
+  for (auto& b : buffer) {
+    b = rng();
+  }
+
+  for (size_t len : {512, 4096, 2 << 20}) {
+    fmt::print("{:>8} B: default {:8.1f} MB/s | table4 {:8.1f} MB/s | table8 {:8.1f} MB/s | table16 {:8.1f} MB/s\n",
+               len,
+               crc_throughput_mbps<CRCDefault>(buffer, len),
+               crc_throughput_mbps<CRCTable<4>>(buffer, len),
+               crc_throughput_mbps<CRCTable<8>>(buffer, len),
+               crc_throughput_mbps<CRCTable<16>>(buffer, len));
+    fmt::print("{:>8} B: clmul {:8.1f} MB/s (hardware: {})\n", len, crc_throughput_mbps<CRCClmul>(buffer, len), CRCClmul::hardware_supported());
+  }
+}
+
+TEST_CASE("clmul crc matches bitwise crc") {
+  INFO("hardware supported: " << CRCClmul::hardware_supported());
+  std::mt19937 rng(7);
+  std::vector<uint8_t> buffer(4096);
+  for (auto& b : buffer) {
+    b = rng();
+  }
+
+  for (size_t len = 0; len <= buffer.size(); ++len) {
+    CRCDefault expected;
+    expected.update(buffer.data(), len);
+
+    CRCClmul crc;
+    crc.update(buffer.data(), len);
+    REQUIRE(crc.get() == expected.get());
+  }
+
+  SECTION("split updates") {
+    for (int i = 0; i < 200; ++i) {
+      auto len = rng() % buffer.size();
+      auto split = len ? rng() % len : 0;
+      CRCDefault expected;
+      expected.update(buffer.data(), len);
+
+      CRCClmul crc;
+      crc.update(buffer.data(), split);
+      crc.update(buffer.data() + split, len - split);
+      REQUIRE(crc.get() == expected.get());
+    }
+  }
+}
+
+TEST_CASE("crc combine") {
+  std::mt19937 rng(3);
+  std::vector<uint8_t> buffer(300 * 1024);
+  for (auto& b : buffer) {
+    b = rng();
+  }
+
+  SECTION("two parts") {
+    for (int i = 0; i < 50; ++i) {
+      size_t len = rng() % 5000;
+      size_t split = len ? rng() % len : 0;
+      CRCTable<> whole, a, b;
+      whole.update(buffer.data(), len);
+      a.update(buffer.data(), split);
+      b.update(buffer.data() + split, len - split);
+      REQUIRE(a.combine(a.get(), b.get(), len - split) == whole.get());
+    }
+  }
+
+  SECTION("non zero initial value") {
+    CRCTable<> whole(0xffffffff), a(0xffffffff), b(0xffffffff);
+    whole.update(buffer.data(), 1000);
+    a.update(buffer.data(), 333);
+    b.update(buffer.data() + 333, 667);
+    a.append(b.get(), 667);
+    REQUIRE(a.get() == whole.get());
+  }
+
+  SECTION("parallel checksum") {
+    CRCTable<> expected;
+    expected.update(buffer.data(), buffer.size());
+    for (unsigned workers : {1, 2, 3, 4}) {
+      REQUIRE(parallel_checksum<CRCTable<>>(buffer.data(), buffer.size(), workers) == expected.get());
+      REQUIRE(parallel_checksum<CRCDefault>(buffer.data(), 1000, workers) == parallel_checksum<CRCTable<>>(buffer.data(), 1000, 1));
+    }
+  }
+}
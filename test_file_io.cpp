@@ -0,0 +1,267 @@
+#include <catch_amalgamated.hpp>
+#include <filesystem>
+
+#include "fmt/format.h"
+#include "tsdb/file_io.h"
+#include "tsdb/series.h"
+using namespace tsdb;
+using namespace tsdb::literals;
+
+static std::string temp_image_path(const std::string& name) {
+  auto path = std::filesystem::temp_directory_path() / fmt::format("tsdb_{}_{}.img", name, getpid());
+  std::filesystem::remove(path);
+  return path.string();
+}
+
+TEST_CASE("file io") {
+  auto path = temp_image_path("file_io");
+  auto direct = GENERATE(false, true);
+  FileSectorIOConfig cfg{.direct = direct, .n_sectors = 64};
+
+  std::unique_ptr<FileSectorIO> io;
+  try {
+    io = std::make_unique<FileSectorIO>(path, cfg);
+  } catch (const IOError& e) {
+    // O_DIRECT is not supported by every file system (e.g. tmpfs).
+    REQUIRE(direct);
+    WARN("O_DIRECT unavailable: " << e.what());
+    return;
+  }
+
+  SECTION("sector number") {
+    REQUIRE(io->n_sectors() == 64);
+  }
+
+  SECTION("write and read back, aligned and unaligned buffers") {
+    std::vector<uint8_t> data(sector_size * 3 + 1);
+    for (int i = 0; i < data.size(); ++i) {
+      data[i] = i * 13;
+    }
+    // Offset by one byte to exercise the bounce buffer in direct mode.
+    io->write_sectors(data.data() + 1, 5, 3);
+
+    std::vector<uint8_t> out(sector_size * 3 + 1);
+    io->read_sectors(out.data() + 1, 5, 3);
+    REQUIRE(memcmp(out.data() + 1, data.data() + 1, sector_size * 3) == 0);
+
+    std::array<uint8_t, sector_size + 100> partial{};
+    io->read_bytes_from_sectors(partial.data(), partial.size(), 5);
+    REQUIRE(memcmp(partial.data(), data.data() + 1, partial.size()) == 0);
+  }
+
+  SECTION("vectored io merges adjacent segments") {
+    alignas(4096) std::array<uint8_t, sector_size * 2> a{};
+    alignas(4096) std::array<uint8_t, sector_size> b{};
+    memset(a.data(), 0x11, a.size());
+    memset(b.data(), 0x22, b.size());
+    std::array<WriteSegment, 3> writes{{{a.data(), 0, 2}, {b.data(), 2, 1}, {b.data(), 10, 1}}};
+    io->writev_sectors(writes);
+
+    alignas(4096) std::array<uint8_t, sector_size * 4> out{};
+    std::array<ReadSegment, 2> reads{{{out.data(), 0, 3}, {out.data() + sector_size * 3, 10, 1}}};
+    io->readv_sectors(reads);
+    REQUIRE(memcmp(out.data(), a.data(), a.size()) == 0);
+    REQUIRE(memcmp(out.data() + sector_size * 2, b.data(), b.size()) == 0);
+    REQUIRE(memcmp(out.data() + sector_size * 3, b.data(), b.size()) == 0);
+  }
+
+  SECTION("error cases") {
+    std::vector<uint8_t> buf(sector_size * 65);
+    REQUIRE_THROWS_AS(io->write_sectors(buf.data(), 0, 65), IOError);
+    REQUIRE_THROWS_AS(io->read_sectors(buf.data(), 60, 5), IOError);
+  }
+
+  SECTION("bad alignment") {
+    for (uint32_t alignment : {3u, 384u, 2 * sector_size}) {
+      REQUIRE_THROWS_AS(FileSectorIO(path, {.direct = direct, .alignment = alignment}), Error);
+    }
+    FileSectorIO aligned{path, {.direct = direct, .alignment = 64}};
+  }
+
+  io.reset();
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("series on file io survives reopen") {
+  auto path = temp_image_path("series");
+  auto partition = Partition::create(0, 256);
+  {
+    FileSectorIO io{path, {.n_sectors = 256}};
+    Series series{io, partition, SeriesConfig{50, 4_kb}};
+    for (int i = 0; i < 30; ++i) {
+      std::string data = fmt::format("entry {}", i);
+      series.insert(data.data(), data.size(), 0, i + 1);
+    }
+    series.sync();
+    // One header sector filled up, plus the explicit sync.
+    REQUIRE(io.sync_count() == 2);
+  }
+  {
+    FileSectorIO io{path};
+    REQUIRE(io.n_sectors() == 256);
+    Series series{io, partition, SeriesConfig{50, 4_kb}};
+    int count = 0;
+    series.iterate(
+        [&](auto& data_log_entry) {
+          std::string recv;
+          recv.resize(data_log_entry.log_entry.size);
+          data_log_entry.read(recv.data(), recv.size());
+          REQUIRE(recv == fmt::format("entry {}", count));
+          REQUIRE(data_log_entry.get_accumulated_crc() == data_log_entry.log_entry.checksum);
+          count++;
+          return true;
+        },
+        false);
+    REQUIRE(count == 30);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("file io insert throughput and latency", "[.][benchmark]") {
+  // Point TSDB_BENCH_FILE at a file on the storage under test (or a block device, careful: it is overwritten).
+  auto env = getenv("TSDB_BENCH_FILE");
+  auto path = env ? std::string(env) : temp_image_path("bench");
+  const uint32_t n_sectors = 64 * 1024;
+
+  for (auto [direct, policy] : {std::pair{false, SyncPolicy::never}, {false, SyncPolicy::on_flush}, {true, SyncPolicy::never}, {true, SyncPolicy::on_flush}}) {
+    std::unique_ptr<FileSectorIO> io;
+    try {
+      io = std::make_unique<FileSectorIO>(path, FileSectorIOConfig{.direct = direct, .sync_policy = policy, .n_sectors = n_sectors});
+    } catch (const IOError& e) {
+      fmt::print("skipping direct={}: {}\n", direct, e.what());
+      continue;
+    }
+    Series series{*io, Partition::create(0, n_sectors), SeriesConfig{2000, 64_kb}};
+    series.clear();
+
+    for (uint32_t size : {512u, 4096u, 65536u}) {
+      std::vector<uint8_t> data(size, 0xab);
+      std::vector<double> latencies_us;
+      auto begin = std::chrono::steady_clock::now();
+      for (int i = 0; i < 500; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        series.insert(data.data(), data.size());
+        latencies_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+      }
+      auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+      std::sort(latencies_us.begin(), latencies_us.end());
+      fmt::print("direct={:d} sync={:d} {:>6} B: {:8.1f} MB/s, p50 {:7.1f} us, p99 {:7.1f} us\n",
+                 direct,
+                 (int)policy,
+                 size,
+                 500.0 * size / elapsed / (1 << 20),
+                 latencies_us[latencies_us.size() / 2],
+                 latencies_us[latencies_us.size() * 99 / 100]);
+    }
+  }
+  if (!env) {
+    std::filesystem::remove(path);
+  }
+}
+
+TEST_CASE("series on 4 KiB file io") {
+  using IO4K = BasicFileSectorIO<4096>;
+  auto path = temp_image_path("series_4k");
+  auto partition = Partition::create_with_size<4096>(0, 1_mb);
+  auto direct = GENERATE(false, true);
+  {
+    std::unique_ptr<IO4K> io;
+    try {
+      io = std::make_unique<IO4K>(path, FileSectorIOConfig{.direct = direct, .n_sectors = partition.n_sectors});
+    } catch (const IOError& e) {
+      REQUIRE(direct);
+      WARN("O_DIRECT unavailable: " << e.what());
+      return;
+    }
+    REQUIRE(std::filesystem::file_size(path) == 1_mb);
+    Series series{*io, partition, SeriesConfig{300, 16_kb}};
+    for (int i = 0; i < 100; ++i) {
+      std::string data = fmt::format("entry {}", i);
+      data.resize(1 + i * 97 % 9000, 'x');
+      series.insert(data.data(), data.size(), 0, i + 1);
+    }
+    series.sync();
+    // 170 entries per header sector: only the explicit sync wrote it.
+    REQUIRE(io->sync_count() == 1);
+  }
+  {
+    IO4K io{path, {.direct = direct}};
+    Series series{io, partition, SeriesConfig{300, 16_kb}};
+    int count = 0;
+    series.iterate(
+        [&](auto& data_log_entry) {
+          std::string expected = fmt::format("entry {}", count);
+          expected.resize(1 + count * 97 % 9000, 'x');
+          std::string recv(data_log_entry.log_entry.size, '\0');
+          data_log_entry.read(recv.data(), recv.size());
+          REQUIRE(recv == expected);
+          REQUIRE(data_log_entry.get_accumulated_crc() == data_log_entry.log_entry.checksum);
+          count++;
+          return true;
+        },
+        false);
+    REQUIRE(count == 100);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("entry reader throughput", "[.][benchmark]") {
+  auto env = getenv("TSDB_BENCH_FILE");
+  auto path = env ? std::string(env) : temp_image_path("bench_reader");
+  const uint32_t n_sectors = 16 * 1024;
+  const uint32_t entry_size = 2_mb;
+
+  for (auto direct : {false, true}) {
+    std::unique_ptr<FileSectorIO> io;
+    try {
+      io = std::make_unique<FileSectorIO>(path, FileSectorIOConfig{.direct = direct, .n_sectors = n_sectors});
+    } catch (const IOError& e) {
+      fmt::print("skipping direct={}: {}\n", direct, e.what());
+      continue;
+    }
+    // A fast crc, so the numbers are about the reads.
+    Series<FileSectorIO, CRCTable<>> series{*io, Partition::create(0, n_sectors), SeriesConfig{100, entry_size}};
+    series.clear();
+    std::vector<uint8_t> data(entry_size, 0xab);
+    for (int i = 0; i < 4; ++i) {
+      series.insert(data.data(), data.size());
+    }
+
+    auto measure = [&](const char* name, uint32_t chunk, const auto& read_entry) {
+      std::vector<uint8_t> buf(chunk);
+      size_t total = 0;
+      auto begin = std::chrono::steady_clock::now();
+      series.iterate([&](auto& data_log_entry) {
+        total += read_entry(data_log_entry, buf);
+        return true;
+      });
+      auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+      fmt::print("direct={:d} {:<12} {:>6} B chunks: {:8.1f} MB/s\n", direct, name, chunk, total / elapsed / (1 << 20));
+    };
+
+    for (uint32_t chunk : {512u, 4096u, 65536u}) {
+      measure("read", chunk, [](auto& data_log_entry, auto& buf) {
+        size_t total = 0;
+        while (auto n = data_log_entry.read(buf.data(), buf.size())) {
+          total += n;
+        }
+        return total;
+      });
+    }
+    for (uint32_t window_sectors : {16u, 128u}) {
+      for (uint32_t chunk : {100u, 512u, 4096u, 65536u}) {
+        measure(window_sectors == 16 ? "reader 8k" : "reader 64k", chunk, [&](auto& data_log_entry, auto& buf) {
+          Series<FileSectorIO, CRCTable<>>::EntryReader reader{data_log_entry, window_sectors};
+          size_t total = 0;
+          while (auto n = reader.read(buf.data(), buf.size())) {
+            total += n;
+          }
+          return total;
+        });
+      }
+    }
+  }
+  if (!env) {
+    std::filesystem::remove(path);
+  }
+}
@@ -3,6 +3,11 @@
 //
 
 #include <catch_amalgamated.hpp>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+#include "fmt/format.h"
 
 #include "tsdb/header_sectors_manager.h"
 #include "tsdb/io.h"
@@ -167,4 +172,351 @@ TEST_CASE("clear header sector managers") {
     HeaderSectorsManager hsm{io, 0, 3, 1000};
     REQUIRE(hsm.get_entries().size() == 0);
   }
-}
\ No newline at end of file
+}
+/// Counts device calls that reach the header sectors.
+struct HeaderCountingIO : IO<HeaderCountingIO> {
+  explicit HeaderCountingIO(uint32_t n_sectors, uint32_t n_header_sectors) : mem(n_sectors), n_header_sectors(n_header_sectors) {}
+
+  SectorMemoryIO mem;
+  uint32_t n_header_sectors;
+  size_t n_header_calls{0};
+  size_t n_calls{0};
+  // Writes of the last sector, where the checkpoint lives.
+  size_t n_last_sector_writes{0};
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    n_header_calls += begin_sector < n_header_sectors;
+    n_last_sector_writes += begin_sector + n_sector == mem.n_sectors();
+    n_calls++;
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    n_header_calls += begin_sector < n_header_sectors;
+    n_calls++;
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
+
+TEST_CASE("header index matches the entries on the device") {
+  uint32_t n_header_sectors = GENERATE(1, 2, 5);
+  int repetitions = GENERATE(5, 100, 3000);
+  HeaderCountingIO io{256, n_header_sectors};
+  HeaderSectorsManager hsm{io, 0, n_header_sectors, 256};
+
+  for (int i = 0; i < repetitions; ++i) {
+    hsm.add_log(1 + (i * 7919) % 9000, i, i + 1);
+  }
+  hsm.sync_current_sector();
+
+  io.n_header_calls = 0;
+  auto entries = hsm.get_entries(false);
+  REQUIRE(io.n_header_calls == 0);
+  REQUIRE(!entries.empty());
+  REQUIRE(entries.back().checksum == repetitions - 1);
+  for (size_t i = 1; i < entries.size(); ++i) {
+    REQUIRE(entries[i - 1].timestamp < entries[i].timestamp);
+    REQUIRE(!is_overlapping(entries[i - 1], entries[i]));
+  }
+
+  HeaderSectorsManager reloaded{io, 0, n_header_sectors, 256};
+  REQUIRE(reloaded.get_entries(false) == entries);
+  REQUIRE(reloaded.get_entries(true, 50, 60) == hsm.get_entries(true, 50, 60));
+}
+
+TEST_CASE("time range lookup") {
+  HeaderCountingIO io{4096, 500};
+  HeaderSectorsManager hsm{io, 0, 500, 4096};
+  const int n = 10000;
+  for (int i = 0; i < n; ++i) {
+    // Runs of equal timestamps
+    hsm.add_log(100, i, 1000 + i / 3);
+  }
+
+  auto all = hsm.get_entries(false);
+  auto filtered = [&](uint64_t after, uint64_t before, bool descending) {
+    std::vector<LogEntry> expected;
+    for (auto& e : all) {
+      if ((after == 0 || e.timestamp >= after) && (before == 0 || e.timestamp < before)) {
+        expected.push_back(e);
+      }
+    }
+    if (descending) {
+      std::reverse(expected.begin(), expected.end());
+    }
+    return expected;
+  };
+
+  io.n_header_calls = 0;
+  for (uint64_t after : {0, 1, 1000, 2500, 3000, 4332, 4333, 9000}) {
+    for (uint64_t before : {0, 1, 1001, 2500, 2501, 4333, 9000}) {
+      for (bool descending : {false, true}) {
+        REQUIRE(hsm.get_entries(descending, after, before) == filtered(after, before, descending));
+      }
+    }
+  }
+  REQUIRE(io.n_header_calls == 0);
+
+  SECTION("timestamps stay monotonic after reload") {
+    hsm.sync_current_sector();
+    HeaderSectorsManager reloaded{io, 0, 500, 4096};
+    reloaded.add_log(100, 0xaa, 1);
+    auto entries = reloaded.get_entries();
+    REQUIRE(entries[0].checksum == 0xaa);
+    REQUIRE(entries[0].timestamp >= entries[1].timestamp);
+    REQUIRE(reloaded.get_entries(true, entries[0].timestamp).front().checksum == 0xaa);
+  }
+}
+
+TEST_CASE("init reads the header sectors in one request") {
+  HeaderCountingIO io{2048, 100};
+  {
+    HeaderSectorsManager hsm{io, 0, 100, 2048};
+    for (int i = 0; i < 1000; ++i) {
+      hsm.add_log(600, i, i + 1);
+    }
+    hsm.sync_current_sector();
+  }
+  // Corrupt a header sector past the written ones, it is cleared on load.
+  uint8_t garbage[sector_size];
+  memset(garbage, 0x5a, sizeof(garbage));
+  io.mem.write_sectors(garbage, 80, 1);
+
+  io.n_header_calls = 0;
+  HeaderSectorsManager hsm{io, 0, 100, 2048};
+  REQUIRE(io.n_header_calls == 2);
+
+  HeaderSector sector;
+  io.mem.read_sectors(&sector, 80, 1);
+  REQUIRE(sector.check_crc<CRCDefault>());
+  REQUIRE(sector.find_empty_slot() == 0);
+
+  auto entries = hsm.get_entries();
+  REQUIRE(entries.front().checksum == 999);
+  REQUIRE(entries == HeaderSectorsManager{io, 0, 100, 2048}.get_entries());
+}
+
+TEST_CASE("header sectors manager startup", "[.][benchmark]") {
+  for (bool checkpoint : {false, true}) {
+    for (uint32_t max_entries : {1000, 10000, 100000, 1000000}) {
+      uint32_t n_header_sectors = max_entries / HeaderSector::n_entries + 1;
+      uint32_t n_total_sectors = n_header_sectors + 4096;
+      HeaderCountingIO io{n_total_sectors, n_header_sectors};
+      {
+        HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total_sectors, checkpoint};
+        for (uint32_t i = 0; i < max_entries; ++i) {
+          hsm.add_log(100, i, i + 1);
+        }
+        hsm.sync_current_sector();
+      }
+
+      io.n_calls = 0;
+      auto begin = std::chrono::steady_clock::now();
+      HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total_sectors, checkpoint};
+      auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+      fmt::print("checkpoint {:d}, max_entries {:8}: {:5} header sectors, init {:8.2f} ms, {} IO calls\n",
+                 checkpoint,
+                 max_entries,
+                 n_header_sectors,
+                 elapsed,
+                 io.n_calls);
+    }
+  }
+}
+
+TEST_CASE("restart from checkpoint") {
+  uint32_t n_header_sectors = GENERATE(1, 3);
+  int repetitions = GENERATE(0, 20, 21, 63, 64, 500);
+  const uint32_t n_total = 200;
+  HeaderCountingIO io{n_total, n_header_sectors};
+  std::vector<LogEntry> expected;
+  {
+    HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total, true};
+    for (int i = 0; i < repetitions; ++i) {
+      hsm.add_log(1 + (i * 331) % 3000, i, i + 1);
+    }
+    hsm.sync_current_sector();
+    expected = hsm.get_entries(false);
+  }
+
+  SECTION("clean restart reads the checkpoint and the head sector") {
+    io.n_calls = 0;
+    HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total, true};
+    REQUIRE(io.n_calls == 2);
+    REQUIRE(hsm.get_entries(false) == expected);
+  }
+
+  SECTION("continues exactly like a restart from a full scan") {
+    HeaderCountingIO scanned_io{n_total, n_header_sectors};
+    scanned_io.mem.mem = io.mem.mem;
+    // Corrupt the checkpoint of the copy to force the scan.
+    scanned_io.mem.mem[n_total - 1][20] ^= 0xff;
+
+    HeaderSectorsManager from_checkpoint{io, 0, n_header_sectors, n_total, true};
+    HeaderSectorsManager from_scan{scanned_io, 0, n_header_sectors, n_total, true};
+    REQUIRE(scanned_io.n_calls > 2);
+    for (int i = 0; i < 50; ++i) {
+      from_checkpoint.add_log(700, 1000 + i, 1);
+      from_scan.add_log(700, 1000 + i, 1);
+    }
+    from_checkpoint.sync_current_sector();
+    from_scan.sync_current_sector();
+    REQUIRE(from_checkpoint.get_entries() == from_scan.get_entries());
+    REQUIRE(std::equal(io.mem.mem.begin(), io.mem.mem.end() - 1, scanned_io.mem.mem.begin()));
+  }
+
+  SECTION("stale checkpoint falls back to the scan") {
+    auto old_checkpoint = io.mem.mem[n_total - 1];
+    {
+      HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total, true};
+      hsm.add_log(100, 0xaa, 1);
+      hsm.sync_current_sector();
+      expected = hsm.get_entries(false);
+    }
+    io.mem.mem[n_total - 1] = old_checkpoint;
+
+    io.n_calls = 0;
+    HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total, true};
+    REQUIRE(io.n_calls > 2);
+    REQUIRE(hsm.get_entries(false) == expected);
+    REQUIRE(expected.back().checksum == 0xaa);
+  }
+
+  SECTION("clear") {
+    {
+      HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total, true};
+      hsm.clear();
+    }
+    io.n_calls = 0;
+    HeaderSectorsManager hsm{io, 0, n_header_sectors, n_total, true};
+    REQUIRE(io.n_calls == 2);
+    REQUIRE(hsm.get_entries().empty());
+  }
+}
+
+TEST_CASE("checkpoint is written periodically") {
+  using HSM = HeaderSectorsManager<HeaderCountingIO>;
+  const uint32_t n_total = 200;
+  const uint32_t n_entries = HSM::HeaderSector::n_entries;
+  HeaderCountingIO io{n_total, 2};
+  auto hsm = std::make_unique<HSM>(io, 0, 2, n_total, true);
+  io.n_last_sector_writes = 0;
+  auto n_header_writes = hsm->header_write_count();
+  for (int i = 0; i < 500; ++i) {
+    hsm->add_log(1 + (i * 331) % 3000, i, i + 1);
+  }
+  auto n_written = hsm->header_write_count() - n_header_writes;
+  REQUIRE(n_written >= 500 / n_entries);
+  REQUIRE(io.n_last_sector_writes <= n_written / HSM::checkpoint_interval);
+
+  // Power loss: the device keeps what was written so far.
+  auto restart_after_crash = [&](HeaderCountingIO& crashed_io) {
+    crashed_io.mem.mem = io.mem.mem;
+    return std::make_unique<HSM>(crashed_io, 0, 2, n_total, true);
+  };
+
+  SECTION("syncing every insert writes it only when due") {
+    io.n_last_sector_writes = 0;
+    n_header_writes = hsm->header_write_count();
+    for (uint32_t i = 0; i < 4 * HSM::checkpoint_interval; ++i) {
+      hsm->add_log(100, i, 1);
+      hsm->sync_current_sector();
+    }
+    n_written = hsm->header_write_count() - n_header_writes;
+    REQUIRE(io.n_last_sector_writes >= 1);
+    REQUIRE(io.n_last_sector_writes <= n_written / HSM::checkpoint_interval);
+
+    HeaderCountingIO crashed_io{n_total, 2};
+    auto restarted = restart_after_crash(crashed_io);
+    REQUIRE(restarted->get_entries(false) == hsm->get_entries(false));
+  }
+
+  SECTION("clear writes it once") {
+    io.n_last_sector_writes = 0;
+    hsm->clear();
+    REQUIRE(io.n_last_sector_writes == 1);
+    io.n_calls = 0;
+    HSM restarted{io, 0, 2, n_total, true};
+    REQUIRE(io.n_calls == 2);
+    REQUIRE(restarted.get_entries(false).empty());
+  }
+
+  SECTION("a crash between checkpoints falls back to the scan") {
+    hsm->add_log(100, 0xaa, 1);
+    hsm->sync_current_sector();
+    // Fills two sectors: two header writes, fewer than the interval.
+    for (uint32_t i = 0; i < 2 * n_entries; ++i) {
+      hsm->add_log(100, 0xbb, 1);
+    }
+    HeaderCountingIO crashed_io{n_total, 2};
+    auto restarted = restart_after_crash(crashed_io);
+    REQUIRE(crashed_io.n_calls > 2);
+    auto entries = restarted->get_entries(false);
+    REQUIRE(std::count_if(entries.begin(), entries.end(), [](auto& e) { return e.checksum == 0xaa; }) == 1);
+    REQUIRE(std::count_if(entries.begin(), entries.end(), [](auto& e) { return e.checksum == 0xbb; }) >= n_entries);
+  }
+
+  SECTION("clean shutdown writes it") {
+    hsm->add_log(100, 0xaa, 1);
+    hsm.reset();
+
+    // Same state as found by a full scan.
+    HeaderCountingIO scanned_io{n_total, 2};
+    scanned_io.mem.mem = io.mem.mem;
+    scanned_io.mem.mem[n_total - 1][20] ^= 0xff;
+    HSM from_scan{scanned_io, 0, 2, n_total, true};
+
+    io.n_calls = 0;
+    HSM restarted{io, 0, 2, n_total, true};
+    REQUIRE(io.n_calls == 2);
+    REQUIRE(restarted.get_entries(false) == from_scan.get_entries(false));
+  }
+}
+
+/// Records the sector of every write, and which of them were named by order_last_writes().
+struct OrderRecordingIO : IO<OrderRecordingIO> {
+  explicit OrderRecordingIO(uint32_t n_sectors) : mem(n_sectors) {}
+
+  SectorMemoryIO mem;
+  std::vector<uint32_t> writes;
+  // First sector of the writes each order_last_writes() call covers.
+  std::vector<uint32_t> ordered_first;
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    writes.push_back(begin_sector);
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  void order_last_writes(uint32_t n) {
+    REQUIRE(n <= writes.size());
+    ordered_first.push_back(writes[writes.size() - n]);
+    // Everything after the first ordered write is header or checkpoint.
+    for (auto i = writes.size() - n; i < writes.size(); ++i) {
+      REQUIRE((writes[i] < 2 || writes[i] == mem.n_sectors() - 1));
+    }
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
+
+TEST_CASE("header writes are ordered after the data they commit") {
+  bool use_checkpoint = GENERATE(false, true);
+  using HSM = HeaderSectorsManager<OrderRecordingIO>;
+  OrderRecordingIO io{200};
+  HSM hsm{io, 0, 2, 200, use_checkpoint};
+  for (int i = 0; i < 500; ++i) {
+    hsm.add_log(1 + (i * 331) % 3000, i, i + 1);
+  }
+  hsm.sync_current_sector();
+  REQUIRE(io.ordered_first.size() >= 500 / HSM::HeaderSector::n_entries);
+  for (auto sector : io.ordered_first) {
+    // The header sector itself, never the checkpoint behind it.
+    REQUIRE(sector < 2);
+  }
+}
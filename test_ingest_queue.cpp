@@ -0,0 +1,173 @@
+//
+// Lock-free ingest queue in front of a series.
+//
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "catch_amalgamated.hpp"
+#include "tsdb/ingest_queue.h"
+#include "tsdb/series.h"
+
+using namespace tsdb;
+using namespace tsdb::literals;
+
+// Writes wait while the gate is closed, which stalls the writer thread of the queue.
+struct GatedIO : IO<GatedIO> {
+  explicit GatedIO(uint32_t n_sectors) : mem(n_sectors) {}
+
+  SectorMemoryIO mem;
+  std::atomic<bool> open{true};
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    while (!open) {
+      std::this_thread::yield();
+    }
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
+
+// Records are their own id. Timestamps of concurrent producers arrive out of order and are made monotonic on insert, so
+// they do not identify a record.
+static std::set<uint64_t> ids_of(auto& series) {
+  std::set<uint64_t> ids;
+  series.iterate([&](auto& data_log_entry) {
+    uint64_t id;
+    REQUIRE(data_log_entry.log_entry.size == sizeof(id));
+    data_log_entry.read(&id, sizeof(id));
+    ids.insert(id);
+    return true;
+  });
+  return ids;
+}
+
+// Close the gate and wait for the writer to take record 1 and get stuck writing it.
+static void stall_writer(GatedIO& io, auto& queue) {
+  io.open = false;
+  uint64_t ts = 1;
+  REQUIRE(queue.push(&ts, sizeof(ts), 0, ts));
+  while (queue.depth() != 0) {
+    std::this_thread::yield();
+  }
+}
+
+TEST_CASE("ingest queue") {
+  GatedIO io{4096};
+  Series series{io, Partition::create(0, 4096), SeriesConfig{2000, 4_kb}};
+
+  SECTION("records of concurrent producers are all written") {
+    IngestQueue queue{series, {.capacity = 64, .max_record_size = 16}};
+    constexpr uint64_t n_producers = 4;
+    constexpr uint64_t n_per_producer = 250;
+    std::vector<std::thread> producers;
+    for (uint64_t p = 0; p < n_producers; ++p) {
+      producers.emplace_back([&, p] {
+        for (uint64_t i = 0; i < n_per_producer; ++i) {
+          uint64_t ts = 1 + p * n_per_producer + i;
+          queue.push(&ts, sizeof(ts), 0, ts);
+        }
+      });
+    }
+    for (auto& t : producers) {
+      t.join();
+    }
+    queue.sync();
+
+    auto stats = queue.stats();
+    REQUIRE(stats.pushed == n_producers * n_per_producer);
+    REQUIRE(stats.written == stats.pushed);
+    REQUIRE(stats.depth == 0);
+    REQUIRE(stats.dropped_oldest + stats.dropped_newest == 0);
+    auto ids = ids_of(series);
+    REQUIRE(ids.size() == n_producers * n_per_producer);
+    REQUIRE(*ids.begin() == 1);
+    REQUIRE(*ids.rbegin() == n_producers * n_per_producer);
+  }
+
+  SECTION("drop newest") {
+    IngestQueue queue{series, {.capacity = 8, .max_record_size = 16, .policy = BackPressure::drop_newest, .max_batch = 1}};
+    stall_writer(io, queue);
+    for (uint64_t ts = 2; ts <= 9; ++ts) {
+      REQUIRE(queue.push(&ts, sizeof(ts), 0, ts));
+    }
+    for (uint64_t ts = 10; ts <= 20; ++ts) {
+      REQUIRE(!queue.push(&ts, sizeof(ts), 0, ts));
+    }
+    auto stats = queue.stats();
+    REQUIRE(stats.dropped_newest == 11);
+    REQUIRE(stats.depth == 8);
+
+    io.open = true;
+    queue.flush();
+    REQUIRE(queue.stats().written == 9);
+    auto ids = ids_of(series);
+    REQUIRE(ids.size() == 9);
+    REQUIRE(*ids.rbegin() == 9);
+  }
+
+  SECTION("drop oldest") {
+    IngestQueue queue{series, {.capacity = 8, .max_record_size = 16, .policy = BackPressure::drop_oldest, .max_batch = 1}};
+    stall_writer(io, queue);
+    for (uint64_t ts = 2; ts <= 40; ++ts) {
+      REQUIRE(queue.push(&ts, sizeof(ts), 0, ts));
+    }
+    auto stats = queue.stats();
+    REQUIRE(stats.pushed == 40);
+    REQUIRE(stats.depth == 8);
+    REQUIRE(stats.dropped_oldest == 31);
+
+    io.open = true;
+    queue.flush();
+    REQUIRE(queue.stats().written == 9);
+    // The record held by the writer, then the newest ones.
+    std::set<uint64_t> expected{1, 33, 34, 35, 36, 37, 38, 39, 40};
+    REQUIRE(ids_of(series) == expected);
+  }
+
+  SECTION("block") {
+    IngestQueue queue{series, {.capacity = 4, .max_record_size = 16, .policy = BackPressure::block, .max_batch = 2}};
+    io.open = false;
+    std::atomic<uint64_t> n_pushed{0};
+    std::thread producer([&] {
+      for (uint64_t ts = 1; ts <= 100; ++ts) {
+        queue.push(&ts, sizeof(ts), 0, ts);
+        n_pushed++;
+      }
+    });
+    while (queue.depth() < 4) {
+      std::this_thread::yield();
+    }
+    // The producer waits for room instead of dropping.
+    REQUIRE(n_pushed < 100);
+    io.open = true;
+    producer.join();
+    queue.flush();
+    REQUIRE(queue.stats().written == 100);
+    REQUIRE(ids_of(series).size() == 100);
+  }
+
+  SECTION("records too big are rejected") {
+    IngestQueue queue{series, {.capacity = 4, .max_record_size = 8}};
+    uint8_t data[9]{};
+    REQUIRE_THROWS_AS(queue.push(data, sizeof(data)), Error);
+    REQUIRE_THROWS_AS(queue.push(data, 8, LogEntry::attr_packed), Error);
+    REQUIRE(queue.push(data, 8));
+  }
+
+  SECTION("the destructor writes queued records") {
+    {
+      IngestQueue queue{series, {.capacity = 128, .max_record_size = 16}};
+      for (uint64_t ts = 1; ts <= 100; ++ts) {
+        queue.push(&ts, sizeof(ts), 0, ts);
+      }
+    }
+    REQUIRE(ids_of(series).size() == 100);
+  }
+}
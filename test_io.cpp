@@ -1,7 +1,60 @@
 #include <catch_amalgamated.hpp>
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <thread>
+
+#include "fmt/format.h"
 
 #include "tsdb/io.h"
+#include "tsdb/series.h"
 using namespace tsdb;
+using namespace tsdb::literals;
+
+/// Only implements the single-buffer calls, so the vectored calls fall back to the IO defaults.
+struct CountingIO : IO<CountingIO> {
+  explicit CountingIO(uint32_t n_sectors) : mem(n_sectors) {}
+
+  SectorMemoryIO mem;
+  size_t n_write_calls{0};
+  size_t n_read_calls{0};
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    n_write_calls++;
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    n_read_calls++;
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
+
+/// Counts batches submitted through the vectored calls.
+struct BatchCountingIO : IO<BatchCountingIO> {
+  explicit BatchCountingIO(uint32_t n_sectors) : mem(n_sectors) {}
+
+  SectorMemoryIO mem;
+  size_t n_device_calls{0};
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    n_device_calls++;
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  void writev_sectors(std::span<const WriteSegment> segments) {
+    n_device_calls++;
+    mem.writev_sectors(segments);
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
 TEST_CASE("io") {
   SectorMemoryIO io{32};
 
@@ -88,4 +141,183 @@ TEST_CASE("io") {
     REQUIRE_THROWS_AS(io.write_sectors(buf.data(), 0, 33), IOError);
     REQUIRE_THROWS_AS(io.read_sectors(buf.data(), 0, 33), IOError);
   }
-}
\ No newline at end of file
+}
+
+TEST_CASE("vectored io") {
+  SectorMemoryIO io{32};
+
+  std::array<uint8_t, sector_size * 2> a{};
+  std::array<uint8_t, sector_size> b{};
+  memset(a.data(), 0x11, a.size());
+  memset(b.data(), 0x22, b.size());
+
+  SECTION("write and read segments") {
+    std::array<WriteSegment, 2> writes{{{a.data(), 3, 2}, {b.data(), 10, 1}}};
+    io.writev_sectors(writes);
+    REQUIRE(memcmp(io.mem[3].data(), a.data(), sector_size) == 0);
+    REQUIRE(memcmp(io.mem[4].data(), a.data() + sector_size, sector_size) == 0);
+    REQUIRE(memcmp(io.mem[10].data(), b.data(), sector_size) == 0);
+
+    std::array<uint8_t, sector_size * 3> out{};
+    std::array<ReadSegment, 2> reads{{{out.data() + sector_size, 3, 2}, {out.data(), 10, 1}}};
+    io.readv_sectors(reads);
+    REQUIRE(memcmp(out.data(), b.data(), sector_size) == 0);
+    REQUIRE(memcmp(out.data() + sector_size, a.data(), a.size()) == 0);
+  }
+
+  SECTION("bad segment leaves batch unapplied") {
+    std::array<WriteSegment, 2> writes{{{a.data(), 0, 2}, {b.data(), 32, 1}}};
+    REQUIRE_THROWS_AS(io.writev_sectors(writes), IOError);
+    REQUIRE(io.mem[0] == SectorMemoryIO::SectorType{});
+  }
+
+  SECTION("default implementation loops over segments") {
+    CountingIO counting_io{32};
+    std::array<WriteSegment, 2> writes{{{a.data(), 3, 2}, {b.data(), 10, 1}}};
+    counting_io.writev_sectors(writes);
+    REQUIRE(counting_io.n_write_calls == 2);
+    REQUIRE(memcmp(counting_io.mem.mem[10].data(), b.data(), sector_size) == 0);
+
+    std::array<uint8_t, sector_size + 100> out{};
+    counting_io.read_bytes_from_sectors(out.data(), out.size(), 3);
+    REQUIRE(counting_io.n_read_calls == 2);
+    REQUIRE(memcmp(out.data(), a.data(), out.size()) == 0);
+  }
+
+  SECTION("insert submits data and header sector as one batch") {
+    BatchCountingIO batch_io{256};
+    Series series{batch_io, Partition::create(0, 256), SeriesConfig{HeaderSector::n_entries, 4_kb}};
+    std::string data = "hello, world";
+    for (int i = 0; i < HeaderSector::n_entries; ++i) {
+      series.insert(data.data(), data.size(), 0, i + 1);
+    }
+    // The last insert filled the header sector and flushed it together with its data.
+    REQUIRE(batch_io.n_device_calls == HeaderSector::n_entries);
+  }
+
+  SECTION("insert_batch writes the whole batch at once") {
+    BatchCountingIO batch_io{256};
+    Series series{batch_io, Partition::create(0, 256), SeriesConfig{2 * HeaderSector::n_entries, 4_kb}};
+    std::string data(700, 'x');
+    std::vector<Record> records(10, Record{data.data(), (uint32_t)data.size()});
+    series.insert_batch(records);
+    REQUIRE(batch_io.n_device_calls == 1);
+
+    // Filling the header sector flushes it with the data before it; the rest follows in a second batch.
+    batch_io.n_device_calls = 0;
+    records.resize(HeaderSector::n_entries, records[0]);
+    series.insert_batch(records);
+    REQUIRE(batch_io.n_device_calls == 2);
+  }
+}
+
+TEST_CASE("memory io concurrent writers") {
+  const uint32_t n_total = 3 * 4096;
+  SectorMemoryIO io{n_total};
+  constexpr int n_threads = 4;
+  // Every sector of a write holds its tag: writer in the high byte, sequence number below.
+  auto tag_of = [](const uint8_t* sector) {
+    uint32_t tag;
+    memcpy(&tag, sector, sizeof(tag));
+    return tag;
+  };
+  auto uniform = [&](const uint8_t* sector) {
+    auto tag = tag_of(sector);
+    for (size_t offset = 0; offset < sector_size; offset += sizeof(tag)) {
+      if (tag_of(sector + offset) != tag) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  std::atomic<size_t> n_torn{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      std::vector<uint32_t> data(sector_size / sizeof(uint32_t) * 200);
+      for (uint32_t i = 0; i < 300; ++i) {
+        // Overlapping ranges, up to 200 sectors long so they cross stripes, and starting at the same offsets of
+        // regions 4096 sectors apart, like the header sectors of equally sized partitions.
+        auto n_sector = 1 + rng() % 200;
+        auto begin = (rng() % 3) * 4096 + rng() % (4096 - n_sector);
+        if (i % 2) {
+          std::fill(data.begin(), data.begin() + n_sector * sector_size / sizeof(uint32_t), (uint32_t)t << 24 | i);
+          io.write_sectors(data.data(), begin, n_sector);
+        } else {
+          io.read_sectors(data.data(), begin, n_sector);
+          for (uint32_t s = 0; s < n_sector; ++s) {
+            n_torn += !uniform((const uint8_t*)data.data() + s * sector_size);
+          }
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  REQUIRE(n_torn == 0);
+  for (uint32_t s = 0; s < n_total; ++s) {
+    REQUIRE(uniform(io.mem[s].data()));
+  }
+}
+
+/// Baseline for the benchmark below: the previous single mutex around every access.
+struct GlobalLockMemoryIO : IO<GlobalLockMemoryIO> {
+  explicit GlobalLockMemoryIO(uint32_t n_sectors) : mem(n_sectors) {}
+
+  SectorMemoryIO mem;
+  std::mutex lock;
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    std::lock_guard g(lock);
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    std::lock_guard g(lock);
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
+
+template <typename TIO>
+static double multi_series_insert_rate(unsigned n_series) {
+  const uint32_t sectors_per_series = 4096;
+  TIO io{sectors_per_series * n_series};
+  // Hardware crc so the checksum does not hide the IO cost.
+  using SeriesType = Series<TIO, CRCClmul>;
+  std::vector<std::unique_ptr<SeriesType>> series;
+  for (unsigned i = 0; i < n_series; ++i) {
+    series.push_back(std::make_unique<SeriesType>(io, Partition::create(i * sectors_per_series, sectors_per_series), SeriesConfig{200, 64_kb}));
+  }
+
+  const int n_inserts = 20000;
+  std::vector<std::thread> threads;
+  auto begin = std::chrono::steady_clock::now();
+  for (auto& s : series) {
+    threads.emplace_back([&s] {
+      std::vector<uint8_t> data(16_kb, 0x3c);
+      for (int i = 0; i < n_inserts; ++i) {
+        s->insert(data.data(), data.size());
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  return n_inserts * n_series / elapsed;
+}
+
+TEST_CASE("memory io multi-series scaling", "[.][benchmark]") {
+  for (unsigned n_series : {1, 2, 4, 8}) {
+    fmt::print("{} series: striped {:10.0f} inserts/s | single lock {:10.0f} inserts/s\n",
+               n_series,
+               multi_series_insert_rate<SectorMemoryIO>(n_series),
+               multi_series_insert_rate<GlobalLockMemoryIO>(n_series));
+  }
+}
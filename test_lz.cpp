@@ -0,0 +1,256 @@
+//
+// LZ block compression and compressed series entries.
+//
+#include <memory>
+#include <random>
+#include <string>
+
+#include "catch_amalgamated.hpp"
+#include "fmt/format.h"
+#include "tsdb/lz.h"
+#include "tsdb/series.h"
+
+using namespace tsdb;
+using namespace tsdb::literals;
+
+static std::string json_line(int i) {
+  return fmt::format(R"({{"ts":{},"device":"sensor-{}","level":"info","temperature":{:.2f},"humidity":{},"msg":"periodic report"}})",
+                     1700000000 + i, i % 8, 20 + (i % 37) * 0.25, 40 + i % 13) +
+         "\n";
+}
+
+static std::vector<uint8_t> json_payload(int seed, size_t min_size) {
+  std::string s;
+  for (int i = seed; s.size() < min_size; ++i) {
+    s += json_line(i);
+  }
+  return {s.begin(), s.end()};
+}
+
+static size_t require_round_trip(const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> compressed(data.size() + data.size() / 255 + 16);
+  auto len = lz::compress(data.data(), data.size(), compressed.data(), compressed.size());
+  REQUIRE(len > 0);
+  std::vector<uint8_t> out(data.size());
+  lz::decompress({compressed.data(), len}, out.data(), out.size());
+  REQUIRE(out == data);
+  return len;
+}
+
+TEST_CASE("lz round trip") {
+  SECTION("tiny inputs are literals only") {
+    for (size_t n = 1; n < 16; ++n) {
+      require_round_trip(std::vector<uint8_t>(n, 'a'));
+    }
+  }
+
+  SECTION("random data") {
+    std::mt19937 rng(1);
+    std::vector<uint8_t> data(100000);
+    for (auto& b : data) {
+      b = rng();
+    }
+    require_round_trip(data);
+    // Not compressible: does not fit its own size.
+    std::vector<uint8_t> out(data.size());
+    REQUIRE(lz::compress(data.data(), data.size(), out.data(), out.size()) == 0);
+  }
+
+  SECTION("long runs") {
+    std::vector<uint8_t> data(200000, 0x11);
+    auto len = require_round_trip(data);
+    REQUIRE(len < 1000);
+  }
+
+  SECTION("text") {
+    auto data = json_payload(0, 64_kb);
+    auto len = require_round_trip(data);
+    INFO("ratio " << double(data.size()) / len);
+    REQUIRE(data.size() >= 3 * len);
+  }
+
+  SECTION("matches farther than the window are not used") {
+    std::mt19937 rng(2);
+    std::vector<uint8_t> data(200000);
+    for (auto& b : data) {
+      b = rng() % 4;
+    }
+    require_round_trip(data);
+  }
+}
+
+TEST_CASE("lz streaming decode") {
+  auto data = json_payload(0, 100000);
+  std::vector<uint8_t> compressed(data.size());
+  auto len = lz::compress(data.data(), data.size(), compressed.data(), compressed.size());
+  REQUIRE(len > 0);
+
+  for (auto [in_piece, out_piece] : {std::pair{1, 1}, {7, 512}, {4096, 3}, {100000, 100000}}) {
+    lz::StreamDecoder decoder(data.size());
+    std::vector<uint8_t> out;
+    std::vector<uint8_t> buf(out_piece);
+    size_t consumed = 0;
+    while (!decoder.done()) {
+      auto n = std::min<size_t>(in_piece, len - consumed);
+      std::span<const uint8_t> in{compressed.data() + consumed, n};
+      do {
+        auto produced = decoder.decode(in, buf.data(), buf.size());
+        out.insert(out.end(), buf.begin(), buf.begin() + produced);
+      } while (!in.empty() && !decoder.done());
+      consumed += n;
+      REQUIRE(consumed <= len);
+    }
+    REQUIRE(consumed == len);
+    REQUIRE(out == data);
+  }
+}
+
+TEST_CASE("lz scratch reuse") {
+  auto text = json_payload(0, 20000);
+  std::vector<uint8_t> noise(20000);
+  std::mt19937 rng(2);
+  for (auto& b : noise) {
+    b = rng();
+  }
+  std::vector<uint8_t> text_out(text.size());
+  std::vector<uint8_t> noise_out(noise.size() * 2);
+
+  // The table left by a previous input must not produce matches into the next one.
+  auto scratch = std::make_unique<lz::CompressScratch>();
+  auto text_len = lz::compress(text.data(), text.size(), text_out.data(), text_out.size(), *scratch);
+  auto noise_len = lz::compress(noise.data(), noise.size(), noise_out.data(), noise_out.size(), *scratch);
+  REQUIRE(text_len == lz::compress(text.data(), text.size(), text_out.data(), text_out.size()));
+  REQUIRE(text_len > 0);
+  REQUIRE(noise_len > 0);
+
+  lz::StreamDecoder decoder(text.size());
+  for (int round = 0; round < 2; ++round) {
+    std::vector<uint8_t> out(text.size());
+    std::span<const uint8_t> in{text_out.data(), text_len};
+    REQUIRE(decoder.decode(in, out.data(), out.size()) == text.size());
+    REQUIRE(out == text);
+
+    decoder.reset(noise.size());
+    out.resize(noise.size());
+    in = {noise_out.data(), noise_len};
+    REQUIRE(decoder.decode(in, out.data(), out.size()) == noise.size());
+    REQUIRE(out == noise);
+    decoder.reset(text.size());
+  }
+}
+
+TEST_CASE("lz corrupted input") {
+  auto data = json_payload(0, 10000);
+  std::vector<uint8_t> compressed(data.size());
+  auto len = lz::compress(data.data(), data.size(), compressed.data(), compressed.size());
+  std::vector<uint8_t> out(data.size());
+
+  // Truncated
+  REQUIRE_THROWS_AS(lz::decompress({compressed.data(), len / 2}, out.data(), out.size()), CorruptedDataError);
+  // Trailing garbage
+  compressed[len] = 0;
+  REQUIRE_THROWS_AS(lz::decompress({compressed.data(), len + 1}, out.data(), out.size()), CorruptedDataError);
+  // A match reaching before the beginning of the block
+  std::vector<uint8_t> bad{0x10, 'a', 0x10, 0x00, 0x00};
+  REQUIRE_THROWS_AS(lz::decompress(bad, out.data(), 10), CorruptedDataError);
+}
+
+TEST_CASE("compressed entries") {
+  SectorMemoryIO io{4096};
+  auto partition = Partition::create(0, 4096);
+  SeriesConfig cfg{200, 64_kb};
+  cfg.compress = true;
+  const int n_entries = 50;
+
+  size_t raw_bytes = 0;
+  std::mt19937 rng(3);
+  std::vector<uint8_t> noise(3000);
+  for (auto& b : noise) {
+    b = rng();
+  }
+  {
+    Series series{io, partition, cfg};
+    for (int i = 0; i < n_entries; ++i) {
+      auto payload = json_payload(i * 100, 1000 + i * 700);
+      raw_bytes += payload.size();
+      series.insert(payload.data(), payload.size(), 3, 1000 + i);
+    }
+    // Not worth compressing, stored as is.
+    series.insert(noise.data(), noise.size(), 4, 1000 + n_entries);
+    series.sync();
+  }
+
+  Series series{io, partition, cfg};
+  size_t stored_bytes = 0;
+  int i = 0;
+  std::vector<uint8_t> recv;
+  series.iterate(
+      [&](auto& data_log_entry) {
+        auto& entry = data_log_entry.log_entry;
+        auto expected = i < n_entries ? json_payload(i * 100, 1000 + i * 700) : noise;
+        REQUIRE(bool(entry.attr & LogEntry::attr_compressed) == (i < n_entries));
+        REQUIRE(data_log_entry.size() == expected.size());
+        if (i < n_entries) {
+          stored_bytes += entry.size;
+        }
+
+        // Read in sector sized chunks, as for an uncompressed entry.
+        recv.resize(data_log_entry.size());
+        uint32_t offset = 0;
+        while (auto n = data_log_entry.read(recv.data() + offset, std::min<uint32_t>(sector_size, recv.size() - offset))) {
+          offset += n;
+        }
+        REQUIRE(offset == expected.size());
+        REQUIRE(recv == expected);
+        REQUIRE(data_log_entry.get_accumulated_crc() == entry.checksum);
+        i++;
+        return true;
+      },
+      false);
+  REQUIRE(i == n_entries + 1);
+  INFO("ratio " << double(raw_bytes) / stored_bytes);
+  REQUIRE(raw_bytes >= 3 * stored_bytes);
+
+  SECTION("records") {
+    int n = 0;
+    series.iterate_records(
+        [&](const Record& r) {
+          if (n < n_entries) {
+            auto expected = json_payload(n * 100, 1000 + n * 700);
+            REQUIRE(r.attr == 3);
+            REQUIRE(std::equal(expected.begin(), expected.end(), (const uint8_t*)r.data, (const uint8_t*)r.data + r.len));
+          }
+          n++;
+          return true;
+        },
+        false);
+    REQUIRE(n == n_entries + 1);
+  }
+
+  SECTION("packed blocks") {
+    series.clear();
+    for (int j = 0; j < 1000; ++j) {
+      auto line = json_line(j);
+      series.insert_packed(line.data(), line.size(), 5000 + j);
+    }
+    series.sync();
+    size_t n_compressed = 0;
+    series.iterate([&](auto& data_log_entry) {
+      n_compressed += bool(data_log_entry.log_entry.attr & LogEntry::attr_compressed);
+      return true;
+    });
+    REQUIRE(n_compressed > 0);
+
+    int j = 0;
+    series.iterate_records(
+        [&](const Record& r) {
+          auto line = json_line(j);
+          REQUIRE(r.timestamp == 5000 + j);
+          REQUIRE(std::string((const char*)r.data, r.len) == line);
+          j++;
+          return true;
+        },
+        false);
+    REQUIRE(j == 1000);
+  }
+}
@@ -0,0 +1,157 @@
+#include <catch_amalgamated.hpp>
+#include <filesystem>
+#include <fstream>
+
+#include "fmt/format.h"
+#include "tsdb/mmap_io.h"
+#include "tsdb/series.h"
+using namespace tsdb;
+using namespace tsdb::literals;
+
+static_assert(MappedIO<MmapSectorIO>);
+static_assert(!MappedIO<SectorMemoryIO>);
+
+TEST_CASE("mmap io") {
+  auto path = (std::filesystem::temp_directory_path() / fmt::format("tsdb_mmap_{}.img", getpid())).string();
+  std::filesystem::remove(path);
+
+  SECTION("read, write and map") {
+    MmapSectorIO io{path, {.n_sectors = 32}};
+    REQUIRE(io.n_sectors() == 32);
+
+    std::array<uint8_t, sector_size * 2> data{};
+    memset(data.data(), 0x5c, data.size());
+    io.write_sectors(data.data(), 4, 2);
+
+    std::array<uint8_t, sector_size * 2> out{};
+    io.read_sectors(out.data(), 4, 2);
+    REQUIRE(out == data);
+
+    auto view = io.map_sectors(4, 2);
+    REQUIRE(memcmp(view.data(), data.data(), data.size()) == 0);
+
+    io.flush();
+    REQUIRE(io.sync_count() == 1);
+    // Nothing dirty, nothing to sync.
+    io.flush();
+    REQUIRE(io.sync_count() == 1);
+
+    REQUIRE_THROWS_AS(io.write_sectors(data.data(), 31, 2), IOError);
+    REQUIRE_THROWS_AS(io.map_sectors(32, 1), IOError);
+  }
+
+  SECTION("scattered writes") {
+    MmapSectorIO io{path, {.n_sectors = 64}};
+    std::array<uint8_t, sector_size> data{};
+    // More runs than are kept apart, some adjacent or overlapping.
+    for (uint32_t sector : {40, 0, 20, 21, 63, 5, 30, 50, 10, 45, 19, 35, 60, 2}) {
+      memset(data.data(), sector + 1, data.size());
+      io.write_sectors(data.data(), sector, 1);
+    }
+    io.flush();
+    REQUIRE(io.sync_count() == 1);
+    io.flush();
+    REQUIRE(io.sync_count() == 1);
+
+    std::ifstream file{path, std::ios::binary};
+    for (uint32_t sector : {0, 2, 19, 20, 21, 40, 63}) {
+      file.seekg((std::streamoff)sector * sector_size);
+      file.read((char*)data.data(), data.size());
+      REQUIRE(data[sector_size / 2] == sector + 1);
+    }
+  }
+
+  SECTION("read only mapping") {
+    {
+      MmapSectorIO io{path, {.n_sectors = 8}};
+      std::array<uint8_t, sector_size> data{};
+      memset(data.data(), 0x11, data.size());
+      io.write_sectors(data.data(), 1, 1);
+    }
+    MmapSectorIO io{path, {.read_only = true}};
+    REQUIRE(io.n_sectors() == 8);
+    REQUIRE(io.map_sectors(1, 1)[100] == 0x11);
+    std::array<uint8_t, sector_size> data{};
+    REQUIRE_THROWS_AS(io.write_sectors(data.data(), 1, 1), IOError);
+  }
+
+  SECTION("zero-copy iterate over a captured image") {
+    auto partition = Partition::create(0, 128);
+    {
+      MmapSectorIO io{path, {.n_sectors = 128}};
+      Series series{io, partition, SeriesConfig{40, 4_kb}};
+      for (int i = 0; i < 25; ++i) {
+        std::string data = fmt::format("sample {}", i);
+        series.insert(data.data(), data.size(), 0, i + 1);
+      }
+      series.sync();
+    }
+
+    MmapSectorIO io{path};
+    Series series{io, partition, SeriesConfig{40, 4_kb}};
+    int count = 0;
+    series.iterate(
+        [&](const LogEntry& log_entry, std::span<const uint8_t> payload) {
+          REQUIRE(std::string((const char*)payload.data(), payload.size()) == fmt::format("sample {}", count));
+          CRCDefault crc;
+          crc.update(payload.data(), payload.size());
+          REQUIRE(crc.get() == log_entry.checksum);
+          count++;
+          return true;
+        },
+        false);
+    REQUIRE(count == 25);
+
+    // The copying interface still works on the mapping.
+    series.iterate([&](auto& data_log_entry) {
+      std::string recv(data_log_entry.log_entry.size, '\0');
+      data_log_entry.read(recv.data(), recv.size());
+      REQUIRE(recv == fmt::format("sample {}", 24));
+      return false;
+    });
+  }
+
+  SECTION("series over a read only mapping") {
+    auto partition = Partition::create(0, 128);
+    SeriesConfig cfg{200, 4_kb};
+    cfg.checkpoint = true;
+    {
+      MmapSectorIO io{path, {.n_sectors = 128}};
+      Series series{io, partition, cfg};
+      for (int i = 0; i < 25; ++i) {
+        std::string data = fmt::format("sample {}", i);
+        series.insert(data.data(), data.size(), 0, i + 1);
+      }
+      series.sync();
+    }
+    {
+      // A stale checkpoint and an unused header sector with a bad crc: both would be rewritten on a writable device.
+      MmapSectorIO io{path};
+      std::array<uint8_t, sector_size> sector{};
+      io.write_sectors(sector.data(), 127, 1);
+      io.read_sectors(sector.data(), 5, 1);
+      sector[0] ^= 0xff;
+      io.write_sectors(sector.data(), 5, 1);
+    }
+    auto read_image = [&] {
+      std::ifstream in(path, std::ios::binary);
+      return std::vector<char>(std::istreambuf_iterator<char>(in), {});
+    };
+    auto image = read_image();
+
+    MmapSectorIO io{path, {.read_only = true}};
+    Series series{io, partition, cfg};
+    int count = 0;
+    series.iterate(
+        [&](const LogEntry&, std::span<const uint8_t> payload) {
+          REQUIRE(std::string((const char*)payload.data(), payload.size()) == fmt::format("sample {}", count));
+          count++;
+          return true;
+        },
+        false);
+    REQUIRE(count == 25);
+    REQUIRE(read_image() == image);
+  }
+
+  std::filesystem::remove(path);
+}
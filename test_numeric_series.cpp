@@ -0,0 +1,163 @@
+//
+// Gorilla encoding and the numeric series layer.
+//
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "catch_amalgamated.hpp"
+#include "tsdb/numeric_series.h"
+#include "tsdb/series.h"
+
+using namespace tsdb;
+using namespace tsdb::literals;
+
+static void require_round_trip(const std::vector<std::pair<uint64_t, double>>& points) {
+  std::vector<uint8_t> block;
+  GorillaEncoder encoder{block};
+  for (auto& [t, v] : points) {
+    encoder.append(t, v);
+  }
+
+  GorillaDecoder decoder{block};
+  REQUIRE(decoder.size() == points.size());
+  uint64_t t;
+  double v;
+  for (auto& p : points) {
+    REQUIRE(decoder.next(t, v));
+    REQUIRE(t == p.first);
+    REQUIRE(memcmp(&v, &p.second, sizeof(v)) == 0);
+  }
+  REQUIRE(!decoder.next(t, v));
+}
+
+TEST_CASE("gorilla round trip") {
+  SECTION("edge values") {
+    require_round_trip({{0, 0.0}});
+    require_round_trip({{1, 1.0},
+                        {2, -1.0},
+                        {3, std::numeric_limits<double>::quiet_NaN()},
+                        {4, std::numeric_limits<double>::infinity()},
+                        {5, -0.0},
+                        {6, std::numeric_limits<double>::denorm_min()},
+                        {7, std::numeric_limits<double>::max()},
+                        {7, std::numeric_limits<double>::max()},
+                        {UINT64_MAX, 3.0},
+                        {0, 3.5}});
+  }
+
+  SECTION("every timestamp bucket") {
+    std::vector<std::pair<uint64_t, double>> points;
+    uint64_t t = 1'000'000;
+    int64_t delta = 1000;
+    for (int64_t dod : {0, 1, -1, 63, -64, 64, -65, 255, -256, 256, -257, 2047, -2048, 2048, -2049, 1 << 20, -(1 << 20)}) {
+      delta += dod;
+      t += delta;
+      points.emplace_back(t, (double)dod);
+    }
+    require_round_trip(points);
+  }
+
+  SECTION("random") {
+    std::mt19937_64 rng(42);
+    std::vector<std::pair<uint64_t, double>> points;
+    uint64_t t = rng();
+    for (int i = 0; i < 10000; ++i) {
+      t += rng() % 3 ? 1000 + rng() % 50 : rng();
+      uint64_t bits = rng();
+      double v;
+      memcpy(&v, &bits, sizeof(v));
+      points.emplace_back(t, rng() % 2 ? v : (double)(rng() % 100));
+    }
+    require_round_trip(points);
+  }
+}
+
+TEST_CASE("numeric series") {
+  SectorMemoryIO io{2048};
+  auto partition = Partition::create(0, 2048);
+  Series series{io, partition, SeriesConfig{100, 4_kb}};
+  NumericSeries numeric{series};
+
+  // 1 kHz samples with a little jitter, a slowly moving reading quantized to the sensor resolution.
+  const int n_points = 20000;
+  std::vector<std::pair<uint64_t, double>> points;
+  uint64_t t = 1'700'000'000'000'000;
+  for (int i = 0; i < n_points; ++i) {
+    t += 1000 + (i % 7 == 0 ? 3 : 0);
+    points.emplace_back(t, std::round(20 + 5 * std::sin(i / 2000.0)) + (i % 100 == 0 ? 0.5 : 0));
+  }
+  for (auto& [t, v] : points) {
+    numeric.append(t, v);
+  }
+  numeric.sync();
+
+  size_t stored = 0;
+  series.iterate([&](auto& data_log_entry) {
+    stored += data_log_entry.log_entry.size;
+    return true;
+  });
+  auto ratio = double(n_points * 16) / stored;
+  INFO("compression ratio " << ratio);
+  REQUIRE(ratio > 5);
+
+  SECTION("ascending") {
+    size_t i = 0;
+    numeric.iterate(
+        [&](uint64_t t, double v) {
+          REQUIRE(t == points[i].first);
+          REQUIRE(v == points[i].second);
+          i++;
+          return true;
+        },
+        false);
+    REQUIRE(i == points.size());
+  }
+
+  SECTION("descending range, skipping other entries") {
+    std::string other = "not numeric";
+    series.insert(other.data(), other.size());
+    size_t first = 1234, last = 15000;
+    size_t i = last;
+    numeric.iterate([&](uint64_t t, double v) {
+      i--;
+      REQUIRE(t == points[i].first);
+      REQUIRE(v == points[i].second);
+      return true;
+    },
+                    true,
+                    points[first].first,
+                    points[last].first);
+    REQUIRE(i == first);
+  }
+
+  SECTION("unflushed points are not visible") {
+    numeric.append(t + 1000, 1.0);
+    REQUIRE(numeric.pending_bytes() > 0);
+    size_t count = 0;
+    numeric.iterate([&](uint64_t, double) {
+      count++;
+      return true;
+    });
+    REQUIRE(count == n_points);
+  }
+
+  SECTION("appending from the callback") {
+    size_t count = 0;
+    numeric.iterate(
+        [&](uint64_t, double v) {
+          numeric.append(t + 1000 * ++count, v);
+          return true;
+        },
+        false);
+    REQUIRE(count == n_points);
+    numeric.sync();
+
+    count = 0;
+    numeric.iterate([&](uint64_t, double) {
+      count++;
+      return true;
+    });
+    REQUIRE(count == 2 * n_points);
+  }
+}
@@ -1,7 +1,8 @@
+#include <atomic>
 #include <thread>
 
 #include "catch_amalgamated.hpp"
-#include "fakeit.hpp"
+#include "fmt/format.h"
 #include "tsdb/series.h"
 using namespace tsdb;
 using namespace tsdb::literals;
@@ -137,6 +138,65 @@ TEST_CASE("partial write and partial read") {
         },
         false);
   }
+
+  SECTION("precomputed chunk checksums") {
+    // Every other chunk comes with its crc, as computed by a worker thread.
+    for (int i = 0; i < 8_kb; i += 1_kb) {
+      if (i % 2_kb) {
+        transaction.write(big_data.data() + i, 1_kb);
+      } else {
+        CRCDefault chunk_crc;
+        chunk_crc.update(big_data.data() + i, 1_kb);
+        transaction.write(big_data.data() + i, 1_kb, chunk_crc.get());
+      }
+    }
+    REQUIRE(transaction.is_finalized);
+
+    CRCDefault whole;
+    whole.update(big_data.data(), big_data.size());
+    size_t n = 0;
+    series.iterate([&](auto& data_log_entry) {
+      REQUIRE(data_log_entry.log_entry.checksum == whole.get());
+      n++;
+      return true;
+    });
+    REQUIRE(n == 1);
+  }
+}
+
+TEST_CASE("parallel checksum insert and out of order read") {
+  SectorMemoryIO io{2048};
+
+  auto partition = Partition::create(0, 2048);
+  Series series{io, partition, SeriesConfig{10, 512_kb}};
+
+  std::vector<uint8_t> data(300_kb + 100);
+  for (int i = 0; i < data.size(); ++i) {
+    data[i] = i * 7;
+  }
+  series.insert_parallel(data.data(), data.size(), 4);
+
+  series.iterate([&](auto& data_log_entry) {
+    CRCDefault checksum;
+    REQUIRE(data_log_entry.log_entry.checksum == parallel_checksum<CRCDefault>(data.data(), data.size(), 1));
+
+    // Read chunks backwards, then merge the chunk checksums in order.
+    const uint32_t chunk = 64_kb;
+    std::vector<uint8_t> recv(data.size());
+    std::vector<uint32_t> chunk_crcs;
+    for (int offset = (data.size() - 1) / chunk * chunk; offset >= 0; offset -= chunk) {
+      auto len = data_log_entry.read_at(recv.data() + offset, chunk, offset);
+      CRCDefault chunk_crc;
+      chunk_crc.update(recv.data() + offset, len);
+      chunk_crcs.insert(chunk_crcs.begin(), chunk_crc.get());
+    }
+    for (int i = 0; i < chunk_crcs.size(); ++i) {
+      checksum.append(chunk_crcs[i], std::min<size_t>(chunk, data.size() - i * chunk));
+    }
+    REQUIRE(checksum.get() == data_log_entry.log_entry.checksum);
+    REQUIRE(recv == data);
+    return true;
+  });
 }
 
 TEST_CASE("ESP32 errorous write sector order") {
@@ -164,6 +224,40 @@ TEST_CASE("get cfg and partition") {
   REQUIRE(cfg.max_file_size == 4096);
 }
 
+TEST_CASE("series restart from checkpoint") {
+  SectorMemoryIO io{512};
+  auto partition = Partition::create(0, 512);
+  SeriesConfig cfg{100, 4_kb, true};
+
+  std::vector<uint8_t> data(3000);
+  {
+    Series series{io, partition, cfg};
+    for (int i = 0; i < 300; ++i) {
+      std::fill(data.begin(), data.end(), (uint8_t)i);
+      series.insert(data.data(), data.size(), i);
+    }
+    series.sync();
+  }
+
+  Series series{io, partition, cfg};
+  std::fill(data.begin(), data.end(), 0xee);
+  series.insert(data.data(), data.size(), 0xee);
+
+  int count = 0;
+  uint32_t expected_attr = 0xee;
+  std::vector<uint8_t> recv(data.size());
+  series.iterate([&](auto& data_log_entry) {
+    REQUIRE(data_log_entry.log_entry.attr == expected_attr);
+    data_log_entry.read(recv.data(), recv.size());
+    REQUIRE(data_log_entry.get_accumulated_crc() == data_log_entry.log_entry.checksum);
+    REQUIRE(recv[0] == (uint8_t)expected_attr);
+    expected_attr = count == 0 ? 299 : expected_attr - 1;
+    count++;
+    return true;
+  });
+  REQUIRE(count > 1);
+}
+
 TEST_CASE("series clear") {
   SectorMemoryIO io{512};
 
@@ -196,6 +290,242 @@ TEST_CASE("series clear") {
   }
 }
 
+TEST_CASE("insert batch") {
+  // Same layout on the device as inserting the records one by one.
+  SectorMemoryIO batch_io{512};
+  SectorMemoryIO single_io{512};
+  auto partition = Partition::create(0, 512);
+  Series batch_series{batch_io, partition, SeriesConfig{100, 4_kb}};
+  Series single_series{single_io, partition, SeriesConfig{100, 4_kb}};
+
+  std::vector<std::vector<uint8_t>> payloads;
+  std::vector<Record> records;
+  uint64_t timestamp = 1;
+  for (int batch = 0; batch < 6; ++batch) {
+    payloads.clear();
+    records.clear();
+    for (int i = 0; i < 37; ++i) {
+      auto len = 1 + (batch * 37 + i) * 197 % 4096;
+      payloads.emplace_back(len, (uint8_t)i);
+    }
+    for (auto& p : payloads) {
+      records.push_back({p.data(), (uint32_t)p.size(), (uint32_t)p.size(), timestamp++});
+    }
+
+    batch_series.insert_batch(records);
+    for (auto& r : records) {
+      single_series.insert(r.data, r.len, r.attr, r.timestamp);
+    }
+    REQUIRE(batch_io.mem == single_io.mem);
+  }
+
+  int count = 0;
+  batch_series.iterate([&](auto& data_log_entry) {
+    std::vector<uint8_t> recv(data_log_entry.log_entry.size);
+    data_log_entry.read(recv.data(), recv.size());
+    REQUIRE(data_log_entry.get_accumulated_crc() == data_log_entry.log_entry.checksum);
+    REQUIRE(data_log_entry.log_entry.attr == recv.size());
+    count++;
+    return true;
+  });
+  REQUIRE(count > 0);
+}
+
+TEST_CASE("packed records") {
+  SectorMemoryIO io{1024};
+  auto partition = Partition::create(0, 1024);
+  SeriesConfig cfg{100, 4_kb};
+  const int n_records = 5000;
+  auto record_of = [](int i) {
+    std::vector<uint8_t> r(16 + i % 49);
+    for (size_t j = 0; j < r.size(); ++j) {
+      r[j] = (uint8_t)(i + j);
+    }
+    return r;
+  };
+
+  {
+    Series series{io, partition, cfg};
+    for (int i = 0; i < n_records; ++i) {
+      auto r = record_of(i);
+      series.insert_packed(r.data(), r.size(), 1000 + i);
+    }
+    // A record big enough for its own entry, mixed in
+    std::vector<uint8_t> big(3000, 0xab);
+    series.insert(big.data(), big.size(), 7, 1000 + n_records);
+
+    size_t n_entries = 0;
+    series.iterate([&](auto&) {
+      n_entries++;
+      return true;
+    });
+    // ~85 records per 4 kb block; the last block is still in RAM.
+    REQUIRE(n_entries < n_records / 50);
+    series.sync();
+  }
+
+  Series series{io, partition, cfg};
+  int i = 0;
+  series.iterate_records(
+      [&](const Record& r) {
+        if (i == n_records) {
+          REQUIRE(r.len == 3000);
+          REQUIRE(r.attr == 7);
+        } else {
+          auto expected = record_of(i);
+          REQUIRE(r.timestamp == 1000 + i);
+          REQUIRE(std::vector<uint8_t>((const uint8_t*)r.data, (const uint8_t*)r.data + r.len) == expected);
+        }
+        i++;
+        return true;
+      },
+      false);
+  REQUIRE(i == n_records + 1);
+
+  SECTION("time range starting inside a block") {
+    std::vector<uint64_t> timestamps;
+    series.iterate_records([&](const Record& r) {
+      timestamps.push_back(r.timestamp);
+      return true;
+    },
+                           true,
+                           1000 + 1234,
+                           1000 + 2345);
+    REQUIRE(timestamps.size() == 2345 - 1234);
+    REQUIRE(timestamps.front() == 1000 + 2344);
+    REQUIRE(timestamps.back() == 1000 + 1234);
+  }
+
+  SECTION("records are visible once their block is written") {
+    std::string data = "late";
+    series.insert_packed(data.data(), data.size());
+    size_t count = 0;
+    auto counter = [&](const Record&) {
+      count++;
+      return true;
+    };
+    series.iterate_records(counter);
+    REQUIRE(count == n_records + 1);
+    series.flush_packed();
+    count = 0;
+    series.iterate_records(counter);
+    REQUIRE(count == n_records + 2);
+  }
+}
+
+TEST_CASE("reserved attr bits") {
+  SectorMemoryIO io{1024};
+  Series series{io, Partition::create(0, 1024), SeriesConfig{100, 256_kb}};
+  std::vector<uint8_t> data(100, 7);
+  for (auto attr : {LogEntry::attr_packed, LogEntry::attr_numeric, LogEntry::attr_compressed, 0xe0000001u}) {
+    REQUIRE_THROWS_AS(series.insert(data.data(), data.size(), attr), Error);
+    REQUIRE_THROWS_AS(series.insert_parallel(data.data(), data.size(), 2, attr), Error);
+    Record records[2]{{data.data(), 10, 1}, {data.data(), 10, attr}};
+    REQUIRE_THROWS_AS(series.insert_batch(records), Error);
+    REQUIRE_THROWS_AS(series.begin_insert_transaction(data.size(), 0, attr), Error);
+  }
+  // Nothing of the rejected calls was written, not even the first record of the batch.
+  size_t count = 0;
+  series.iterate([&](auto&) {
+    count++;
+    return true;
+  });
+  REQUIRE(count == 0);
+
+  series.insert(data.data(), data.size(), ~LogEntry::attr_reserved, 1);
+  series.iterate([&](auto& entry) {
+    REQUIRE(entry.log_entry.attr == ~LogEntry::attr_reserved);
+    return true;
+  });
+
+  SECTION("packed records too big for a block") {
+    SeriesConfig cfg{100, 256_kb};
+    cfg.packed_block_size = 128_kb;
+    SectorMemoryIO packed_io{1024};
+    Series packed{packed_io, Partition::create(0, 1024), cfg};
+    std::vector<uint8_t> big(UINT16_MAX + 2);
+    // Would be a 1 byte record if the length were truncated to 16 bits.
+    REQUIRE_THROWS_AS(packed.insert_packed(big.data(), big.size()), Error);
+    packed.flush_packed();
+    size_t n_records = 0;
+    packed.iterate_records([&](const Record&) {
+      n_records++;
+      return true;
+    });
+    REQUIRE(n_records == 0);
+  }
+}
+
+TEST_CASE("group commit") {
+  using namespace std::chrono_literals;
+  SectorMemoryIO io{1024};
+  auto partition = Partition::create(0, 1024);
+  auto count_on_device = [&] {
+    // A second series on the same partition only sees what reached the device.
+    Series reader{io, partition, SeriesConfig{300, 1_kb}};
+    int count = 0;
+    reader.iterate([&](auto&) {
+      count++;
+      return true;
+    });
+    return count;
+  };
+
+  SECTION("sync without new inserts does not write") {
+    SeriesConfig cfg{300, 1_kb};
+    cfg.group_commit_window = 1ms;
+    Series series{io, partition, cfg};
+    std::string data = "hello";
+    series.insert(data.data(), data.size());
+    series.sync();
+    REQUIRE(count_on_device() == 1);
+    series.sync();
+    REQUIRE(series.sync_stats().sync_calls == 2);
+    REQUIRE(series.sync_stats().header_writes == 1);
+    REQUIRE(series.sync_stats().writes_saved() == 1);
+  }
+
+  SECTION("max inserts ends the window early") {
+    SeriesConfig cfg{300, 1_kb};
+    cfg.group_commit_window = 60s;
+    cfg.group_commit_max_inserts = 1;
+    Series series{io, partition, cfg};
+    std::string data = "hello";
+    series.insert(data.data(), data.size());
+    auto begin = std::chrono::steady_clock::now();
+    series.sync();
+    REQUIRE(std::chrono::steady_clock::now() - begin < 10s);
+    REQUIRE(count_on_device() == 1);
+  }
+
+  SECTION("concurrent syncs share header writes") {
+    SeriesConfig cfg{300, 1_kb};
+    cfg.group_commit_window = 20ms;
+    Series series{io, partition, cfg};
+    const int n_threads = 8;
+    const int n_rounds = 25;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t) {
+      threads.emplace_back([&] {
+        std::string data(100, 'x');
+        for (int i = 0; i < n_rounds; ++i) {
+          series.insert(data.data(), data.size());
+          series.sync();
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    auto stats = series.sync_stats();
+    INFO("header writes " << stats.header_writes << " for " << stats.sync_calls << " syncs");
+    REQUIRE(stats.sync_calls == n_threads * n_rounds);
+    REQUIRE(stats.writes_saved() > 0);
+    REQUIRE(count_on_device() == n_threads * n_rounds);
+  }
+}
+
 TEST_CASE("Multithread", "[.]") {
   using namespace std::chrono_literals;
   SectorMemoryIO io{512};
@@ -398,4 +728,552 @@ TEST_CASE("Overwrite and all sectors are monotonic, starting from the second sec
     return true;
   }, false);
   REQUIRE(count == 3 * HeaderSector::n_entries);
-}
\ No newline at end of file
+}
+TEMPLATE_TEST_CASE("series sector sizes", "", BasicSectorMemoryIO<512>, BasicSectorMemoryIO<4096>) {
+  constexpr auto sector_size = TestType::sector_size;
+  using SeriesType = Series<TestType>;
+  REQUIRE(SeriesType::HeaderSector::n_entries == (sector_size - 8) / sizeof(LogEntry));
+
+  TestType io{256};
+  auto partition = Partition::create(0, 256);
+  SeriesConfig cfg{400, 3 * sector_size};
+  cfg.checkpoint = GENERATE(false, true);
+  auto payload_of = [](uint64_t ts) {
+    std::vector<uint8_t> data(1 + ts * 37 % (2 * sector_size + 7));
+    for (size_t i = 0; i < data.size(); ++i) {
+      data[i] = (uint8_t)(ts + i);
+    }
+    return data;
+  };
+
+  const uint64_t n_inserts = 3000;
+  {
+    SeriesType series{io, partition, cfg};
+    for (uint64_t ts = 1; ts <= n_inserts; ++ts) {
+      auto data = payload_of(ts);
+      series.insert(data.data(), data.size(), 0, ts);
+    }
+    series.sync();
+  }
+
+  // The ring wrapped around several times; what is left must read back intact, newest first.
+  SeriesType series{io, partition, cfg};
+  uint64_t expected_ts = n_inserts;
+  std::vector<uint8_t> recv;
+  series.iterate([&](auto& data_log_entry) {
+    auto& entry = data_log_entry.log_entry;
+    REQUIRE(entry.timestamp == expected_ts);
+    auto expected = payload_of(entry.timestamp);
+    recv.resize(entry.size);
+    for (uint32_t offset = 0; offset < entry.size; offset += sector_size) {
+      data_log_entry.read(recv.data() + offset, std::min(sector_size, entry.size - offset));
+    }
+    REQUIRE(recv == expected);
+    REQUIRE(data_log_entry.get_accumulated_crc() == entry.checksum);
+    expected_ts--;
+    return true;
+  });
+  REQUIRE(expected_ts < n_inserts - 20);
+}
+
+struct ReadCountingIO : IO<ReadCountingIO> {
+  explicit ReadCountingIO(uint32_t n_sectors) : mem(n_sectors) {}
+
+  SectorMemoryIO mem;
+  size_t n_reads{0};
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    mem.write_sectors(in, begin_sector, n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    n_reads++;
+    mem.read_sectors(out, begin_sector, n_sector);
+  }
+
+  uint32_t n_sectors() { return mem.n_sectors(); }
+};
+
+TEST_CASE("entry reader") {
+  ReadCountingIO io{8192};
+  SeriesConfig cfg{100, 2_mb};
+  cfg.compress = true;
+  Series series{io, Partition::create(0, 8192), cfg};
+
+  std::vector<uint8_t> data(2_mb - 123);
+  uint32_t x = 1;
+  for (auto& b : data) {
+    x = x * 1103515245 + 12345;
+    b = x >> 24;
+  }
+  series.insert(data.data(), data.size(), 0, 1);
+  // Compressible, for the fallback path.
+  std::string text;
+  while (text.size() < 100000) {
+    text += fmt::format("line {} of a log that compresses well\n", text.size());
+  }
+  series.insert(text.data(), text.size(), 0, 2);
+
+  auto chunk = GENERATE(7u, 512u, 4099u, 1u << 20);
+  auto window_sectors = GENERATE(1u, 64u);
+  std::vector<uint8_t> recv;
+  series.iterate(
+      [&](auto& data_log_entry) {
+        auto& entry = data_log_entry.log_entry;
+        bool compressed = entry.attr & LogEntry::attr_compressed;
+        auto expected = entry.timestamp == 1 ? data : std::vector<uint8_t>(text.begin(), text.end());
+        REQUIRE(compressed == (entry.timestamp == 2));
+
+        io.n_reads = 0;
+        Series<ReadCountingIO>::EntryReader reader{data_log_entry, window_sectors};
+        recv.clear();
+        std::vector<uint8_t> buf(chunk);
+        while (auto n = reader.read(buf.data(), buf.size())) {
+          recv.insert(recv.end(), buf.begin(), buf.begin() + n);
+        }
+        REQUIRE(recv == expected);
+        REQUIRE(data_log_entry.get_accumulated_crc() == entry.checksum);
+        if (!compressed) {
+          // One request per window, whatever the chunk size.
+          auto n_windows = (min_sector_for_size(entry.size) + window_sectors - 1) / window_sectors;
+          REQUIRE(reader.request_count() == n_windows);
+          REQUIRE(io.n_reads == n_windows);
+        }
+        return true;
+      },
+      false);
+
+  SECTION("plain reads issue one request per chunk") {
+    series.iterate([&](auto& data_log_entry) {
+      if (data_log_entry.log_entry.timestamp != 1) {
+        return true;
+      }
+      io.n_reads = 0;
+      std::vector<uint8_t> buf(sector_size);
+      while (data_log_entry.read(buf.data(), buf.size())) {
+      }
+      REQUIRE(io.n_reads == min_sector_for_size(data.size()));
+      return true;
+    });
+  }
+}
+
+TEST_CASE("work stealing queues") {
+  const size_t n_items = 10000;
+  auto n_workers = GENERATE(1u, 3u, 8u);
+  WorkStealingQueues queues(n_items, n_workers, 16);
+  std::vector<std::atomic<int>> claimed(n_items);
+
+  std::vector<std::thread> threads;
+  for (unsigned w = 0; w < n_workers; ++w) {
+    threads.emplace_back([&, w] {
+      for (auto i = queues.pop(w); i != WorkStealingQueues::none; i = queues.pop(w)) {
+        claimed[i]++;
+        // Worker 0 is slow, the others have to steal from it.
+        if (w == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  REQUIRE(queues.empty());
+  for (auto& c : claimed) {
+    REQUIRE(c == 1);
+  }
+  if (n_workers > 1) {
+    REQUIRE(queues.steal_count() > 0);
+  }
+
+  SECTION("limit") {
+    WorkStealingQueues limited(100, 2, 4);
+    REQUIRE(limited.pop(0, 0) == WorkStealingQueues::none);
+    REQUIRE(limited.pop(1, 5) == 4);
+    REQUIRE(limited.pop(1, 5) == WorkStealingQueues::none);
+    REQUIRE(limited.pop(1, 1) == WorkStealingQueues::none);
+    REQUIRE(limited.pop(0, 1) == 0);
+  }
+}
+
+TEST_CASE("parallel iterate") {
+  SectorMemoryIO io{4096};
+  SeriesConfig cfg{2000, 16_kb};
+  Series series{io, Partition::create(0, 4096), cfg};
+  auto payload_of = [](uint64_t ts) {
+    std::vector<uint8_t> data(1 + ts * 7919 % 3000);
+    for (size_t i = 0; i < data.size(); ++i) {
+      data[i] = (uint8_t)(ts * 31 + i);
+    }
+    return data;
+  };
+  for (uint64_t ts = 1; ts <= 3000; ++ts) {
+    auto data = payload_of(ts);
+    series.insert(data.data(), data.size(), 0, ts);
+  }
+
+  std::vector<uint64_t> expected;
+  series.iterate([&](auto& data_log_entry) {
+    expected.push_back(data_log_entry.log_entry.timestamp);
+    return true;
+  });
+  REQUIRE(expected.size() > 100);
+  auto n_threads = GENERATE(1u, 4u);
+
+  // The callbacks run on the worker threads: mismatches are counted there and checked once parallel_iterate returns.
+  std::atomic<size_t> n_mismatches{0};
+
+  SECTION("unordered") {
+    std::mutex m;
+    std::vector<uint64_t> seen;
+    series.parallel_iterate(
+        [&](const LogEntry& e, std::span<const uint8_t> data) {
+          auto payload = payload_of(e.timestamp);
+          n_mismatches += !std::equal(data.begin(), data.end(), payload.begin(), payload.end());
+          std::lock_guard g(m);
+          seen.push_back(e.timestamp);
+          return true;
+        },
+        n_threads);
+    REQUIRE(n_mismatches == 0);
+    std::sort(seen.begin(), seen.end(), std::greater<>());
+    REQUIRE(seen == expected);
+  }
+
+  SECTION("ordered") {
+    auto descending = GENERATE(true, false);
+    auto max_pending = GENERATE(1u, 64u);
+    std::vector<uint64_t> seen;
+    series.parallel_iterate(
+        [&](const LogEntry& e, std::span<const uint8_t> data) {
+          auto payload = payload_of(e.timestamp);
+          n_mismatches += !std::equal(data.begin(), data.end(), payload.begin(), payload.end());
+          seen.push_back(e.timestamp);
+          return true;
+        },
+        n_threads,
+        0,
+        0,
+        {.ordered = true, .descending = descending, .max_pending = max_pending, .chunk_size = 3});
+    REQUIRE(n_mismatches == 0);
+    if (!descending) {
+      std::reverse(seen.begin(), seen.end());
+    }
+    REQUIRE(seen == expected);
+  }
+
+  SECTION("time range and early stop") {
+    std::vector<uint64_t> seen;
+    series.parallel_iterate(
+        [&](const LogEntry& e, std::span<const uint8_t>) {
+          seen.push_back(e.timestamp);
+          return seen.size() < 10;
+        },
+        n_threads,
+        2500,
+        2900,
+        {.ordered = true});
+    REQUIRE(seen.size() == 10);
+    REQUIRE(seen.front() == 2899);
+    REQUIRE(seen.back() == 2890);
+  }
+
+  SECTION("corrupted entry") {
+    // Find the first data sector of an entry in the middle and damage it.
+    auto payload = payload_of(expected[expected.size() / 2]);
+    std::array<uint8_t, sector_size> first_sector{};
+    memcpy(first_sector.data(), payload.data(), std::min<size_t>(payload.size(), sector_size));
+    size_t n_damaged = 0;
+    for (auto& sector : io.mem) {
+      if (sector == first_sector) {
+        sector[0] ^= 1;
+        n_damaged++;
+      }
+    }
+    REQUIRE(n_damaged > 0);
+    REQUIRE_THROWS_AS(series.parallel_iterate([](const LogEntry&, std::span<const uint8_t>) { return true; }, n_threads), CorruptedDataError);
+    REQUIRE_THROWS_AS(series.parallel_iterate([](const LogEntry&, std::span<const uint8_t>) { return true; }, n_threads, 0, 0, {.ordered = true}), CorruptedDataError);
+  }
+}
+
+TEST_CASE("parallel iterate scaling", "[.][benchmark]") {
+  SectorMemoryIO io{64 * 1024};
+  Series series{io, Partition::create(0, 64 * 1024), SeriesConfig{4000, 64_kb}};
+  std::vector<uint8_t> data(8_kb, 0x5a);
+  for (int i = 0; i < 3500; ++i) {
+    data[0] = i;
+    series.insert(data.data(), data.size(), 0, i + 1);
+  }
+
+  for (bool ordered : {false, true}) {
+    for (unsigned n_threads : {1u, 2u, 4u, 8u}) {
+      std::atomic<size_t> total{0};
+      auto begin = std::chrono::steady_clock::now();
+      series.parallel_iterate(
+          [&](const LogEntry&, std::span<const uint8_t> payload) {
+            total += payload.size();
+            return true;
+          },
+          n_threads,
+          0,
+          0,
+          {.ordered = ordered});
+      auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+      fmt::print("ordered={:d} {} threads: {:8.1f} MB/s\n", ordered, n_threads, total / elapsed / (1 << 20));
+    }
+  }
+}
+
+TEST_CASE("snapshot iterate") {
+  SectorMemoryIO io{256};
+  SeriesConfig cfg{400, 4_kb};
+  Series series{io, Partition::create(0, 256), cfg};
+  auto payload_of = [](uint64_t ts) {
+    std::vector<uint8_t> data(1 + ts * 131 % 1500);
+    for (size_t i = 0; i < data.size(); ++i) {
+      data[i] = (uint8_t)(ts * 7 + i);
+    }
+    return data;
+  };
+  uint64_t ts = 1;
+  auto insert_n = [&](int n) {
+    for (int i = 0; i < n; ++i, ++ts) {
+      auto data = payload_of(ts);
+      series.insert(data.data(), data.size(), 0, ts);
+    }
+  };
+  insert_n(300);
+
+  SECTION("the writer is not blocked, overwritten entries are skipped") {
+    size_t n_visited = 0;
+    auto n_skipped = series.iterate(
+        [&](auto& data_log_entry) {
+          if (n_visited++ == 0) {
+            // Wraps around the whole data ring. With the lock held across the traversal, this would deadlock.
+            std::thread writer([&] { insert_n(400); });
+            writer.join();
+          }
+          std::vector<uint8_t> recv(data_log_entry.log_entry.size);
+          data_log_entry.read(recv.data(), recv.size());
+          REQUIRE(recv == payload_of(data_log_entry.log_entry.timestamp));
+          return true;
+        },
+        false);
+    REQUIRE(n_skipped > 0);
+    REQUIRE(n_visited > 0);
+  }
+
+  SECTION("an entry overwritten in the middle of a read") {
+    size_t n_visited = 0;
+    auto n_skipped = series.iterate([&](auto& data_log_entry) {
+      if (data_log_entry.log_entry.size <= 2 * sector_size) {
+        return true;
+      }
+      n_visited++;
+      std::vector<uint8_t> recv(data_log_entry.log_entry.size);
+      auto n = data_log_entry.read(recv.data(), std::min<uint32_t>(sector_size, recv.size()));
+      insert_n(400);
+      REQUIRE(data_log_entry.overwritten());
+      data_log_entry.read(recv.data() + n, recv.size() - n);
+      FAIL("read of an overwritten entry did not throw");
+      return true;
+    });
+    REQUIRE(n_visited == 1);
+    REQUIRE(n_skipped > 0);
+  }
+
+  SECTION("records and parallel iterate skip as well") {
+    size_t n_visited = 0;
+    auto n_skipped = series.iterate_records([&](const Record&) {
+      if (n_visited++ == 0) {
+        insert_n(400);
+      }
+      return true;
+    });
+    REQUIRE(n_skipped > 0);
+
+    n_visited = 0;
+    n_skipped = series.parallel_iterate(
+        [&](const LogEntry& e, std::span<const uint8_t> data) {
+          if (n_visited++ == 0) {
+            insert_n(400);
+          }
+          auto payload = payload_of(e.timestamp);
+          REQUIRE(std::equal(data.begin(), data.end(), payload.begin(), payload.end()));
+          return true;
+        },
+        1,
+        0,
+        0,
+        {.ordered = true});
+    REQUIRE(n_skipped > 0);
+  }
+
+  SECTION("concurrent writer") {
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+      while (!done) {
+        insert_n(1);
+      }
+    });
+    size_t n_read = 0;
+    size_t n_skipped = 0;
+    size_t n_mismatches = 0;
+    for (int round = 0; round < 50; ++round) {
+      n_skipped += series.iterate([&](auto& data_log_entry) {
+        std::vector<uint8_t> recv(data_log_entry.log_entry.size);
+        data_log_entry.read(recv.data(), recv.size());
+        n_mismatches += data_log_entry.get_accumulated_crc() != data_log_entry.log_entry.checksum;
+        n_read++;
+        return true;
+      });
+    }
+    done = true;
+    writer.join();
+    INFO("read " << n_read << " skipped " << n_skipped);
+    REQUIRE(n_mismatches == 0);
+    REQUIRE(n_read > 0);
+  }
+}
+
+TEST_CASE("concurrent insert transactions") {
+  SectorMemoryIO io{1024};
+  Series series{io, Partition::create(0, 1024), SeriesConfig{200, 8_kb}};
+  auto payload_of = [](uint64_t ts, size_t size) {
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+      data[i] = (uint8_t)(ts * 11 + i);
+    }
+    return data;
+  };
+  auto stream = [&](auto& transaction, const std::vector<uint8_t>& data, size_t from, size_t to) {
+    for (auto offset = from; offset < to; offset += sector_size) {
+      transaction.write((void*)(data.data() + offset), sector_size);
+    }
+  };
+  auto entries = [&] {
+    std::vector<uint64_t> timestamps;
+    series.iterate(
+        [&](auto& data_log_entry) {
+          auto& entry = data_log_entry.log_entry;
+          std::vector<uint8_t> recv(entry.size);
+          data_log_entry.read(recv.data(), recv.size());
+          REQUIRE(data_log_entry.get_accumulated_crc() == entry.checksum);
+          timestamps.push_back(entry.timestamp);
+          return true;
+        },
+        false);
+    return timestamps;
+  };
+
+  SECTION("entries are published in reservation order") {
+    auto big1 = payload_of(1, 4_kb);
+    auto small = payload_of(2, 100);
+    auto big2 = payload_of(3, 2_kb);
+    auto t1 = series.begin_insert_transaction(big1.size(), 1);
+    stream(t1, big1, 0, 2_kb);
+    // Neither the insert nor the reads wait for the open transaction.
+    series.insert(small.data(), small.size(), 0, 2);
+    auto t2 = series.begin_insert_transaction(big2.size(), 3);
+    REQUIRE(entries().empty());
+
+    stream(t2, big2, 0, big2.size());
+    REQUIRE(t2.is_finalized);
+    REQUIRE(entries().empty());
+
+    stream(t1, big1, 2_kb, big1.size());
+    REQUIRE(entries() == std::vector<uint64_t>{1, 2, 3});
+
+    series.insert(small.data(), small.size(), 0, 4);
+    REQUIRE(entries() == std::vector<uint64_t>{1, 2, 3, 4});
+  }
+
+  SECTION("survives a restart once synced") {
+    auto big = payload_of(1, 3_kb);
+    {
+      auto t = series.begin_insert_transaction(big.size(), 1);
+      stream(t, big, 0, 1_kb);
+      series.insert(big.data(), 100, 0, 2);
+    }
+    series.sync();
+    Series reopened{io, Partition::create(0, 1024), SeriesConfig{200, 8_kb}};
+    int n = 0;
+    reopened.iterate([&](auto&) {
+      n++;
+      return true;
+    });
+    REQUIRE(n == 2);
+  }
+
+  SECTION("sync waits for the transactions ahead of an insert") {
+    auto big = payload_of(1, 2_kb);
+    auto t = series.begin_insert_transaction(big.size(), 1);
+    series.insert(big.data(), 100, 0, 2);
+    std::atomic<bool> synced{false};
+    std::thread syncer([&] {
+      series.sync();
+      synced = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    REQUIRE(!synced);
+    stream(t, big, 0, big.size());
+    syncer.join();
+
+    // Nothing written after the sync: both entries are on the device.
+    SectorMemoryIO copy{1024};
+    copy.mem = io.mem;
+    Series reopened{copy, Partition::create(0, 1024), SeriesConfig{200, 8_kb}};
+    std::vector<uint64_t> timestamps;
+    reopened.iterate(
+        [&](auto& entry) {
+          timestamps.push_back(entry.log_entry.timestamp);
+          return true;
+        },
+        false);
+    REQUIRE(timestamps == std::vector<uint64_t>{1, 2});
+  }
+
+  SECTION("concurrent writers") {
+    constexpr int n_threads = 4;
+    constexpr int n_per_thread = 20;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t) {
+      threads.emplace_back([&, t] {
+        for (int i = 0; i < n_per_thread; ++i) {
+          auto data = payload_of(t * 100 + i, (1 + (i + t) % 4) * sector_size);
+          if (i % 2) {
+            series.insert(data.data(), data.size());
+            continue;
+          }
+          auto transaction = series.begin_insert_transaction(data.size());
+          for (uint32_t offset = 0; offset < data.size(); offset += sector_size) {
+            transaction.write(data.data() + offset, sector_size);
+            std::this_thread::yield();
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    REQUIRE(entries().size() == n_threads * n_per_thread);
+  }
+
+  SECTION("the ring can not wrap onto an open transaction") {
+    auto big = payload_of(1, 8_kb);
+    auto t = series.begin_insert_transaction(big.size(), 1);
+    REQUIRE_THROWS_AS(series.clear(), Error);
+    bool thrown = false;
+    for (int i = 0; i < 100 && !thrown; ++i) {
+      try {
+        series.insert(big.data(), big.size());
+      } catch (const Error&) {
+        thrown = true;
+      }
+    }
+    REQUIRE(thrown);
+    stream(t, big, 0, big.size());
+    REQUIRE(entries().size() > 1);
+  }
+}
@@ -0,0 +1,206 @@
+#include <catch_amalgamated.hpp>
+#include <atomic>
+#include <filesystem>
+#include <thread>
+
+#include "fmt/format.h"
+#include "tsdb/series.h"
+#include "tsdb/uring_io.h"
+using namespace tsdb;
+using namespace tsdb::literals;
+
+/// io_uring may be disabled (old kernel, seccomp, sysctl kernel.io_uring_disabled).
+static std::unique_ptr<IoUringSectorIO> try_open_uring(const std::string& path, const IoUringSectorIOConfig& cfg) {
+  try {
+    return std::make_unique<IoUringSectorIO>(path, cfg);
+  } catch (const IOError& e) {
+    WARN("io_uring unavailable: " << e.what());
+    return nullptr;
+  }
+}
+
+TEST_CASE("io_uring io") {
+  auto path = (std::filesystem::temp_directory_path() / fmt::format("tsdb_uring_{}.img", getpid())).string();
+  std::filesystem::remove(path);
+  auto queue_depth = GENERATE(4u, 64u);
+  auto io = try_open_uring(path, {.queue_depth = queue_depth, .sync_policy = SyncPolicy::never, .n_sectors = 512});
+  if (!io) {
+    return;
+  }
+  REQUIRE(io->n_sectors() == 512);
+
+  SECTION("write behind, then read back") {
+    std::vector<uint8_t> data(sector_size * 20);
+    for (int i = 0; i < data.size(); ++i) {
+      data[i] = i * 31;
+    }
+    for (int i = 0; i < 20; ++i) {
+      io->write_sectors(data.data() + i * sector_size, 100 + i, 1);
+    }
+    // Reads drain queued writes.
+    std::vector<uint8_t> out(data.size());
+    io->read_sectors(out.data(), 100, 20);
+    REQUIRE(out == data);
+
+    std::array<ReadSegment, 2> reads{{{out.data() + sector_size, 100, 1}, {out.data(), 101, 1}}};
+    io->readv_sectors(reads);
+    REQUIRE(memcmp(out.data(), data.data() + sector_size, sector_size) == 0);
+    REQUIRE(memcmp(out.data() + sector_size, data.data(), sector_size) == 0);
+  }
+
+  SECTION("async requests complete through callbacks") {
+    std::vector<std::array<uint8_t, sector_size>> buffers(10);
+    int completed = 0;
+    for (int i = 0; i < buffers.size(); ++i) {
+      buffers[i].fill(i + 1);
+      io->async_write_sectors(buffers[i].data(), i, 1, [&](std::exception_ptr e) {
+        REQUIRE(!e);
+        completed++;
+      });
+    }
+    io->wait_all();
+    REQUIRE(completed == 10);
+
+    std::vector<std::array<uint8_t, sector_size>> out(10);
+    for (int i = 0; i < out.size(); ++i) {
+      io->async_read_sectors(out[i].data(), i, 1, [&, i](std::exception_ptr e) {
+        REQUIRE(!e);
+        REQUIRE(out[i] == buffers[i]);
+        completed++;
+      });
+    }
+    io->wait_all();
+    REQUIRE(completed == 20);
+  }
+
+  SECTION("errors") {
+    std::array<uint8_t, sector_size> buf{};
+    REQUIRE_THROWS_AS(io->write_sectors(buf.data(), 512, 1), IOError);
+    REQUIRE_THROWS_AS(io->async_read_sectors(buf.data(), 600, 1, [](auto) {}), IOError);
+  }
+
+  SECTION("inserts and their header sector go out in one submission") {
+    Series series{*io, Partition::create(0, 512), SeriesConfig{100, 4_kb}};
+    auto submits_before = io->submit_count();
+    std::vector<uint8_t> data(700, 0x42);
+    for (int i = 0; i < HeaderSector::n_entries; ++i) {
+      series.insert(data.data(), data.size(), 0, i + 1);
+    }
+    // Each insert queues its data and tail segment, the 21st also the header sector, all submitted when the queue is
+    // full or by the flush. Then the next header sector is read.
+    auto expected_submits = (2 * HeaderSector::n_entries + 1 + io->queue_depth() - 1) / io->queue_depth() + 1;
+    REQUIRE(io->submit_count() - submits_before == expected_submits);
+
+    int count = 0;
+    series.iterate([&](auto& data_log_entry) {
+      std::vector<uint8_t> recv(data_log_entry.log_entry.size);
+      data_log_entry.read(recv.data(), recv.size());
+      REQUIRE(recv == data);
+      count++;
+      return true;
+    });
+    REQUIRE(count == HeaderSector::n_entries);
+  }
+
+  SECTION("coroutine reads complete from poll") {
+    Series series{*io, Partition::create(0, 512), SeriesConfig{100, 4_kb}};
+    std::vector<uint8_t> data(1300);
+    for (int i = 0; i < data.size(); ++i) {
+      data[i] = i * 7;
+    }
+    for (int i = 0; i < 10; ++i) {
+      series.insert(data.data(), data.size(), 0, i + 1);
+    }
+    series.sync();
+
+    auto read_all = [&]() -> Task<int> {
+      int n = 0;
+      auto entries = series.async_iterate();
+      while (auto* entry = co_await entries.next()) {
+        std::vector<uint8_t> recv(entry->log_entry.size);
+        co_await entry->async_read(recv.data(), recv.size());
+        if (recv != data || entry->get_accumulated_crc() != entry->log_entry.checksum) {
+          throw CorruptedDataError("mismatch");
+        }
+        n++;
+      }
+      co_return n;
+    };
+    std::atomic<bool> done{false};
+    std::thread poller([&] {
+      while (!done) {
+        io->poll();
+        std::this_thread::yield();
+      }
+    });
+    auto n = sync_wait(read_all());
+    done = true;
+    poller.join();
+    REQUIRE(n == 10);
+  }
+
+  SECTION("async reads see the inserts queued just before") {
+    Series series{*io, Partition::create(0, 512), SeriesConfig{100, 4_kb}};
+    std::vector<uint8_t> old_data(1300, 0x11);
+    for (int i = 0; i < 20; ++i) {
+      series.insert(old_data.data(), old_data.size(), 0, i + 1);
+    }
+    series.sync();
+    series.clear();
+
+    std::atomic<bool> done{false};
+    std::thread poller([&] {
+      while (!done) {
+        io->poll();
+        std::this_thread::yield();
+      }
+    });
+    // Every insert reuses sectors holding old data; its own writes are still queued when it is read.
+    int n_stale = 0;
+    for (int i = 0; i < 20; ++i) {
+      std::vector<uint8_t> data(1300, (uint8_t)(0x20 + i));
+      series.insert(data.data(), data.size(), 0, i + 1);
+      auto read_newest = [&]() -> Task<std::vector<uint8_t>> {
+        auto entries = series.async_iterate();
+        auto* entry = co_await entries.next();
+        std::vector<uint8_t> recv(entry->log_entry.size);
+        co_await entry->async_read(recv.data(), recv.size());
+        co_return recv;
+      };
+      n_stale += sync_wait(read_newest()) != data;
+    }
+    done = true;
+    poller.join();
+    REQUIRE(n_stale == 0);
+  }
+
+  SECTION("entry reader sees the inserts queued just before") {
+    Series series{*io, Partition::create(0, 512), SeriesConfig{100, 4_kb}};
+    std::vector<uint8_t> old_data(3000, 0x11);
+    for (int i = 0; i < 10; ++i) {
+      series.insert(old_data.data(), old_data.size(), 0, i + 1);
+    }
+    series.sync();
+    series.clear();
+
+    for (int i = 0; i < 10; ++i) {
+      std::vector<uint8_t> data(3000, (uint8_t)(0x20 + i));
+      series.insert(data.data(), data.size(), 0, i + 1);
+    }
+    int count = 0;
+    series.iterate(
+        [&](auto& data_log_entry) {
+          Series<IoUringSectorIO>::EntryReader reader{data_log_entry, 2};
+          std::vector<uint8_t> recv(data_log_entry.log_entry.size);
+          REQUIRE(reader.read(recv.data(), recv.size()) == recv.size());
+          REQUIRE(recv == std::vector<uint8_t>(recv.size(), (uint8_t)(0x20 + count)));
+          count++;
+          return true;
+        },
+        false);
+    REQUIRE(count == 10);
+  }
+
+  io.reset();
+  std::filesystem::remove(path);
+}
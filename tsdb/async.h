@@ -0,0 +1,373 @@
+//
+// C++20 coroutine support: a lazy Task, an async generator, and offloading of blocking calls to worker threads.
+//
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace tsdb {
+
+/// Worker threads running blocking calls for coroutines, so the thread of an event loop never waits on a device.
+/// Started on first use, joined at exit once the queued work is done.
+struct OffloadPool {
+  static OffloadPool& shared() {
+    static OffloadPool pool{std::max(2u, std::thread::hardware_concurrency())};
+    return pool;
+  }
+
+  explicit OffloadPool(unsigned n_threads) {
+    for (unsigned i = 0; i < n_threads; ++i) {
+      workers.emplace_back([this] { run(); });
+    }
+  }
+
+  OffloadPool(const OffloadPool&) = delete;
+  OffloadPool& operator=(const OffloadPool&) = delete;
+
+  ~OffloadPool() {
+    {
+      std::lock_guard g(lock);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto& t : workers) {
+      t.join();
+    }
+  }
+
+  void post(std::function<void()> work) {
+    {
+      std::lock_guard g(lock);
+      queue.push_back(std::move(work));
+    }
+    cv.notify_one();
+  }
+
+ private:
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> queue;
+  bool stopping{false};
+  std::vector<std::thread> workers;
+
+  void run() {
+    for (;;) {
+      std::function<void()> work;
+      {
+        std::unique_lock g(lock);
+        cv.wait(g, [&] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+          return;
+        }
+        work = std::move(queue.front());
+        queue.pop_front();
+      }
+      work();
+    }
+  }
+};
+
+namespace detail {
+/// Result or exception of a coroutine or an offloaded call.
+template <typename T>
+struct Outcome {
+  std::optional<T> value;
+  std::exception_ptr error;
+
+  template <typename TFcn>
+  void capture(TFcn& fcn) {
+    try {
+      value.emplace(fcn());
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+
+  template <typename U>
+  void return_value(U&& v) {
+    value.emplace(std::forward<U>(v));
+  }
+
+  T get() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return std::move(*value);
+  }
+};
+
+template <>
+struct Outcome<void> {
+  std::exception_ptr error;
+
+  template <typename TFcn>
+  void capture(TFcn& fcn) {
+    try {
+      fcn();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+
+  void return_void() {}
+
+  void get() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+}  // namespace detail
+
+/// co_await offload(fcn) runs fcn on the OffloadPool and resumes the coroutine on that worker thread.
+template <typename TFcn>
+struct OffloadAwaiter {
+  using Result = std::invoke_result_t<TFcn&>;
+
+  TFcn fcn;
+  detail::Outcome<Result> outcome{};
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> waiter) {
+    OffloadPool::shared().post([this, waiter] {
+      outcome.capture(fcn);
+      waiter.resume();
+    });
+  }
+
+  Result await_resume() {
+    return outcome.get();
+  }
+};
+
+template <typename TFcn>
+OffloadAwaiter<std::decay_t<TFcn>> offload(TFcn&& fcn) {
+  return {std::forward<TFcn>(fcn)};
+}
+
+/// Lazily started coroutine returning T. Awaiting it starts it; the awaiter resumes where the task completes.
+template <typename T = void>
+struct [[nodiscard]] Task {
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  // co_return goes to the outcome: return_value, or return_void for Task<void>.
+  struct promise_type : detail::Outcome<T> {
+    std::coroutine_handle<> continuation{std::noop_coroutine()};
+
+    Task get_return_object() {
+      return Task{Handle::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    auto final_suspend() noexcept {
+      struct Final {
+        bool await_ready() noexcept {
+          return false;
+        }
+        std::coroutine_handle<> await_suspend(Handle h) noexcept {
+          return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+      };
+      return Final{};
+    }
+
+    void unhandled_exception() {
+      this->error = std::current_exception();
+    }
+  };
+
+  Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) {
+    handle.promise().continuation = waiter;
+    return handle;
+  }
+
+  T await_resume() {
+    return handle.promise().get();
+  }
+
+ private:
+  Handle handle;
+
+  explicit Task(Handle handle) : handle(handle) {}
+};
+
+namespace detail {
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() {
+      return {};
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+struct Signal {
+  std::mutex lock;
+  std::condition_variable cv;
+  bool done{false};
+};
+
+template <typename T>
+Detached run_and_signal(Task<T>& task, Outcome<T>& outcome, Signal& signal) {
+  try {
+    if constexpr (std::is_void_v<T>) {
+      co_await task;
+    } else {
+      outcome.value.emplace(co_await task);
+    }
+  } catch (...) {
+    outcome.error = std::current_exception();
+  }
+  // Notify with the lock held: the waiter can not return and destroy `signal` before we are done with it.
+  std::lock_guard g(signal.lock);
+  signal.done = true;
+  signal.cv.notify_one();
+}
+}  // namespace detail
+
+/// Block the calling thread until `task` completes, for callers outside of any event loop.
+template <typename T>
+T sync_wait(Task<T> task) {
+  detail::Outcome<T> outcome;
+  detail::Signal signal;
+  detail::run_and_signal(task, outcome, signal);
+  std::unique_lock g(signal.lock);
+  signal.cv.wait(g, [&] { return signal.done; });
+  return outcome.get();
+}
+
+/// Coroutine yielding a sequence of T, which may co_await between items.
+/// `while (auto* item = co_await generator.next())`; the item is valid until the next call to next().
+template <typename T>
+struct [[nodiscard]] AsyncGenerator {
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct promise_type {
+    T* current{nullptr};
+    std::coroutine_handle<> consumer;
+    std::exception_ptr error;
+
+    AsyncGenerator get_return_object() {
+      return AsyncGenerator{Handle::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    // Back to the consumer, which is waiting in next().
+    struct ToConsumer {
+      bool await_ready() noexcept {
+        return false;
+      }
+      std::coroutine_handle<> await_suspend(Handle h) noexcept {
+        return h.promise().consumer;
+      }
+      void await_resume() noexcept {}
+    };
+
+    ToConsumer final_suspend() noexcept {
+      current = nullptr;
+      return {};
+    }
+
+    ToConsumer yield_value(T& value) noexcept {
+      current = &value;
+      return {};
+    }
+
+    ToConsumer yield_value(T&& value) noexcept {
+      current = &value;
+      return {};
+    }
+
+    void return_void() {}
+
+    void unhandled_exception() {
+      error = std::current_exception();
+    }
+  };
+
+  AsyncGenerator(AsyncGenerator&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+  AsyncGenerator(const AsyncGenerator&) = delete;
+  AsyncGenerator& operator=(const AsyncGenerator&) = delete;
+
+  ~AsyncGenerator() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  /// \return awaitable of the next item, nullptr once the generator is done
+  auto next() {
+    struct Next {
+      Handle producer;
+
+      bool await_ready() noexcept {
+        return producer.done();
+      }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept {
+        producer.promise().consumer = consumer;
+        return producer;
+      }
+      T* await_resume() {
+        auto& promise = producer.promise();
+        if (promise.error) {
+          std::rethrow_exception(std::exchange(promise.error, {}));
+        }
+        return producer.done() ? nullptr : promise.current;
+      }
+    };
+    return Next{handle};
+  }
+
+ private:
+  Handle handle;
+
+  explicit AsyncGenerator(Handle handle) : handle(handle) {}
+};
+}  // namespace tsdb
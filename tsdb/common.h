@@ -3,10 +3,17 @@
 //
 
 #pragma once
+#include <bit>
+#include <cstddef>
+#include <cstdint>
 namespace tsdb {
+// Default sector size. Storage layouts can use another power of two, see IO::sector_size.
 const static uint32_t sector_size = 512;
+
+template <uint32_t SectorSize = sector_size>
 inline size_t min_sector_for_size(size_t bytes) {
-  return ((bytes - 1) & (~(sector_size - 1))) / 512 + 1;
+  static_assert(std::has_single_bit(SectorSize));
+  return ((bytes - 1) & ~(size_t)(SectorSize - 1)) / SectorSize + 1;
 }
 
 typedef uint32_t RelativeSectorAddress;
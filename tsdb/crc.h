@@ -2,15 +2,53 @@
 // Created by wuyua on 2023/1/17.
 //
 #pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 namespace tsdb {
+namespace crc_detail {
+/// a * b mod poly over GF(2), MSB-first (bit 31 is the highest coefficient).
+constexpr uint32_t multiply_mod(uint32_t a, uint32_t b, uint32_t poly) {
+  uint32_t r = 0;
+  for (int i = 31; i >= 0; --i) {
+    r = (r & (1u << 31)) ? (r << 1) ^ poly : (r << 1);
+    if ((a >> i) & 1) {
+      r ^= b;
+    }
+  }
+  return r;
+}
+
+/// x^n mod poly
+constexpr uint32_t x_pow_mod(uint64_t n, uint32_t poly) {
+  uint32_t result = 1;
+  uint32_t square = 2;  // x^1
+  while (n) {
+    if (n & 1) {
+      result = multiply_mod(result, square, poly);
+    }
+    square = multiply_mod(square, square, poly);
+    n >>= 1;
+  }
+  return result;
+}
+}  // namespace crc_detail
+
 template <typename T>
 struct CRC {
  protected:
   uint32_t poly;
+  uint32_t init;
   uint32_t crc;
 
  public:
-  explicit CRC(uint32_t poly = 0x04C11DB7, uint32_t init = UINT32_MAX) : poly(poly), crc(init) {}
+  explicit CRC(uint32_t poly = 0x04C11DB7, uint32_t init = UINT32_MAX) : poly(poly), init(init), crc(init) {}
 
   void update(const void* data, size_t len) {
     return static_cast<T*>(this)->update(data, len, poly);
@@ -19,6 +57,19 @@ struct CRC {
   uint32_t get() {
     return crc;
   }
+
+  /// CRC of the concatenation A + B, given crc_a of A and crc_b of B. Both must have been computed from this
+  /// policy's initial value.
+  /// \param len_b length of B in bytes
+  [[nodiscard]] uint32_t combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) const {
+    // crc(A + B) = crc(A) * x^(8 len_b) + B * x^32, and crc(B) already carries init * x^(8 len_b).
+    return crc_detail::multiply_mod(crc_a ^ init, crc_detail::x_pow_mod(8 * len_b, poly), poly) ^ crc_b;
+  }
+
+  /// Append the checksum of a chunk that was computed separately, as if update() had been called with its data.
+  void append(uint32_t crc_b, uint64_t len_b) {
+    crc = combine(crc, crc_b, len_b);
+  }
 };
 
 struct CRCDefault : CRC<CRCDefault> {
@@ -39,4 +90,191 @@ struct CRCDefault : CRC<CRCDefault> {
   }
 };
 
-}  // namespace tsdb
\ No newline at end of file
+namespace crc_detail {
+/// Lookup tables for MSB-first CRC. tables[0] is the classic byte-wise table; tables[k][i] is the CRC of byte i
+/// followed by k zero bytes, which lets slicing-by-N consume N bytes with N independent lookups.
+template <size_t N_SLICES, uint32_t POLY>
+constexpr std::array<std::array<uint32_t, 256>, N_SLICES> make_slicing_tables() {
+  std::array<std::array<uint32_t, 256>, N_SLICES> tables{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i << 24;
+    for (int bit = 0; bit < 8; ++bit) {
+      c = (c & (1u << 31)) ? (c << 1) ^ POLY : (c << 1);
+    }
+    tables[0][i] = c;
+  }
+  for (size_t k = 1; k < N_SLICES; ++k) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      auto prev = tables[k - 1][i];
+      tables[k][i] = (prev << 8) ^ tables[0][prev >> 24];
+    }
+  }
+  return tables;
+}
+
+inline uint32_t load_be32(const uint8_t* p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+}  // namespace crc_detail
+
+/// Table driven CRC producing the same result as CRCDefault. The tables are generated at compile time,
+/// N_SLICES (4, 8 or 16) bytes are consumed per iteration.
+template <size_t N_SLICES = 8, uint32_t POLY = 0x04C11DB7>
+struct CRCTable : CRC<CRCTable<N_SLICES, POLY>> {
+  static_assert(N_SLICES == 4 || N_SLICES == 8 || N_SLICES == 16, "slicing-by-4, 8 or 16 only");
+  constexpr static auto tables = crc_detail::make_slicing_tables<N_SLICES, POLY>();
+
+  explicit CRCTable(uint32_t init = 0) : CRC<CRCTable>(POLY, init) {}
+
+  void update(const void* data, size_t len) {
+    const auto* buffer = (const uint8_t*)data;
+    uint32_t c = this->crc;
+
+    while (len >= N_SLICES) {
+      uint32_t result = 0;
+      for (size_t w = 0; w < N_SLICES / 4; ++w) {
+        uint32_t word = crc_detail::load_be32(buffer + w * 4);
+        if (w == 0) {
+          word ^= c;
+        }
+        const auto t = N_SLICES - 1 - w * 4;
+        result ^= tables[t][word >> 24] ^
+                  tables[t - 1][(word >> 16) & 0xff] ^
+                  tables[t - 2][(word >> 8) & 0xff] ^
+                  tables[t - 3][word & 0xff];
+      }
+      c = result;
+      buffer += N_SLICES;
+      len -= N_SLICES;
+    }
+
+    while (len--) {
+      c = (c << 8) ^ tables[0][(c >> 24) ^ *buffer++];
+    }
+    this->crc = c;
+  }
+};
+
+/// CRC folding with carry-less multiplication (PCLMULQDQ). Same result as CRCDefault. The CPU is probed once at
+/// runtime; without PCLMULQDQ/SSSE3 (or on non-x86 targets) it falls back to CRCTable.
+struct CRCClmul : CRC<CRCClmul> {
+  constexpr static uint32_t POLY = 0x04C11DB7;
+  // Buffers shorter than this are not worth the setup of the folding loop.
+  constexpr static size_t min_clmul_len = 64;
+
+  explicit CRCClmul(uint32_t init = 0) : CRC(POLY, init) {}
+
+  void update(const void* data, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (len >= min_clmul_len && hardware_supported()) {
+      crc = fold(crc, (const uint8_t*)data, len);
+      return;
+    }
+#endif
+    CRCTable<8, POLY> table(crc);
+    table.update(data, len);
+    crc = table.get();
+  }
+
+  static bool hardware_supported() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+    return supported;
+#else
+    return false;
+#endif
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+ private:
+  constexpr static uint32_t k_x128 = crc_detail::x_pow_mod(128, POLY);
+  constexpr static uint32_t k_x192 = crc_detail::x_pow_mod(128 + 64, POLY);
+  constexpr static uint32_t k_x512 = crc_detail::x_pow_mod(512, POLY);
+  constexpr static uint32_t k_x576 = crc_detail::x_pow_mod(512 + 64, POLY);
+
+  __attribute__((target("ssse3"))) static __m128i load_reversed(const uint8_t* p, __m128i byte_reverse) {
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), byte_reverse);
+  }
+
+  __attribute__((target("pclmul"))) static __m128i fold_into(__m128i x, __m128i next, __m128i k) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00)), next);
+  }
+
+  /// Folds 16-byte blocks while keeping the message congruent mod P: a block X = H * x^64 + L that is followed by
+  /// n bits is replaced by H * (x^(n+64) mod P) + L * (x^n mod P), which is xor-ed into the block n bits later.
+  /// The remaining 16 bytes plus the tail (< 16 bytes) are finished with the table.
+  __attribute__((target("pclmul,ssse3"))) static uint32_t fold(uint32_t crc, const uint8_t* buffer, size_t len) {
+    const __m128i byte_reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k_fold_4 = _mm_set_epi64x(k_x576, k_x512);
+    const __m128i k_fold_1 = _mm_set_epi64x(k_x192, k_x128);
+
+    auto load = [&](size_t offset) { return load_reversed(buffer + offset, byte_reverse); };
+
+    // Xor-ing the initial value into the first 4 bytes makes the rest a zero-init CRC.
+    __m128i x0 = _mm_xor_si128(load(0), _mm_set_epi32((int)crc, 0, 0, 0));
+    __m128i x1 = load(16);
+    __m128i x2 = load(32);
+    __m128i x3 = load(48);
+    buffer += 64;
+    len -= 64;
+
+    while (len >= 64) {
+      x0 = fold_into(x0, load(0), k_fold_4);
+      x1 = fold_into(x1, load(16), k_fold_4);
+      x2 = fold_into(x2, load(32), k_fold_4);
+      x3 = fold_into(x3, load(48), k_fold_4);
+      buffer += 64;
+      len -= 64;
+    }
+
+    x0 = fold_into(x0, x1, k_fold_1);
+    x0 = fold_into(x0, x2, k_fold_1);
+    x0 = fold_into(x0, x3, k_fold_1);
+    while (len >= 16) {
+      x0 = fold_into(x0, load(0), k_fold_1);
+      buffer += 16;
+      len -= 16;
+    }
+
+    alignas(16) uint8_t rest[16];
+    _mm_store_si128((__m128i*)rest, _mm_shuffle_epi8(x0, byte_reverse));
+    CRCTable<8, POLY> table;
+    table.update(rest, sizeof(rest));
+    table.update(buffer, len);
+    return table.get();
+  }
+#endif
+};
+
+/// Checksum a buffer with n_workers threads, each handling one contiguous chunk, merged with CRC::combine.
+template <typename TCRC>
+uint32_t parallel_checksum(const void* data, size_t len, unsigned n_workers) {
+  // Below this per-worker size, thread startup costs more than the checksum itself.
+  constexpr size_t min_chunk_size = 64 * 1024;
+  n_workers = std::max(1u, std::min<unsigned>(n_workers, len / min_chunk_size));
+
+  TCRC crc_computer;
+  if (n_workers == 1) {
+    crc_computer.update(data, len);
+    return crc_computer.get();
+  }
+
+  const auto* buffer = (const uint8_t*)data;
+  size_t chunk_size = (len + n_workers - 1) / n_workers;
+  std::vector<std::future<uint32_t>> chunks;
+  for (size_t offset = 0; offset < len; offset += chunk_size) {
+    auto chunk_len = std::min(chunk_size, len - offset);
+    chunks.push_back(std::async(std::launch::async, [=] {
+      TCRC chunk_crc;
+      chunk_crc.update(buffer + offset, chunk_len);
+      return chunk_crc.get();
+    }));
+  }
+
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    crc_computer.append(chunks[i].get(), std::min(chunk_size, len - i * chunk_size));
+  }
+  return crc_computer.get();
+}
+
+}  // namespace tsdb
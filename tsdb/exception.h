@@ -3,6 +3,7 @@
 //
 
 #pragma once
+#include <stdexcept>
 #include <string>
 namespace tsdb {
 
@@ -17,4 +18,9 @@ struct CorruptedDataError : Error {
 struct IOError : Error {
   explicit IOError(const std::string& msg) : Error(msg) {}
 };
+
+/// The data of an entry was overwritten by the writer while it was being read without the series lock.
+struct EntryOverwrittenError : Error {
+  explicit EntryOverwrittenError(const std::string& msg) : Error(msg) {}
+};
 }  // namespace tsdb
\ No newline at end of file
@@ -0,0 +1,301 @@
+//
+// Sector IO on a regular file or a block device.
+//
+
+#pragma once
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "io.h"
+
+namespace tsdb {
+
+struct FileSectorIOConfig {
+  // Open with O_DIRECT. Buffers not aligned to `alignment` (the device's logical block size, usually 512 or 4096)
+  // are copied through an aligned bounce buffer. 0 for the sector size of the IO; a power of two up to it otherwise.
+  bool direct{false};
+  uint32_t alignment{0};
+  SyncPolicy sync_policy{SyncPolicy::on_flush};
+  // Grow a regular file to this many sectors when it is smaller. 0 keeps the current size.
+  uint32_t n_sectors{0};
+};
+
+template <uint32_t SectorSize = sector_size>
+struct BasicFileSectorIO : IO<BasicFileSectorIO<SectorSize>, SectorSize> {
+  constexpr static uint32_t sector_size = SectorSize;
+
+  /// \throw Error if cfg.alignment is not a power of two, or larger than the sector size
+  explicit BasicFileSectorIO(const std::string& path, const FileSectorIOConfig& cfg = {}) : cfg(cfg) {
+    if (this->cfg.alignment == 0) {
+      this->cfg.alignment = sector_size;
+    }
+    // Sector sized buffers of the callers are the ones that must go to the device without a copy.
+    if (!std::has_single_bit(this->cfg.alignment) || this->cfg.alignment > sector_size) {
+      throw Error("alignment must be a power of two, at most the sector size");
+    }
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (cfg.direct ? O_DIRECT : 0), 0644);
+    if (fd < 0) {
+      throw_errno("Failed to open " + path);
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+      close_fd();
+      throw_errno("Failed to stat " + path);
+    }
+
+    uint64_t size = st.st_size;
+    if (S_ISBLK(st.st_mode)) {
+      if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        close_fd();
+        throw_errno("Failed to get size of " + path);
+      }
+    } else if (size < (uint64_t)cfg.n_sectors * sector_size) {
+      size = (uint64_t)cfg.n_sectors * sector_size;
+      if (ftruncate(fd, size) != 0) {
+        close_fd();
+        throw_errno("Failed to resize " + path);
+      }
+    }
+    total_sectors = size / sector_size;
+  }
+
+  BasicFileSectorIO(const BasicFileSectorIO&) = delete;
+  BasicFileSectorIO& operator=(const BasicFileSectorIO&) = delete;
+
+  ~BasicFileSectorIO() {
+    close_fd();
+  }
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    assert(in);
+    assert(n_sector);
+    check_range(begin_sector, n_sector, "Failed to write sectors");
+
+    if (needs_bounce(in)) {
+      write_through_bounce(in, begin_sector, n_sector);
+    } else {
+      iovec iov{const_cast<void*>(in), (size_t)n_sector * sector_size};
+      transfer(&iov, 1, begin_sector, true);
+    }
+    after_write();
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    assert(n_sector);
+    check_range(begin_sector, n_sector, "Failed to read sectors");
+
+    if (needs_bounce(out)) {
+      read_through_bounce(out, begin_sector, n_sector);
+    } else {
+      iovec iov{out, (size_t)n_sector * sector_size};
+      transfer(&iov, 1, begin_sector, false);
+    }
+  }
+
+  /// Segments that are adjacent on the device are merged into a single pwritev.
+  void writev_sectors(std::span<const WriteSegment> segments) {
+    for (auto& s : segments) {
+      check_range(s.begin_sector, s.n_sector, "Failed to write sectors");
+    }
+
+    iovec iov[max_iov];
+    size_t n_iov = 0;
+    uint32_t run_begin = 0;
+    uint32_t run_end = 0;
+    auto submit_run = [&] {
+      if (n_iov) {
+        transfer(iov, n_iov, run_begin, true);
+        n_iov = 0;
+      }
+    };
+
+    for (auto& s : segments) {
+      if (needs_bounce(s.in)) {
+        submit_run();
+        write_through_bounce(s.in, s.begin_sector, s.n_sector);
+        continue;
+      }
+      if (n_iov == 0 || s.begin_sector != run_end || n_iov == max_iov) {
+        submit_run();
+        run_begin = s.begin_sector;
+      }
+      iov[n_iov++] = {const_cast<void*>(s.in), (size_t)s.n_sector * sector_size};
+      run_end = s.begin_sector + s.n_sector;
+    }
+    submit_run();
+    after_write();
+  }
+
+  void readv_sectors(std::span<const ReadSegment> segments) {
+    for (auto& s : segments) {
+      check_range(s.begin_sector, s.n_sector, "Failed to read sectors");
+    }
+
+    iovec iov[max_iov];
+    size_t n_iov = 0;
+    uint32_t run_begin = 0;
+    uint32_t run_end = 0;
+    auto submit_run = [&] {
+      if (n_iov) {
+        transfer(iov, n_iov, run_begin, false);
+        n_iov = 0;
+      }
+    };
+
+    for (auto& s : segments) {
+      if (needs_bounce(s.out)) {
+        submit_run();
+        read_through_bounce(s.out, s.begin_sector, s.n_sector);
+        continue;
+      }
+      if (n_iov == 0 || s.begin_sector != run_end || n_iov == max_iov) {
+        submit_run();
+        run_begin = s.begin_sector;
+      }
+      iov[n_iov++] = {s.out, (size_t)s.n_sector * sector_size};
+      run_end = s.begin_sector + s.n_sector;
+    }
+    submit_run();
+  }
+
+  uint32_t n_sectors() { return total_sectors; }
+
+  void flush() {
+    if (cfg.sync_policy == SyncPolicy::on_flush) {
+      sync();
+    }
+  }
+
+  /// Unconditional fdatasync.
+  void sync() {
+    if (fdatasync(fd) != 0) {
+      throw_errno("Failed to sync");
+    }
+    n_syncs++;
+  }
+
+  [[nodiscard]] size_t sync_count() const {
+    return n_syncs;
+  }
+
+ private:
+  constexpr static size_t max_iov = 64;
+  // Unaligned O_DIRECT transfers are split into chunks of this size.
+  constexpr static uint32_t bounce_sectors = 128;
+
+  FileSectorIOConfig cfg;
+  int fd{-1};
+  uint32_t total_sectors{0};
+  std::atomic<size_t> n_syncs{0};
+
+  [[noreturn]] static void throw_errno(const std::string& msg) {
+    throw IOError(msg + ": " + strerror(errno));
+  }
+
+  void close_fd() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  void check_range(uint32_t begin_sector, uint32_t n_sector, const char* msg) const {
+    if ((uint64_t)begin_sector + n_sector > total_sectors) {
+      throw IOError(msg);
+    }
+  }
+
+  bool needs_bounce(const void* buffer) const {
+    return cfg.direct && ((uintptr_t)buffer % cfg.alignment) != 0;
+  }
+
+  void after_write() {
+    if (cfg.sync_policy == SyncPolicy::every_write) {
+      sync();
+    }
+  }
+
+  /// preadv/pwritev until everything is transferred. iov is consumed.
+  void transfer(iovec* iov, size_t n_iov, uint32_t begin_sector, bool write) {
+    off_t offset = (off_t)begin_sector * sector_size;
+    while (n_iov) {
+      auto n = write ? pwritev(fd, iov, (int)n_iov, offset) : preadv(fd, iov, (int)n_iov, offset);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw_errno(write ? "Failed to write sectors" : "Failed to read sectors");
+      }
+      if (n == 0) {
+        throw IOError(write ? "Failed to write sectors: no progress" : "Failed to read sectors: end of file");
+      }
+      offset += n;
+      while (n_iov && (size_t)n >= iov->iov_len) {
+        n -= (ssize_t)iov->iov_len;
+        iov++;
+        n_iov--;
+      }
+      if (n_iov) {
+        iov->iov_base = (uint8_t*)iov->iov_base + n;
+        iov->iov_len -= n;
+      }
+    }
+  }
+
+  /// Aligned scratch buffer for O_DIRECT transfers from unaligned memory. Per thread, the IO may be shared.
+  uint8_t* bounce_buffer() const {
+    struct Deleter {
+      void operator()(uint8_t* p) const { free(p); }
+    };
+    static thread_local std::unique_ptr<uint8_t, Deleter> buffer;
+    static thread_local uint32_t buffer_alignment = 0;
+    if (!buffer || buffer_alignment < cfg.alignment) {
+      auto size = (size_t)bounce_sectors * sector_size;
+      buffer.reset((uint8_t*)aligned_alloc(cfg.alignment, (size + cfg.alignment - 1) / cfg.alignment * cfg.alignment));
+      if (!buffer) {
+        throw std::bad_alloc();
+      }
+      buffer_alignment = cfg.alignment;
+    }
+    return buffer.get();
+  }
+
+  void write_through_bounce(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    auto bounce = bounce_buffer();
+    for (uint32_t done = 0; done < n_sector;) {
+      auto n = std::min(bounce_sectors, n_sector - done);
+      memcpy(bounce, (const uint8_t*)in + (size_t)done * sector_size, (size_t)n * sector_size);
+      iovec iov{bounce, (size_t)n * sector_size};
+      transfer(&iov, 1, begin_sector + done, true);
+      done += n;
+    }
+  }
+
+  void read_through_bounce(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    auto bounce = bounce_buffer();
+    for (uint32_t done = 0; done < n_sector;) {
+      auto n = std::min(bounce_sectors, n_sector - done);
+      iovec iov{bounce, (size_t)n * sector_size};
+      transfer(&iov, 1, begin_sector + done, false);
+      memcpy((uint8_t*)out + (size_t)done * sector_size, bounce, (size_t)n * sector_size);
+      done += n;
+    }
+  }
+};
+
+using FileSectorIO = BasicFileSectorIO<>;
+}  // namespace tsdb
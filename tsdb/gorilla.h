@@ -0,0 +1,262 @@
+//
+// Gorilla style compression of (timestamp, double) points: delta-of-delta timestamps and XOR encoded values.
+//
+
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "exception.h"
+
+namespace tsdb {
+
+struct BitWriter {
+  explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+  /// Append the low `n_bits` of `value`, most significant first.
+  void write(uint64_t value, unsigned n_bits) {
+    assert(n_bits <= 64);
+    while (n_bits) {
+      if (bit_pos == 0) {
+        out.push_back(0);
+      }
+      auto n = std::min(n_bits, 8 - bit_pos);
+      auto chunk = (uint8_t)((value >> (n_bits - n)) & ((1u << n) - 1));
+      out.back() |= chunk << (8 - bit_pos - n);
+      bit_pos = (bit_pos + n) % 8;
+      n_bits -= n;
+    }
+  }
+
+  /// Continue at a byte boundary, e.g. after the owner cleared `out`.
+  void align() {
+    bit_pos = 0;
+  }
+
+ private:
+  std::vector<uint8_t>& out;
+  unsigned bit_pos{0};
+};
+
+struct BitReader {
+  explicit BitReader(std::span<const uint8_t> in) : in(in) {}
+
+  uint64_t read(unsigned n_bits) {
+    assert(n_bits <= 64);
+    if (pos + n_bits > in.size() * 8) {
+      throw CorruptedDataError("Bit stream truncated");
+    }
+    uint64_t value = 0;
+    while (n_bits) {
+      auto bit_pos = (unsigned)(pos % 8);
+      auto n = std::min(n_bits, 8 - bit_pos);
+      auto chunk = (in[pos / 8] >> (8 - bit_pos - n)) & ((1u << n) - 1);
+      value = (value << n) | chunk;
+      pos += n;
+      n_bits -= n;
+    }
+    return value;
+  }
+
+  bool read_bit() {
+    return read(1);
+  }
+
+ private:
+  std::span<const uint8_t> in;
+  size_t pos{0};
+};
+
+/// Block layout: uint32 point count, then the bit stream. The first point is stored raw; after it each timestamp is
+/// the delta of its delta, in the variable width buckets of the Gorilla paper, and each value is XORed with the previous
+/// one, storing only the meaningful bits.
+struct GorillaEncoder {
+  /// Upper bound of the bytes a single point adds to a block.
+  constexpr static size_t max_point_bytes = (4 + 64 + 2 + 5 + 6 + 64) / 8 + 1;
+
+  explicit GorillaEncoder(std::vector<uint8_t>& out) : out(out), bits(out) {
+    reset();
+  }
+
+  /// Start a new block in the same buffer.
+  void reset() {
+    out.clear();
+    out.resize(sizeof(uint32_t));
+    bits.align();
+    n_points = 0;
+    previous_delta = 0;
+    previous_leading = UINT32_MAX;
+    previous_trailing = 0;
+  }
+
+  void append(uint64_t timestamp, double value) {
+    uint64_t value_bits;
+    memcpy(&value_bits, &value, sizeof(value_bits));
+
+    if (n_points == 0) {
+      bits.write(timestamp, 64);
+      bits.write(value_bits, 64);
+    } else {
+      append_timestamp(timestamp);
+      append_value(value_bits);
+    }
+    previous_timestamp = timestamp;
+    previous_value = value_bits;
+    n_points++;
+    memcpy(out.data(), &n_points, sizeof(n_points));
+  }
+
+  [[nodiscard]] uint32_t size() const {
+    return n_points;
+  }
+
+  [[nodiscard]] size_t bytes() const {
+    return out.size();
+  }
+
+ private:
+  std::vector<uint8_t>& out;
+  BitWriter bits;
+  uint32_t n_points{0};
+  uint64_t previous_timestamp{0};
+  int64_t previous_delta{0};
+  uint64_t previous_value{0};
+  unsigned previous_leading{UINT32_MAX};
+  unsigned previous_trailing{0};
+
+  void append_timestamp(uint64_t timestamp) {
+    auto delta = (int64_t)(timestamp - previous_timestamp);
+    auto dod = delta - previous_delta;
+    previous_delta = delta;
+
+    if (dod == 0) {
+      bits.write(0b0, 1);
+    } else if (dod >= -64 && dod <= 63) {
+      bits.write(0b10, 2);
+      bits.write((uint64_t)dod, 7);
+    } else if (dod >= -256 && dod <= 255) {
+      bits.write(0b110, 3);
+      bits.write((uint64_t)dod, 9);
+    } else if (dod >= -2048 && dod <= 2047) {
+      bits.write(0b1110, 4);
+      bits.write((uint64_t)dod, 12);
+    } else {
+      bits.write(0b1111, 4);
+      bits.write((uint64_t)dod, 64);
+    }
+  }
+
+  void append_value(uint64_t value_bits) {
+    auto x = value_bits ^ previous_value;
+    if (x == 0) {
+      bits.write(0b0, 1);
+      return;
+    }
+
+    // The leading zero count is stored in 5 bits.
+    auto leading = std::min((unsigned)std::countl_zero(x), 31u);
+    auto trailing = (unsigned)std::countr_zero(x);
+    if (previous_leading != UINT32_MAX && leading >= previous_leading && trailing >= previous_trailing) {
+      // Fits in the previous window.
+      bits.write(0b10, 2);
+      bits.write(x >> previous_trailing, 64 - previous_leading - previous_trailing);
+      return;
+    }
+
+    auto meaningful = 64 - leading - trailing;
+    bits.write(0b11, 2);
+    bits.write(leading, 5);
+    // 64 meaningful bits do not fit in 6 bits; 0 stands for 64 since there is always at least one.
+    bits.write(meaningful & 63, 6);
+    bits.write(x >> trailing, meaningful);
+    previous_leading = leading;
+    previous_trailing = trailing;
+  }
+};
+
+struct GorillaDecoder {
+  explicit GorillaDecoder(std::span<const uint8_t> block) : bits(block.size() >= sizeof(uint32_t) ? block.subspan(sizeof(uint32_t)) : block) {
+    if (block.size() < sizeof(uint32_t)) {
+      throw CorruptedDataError("Numeric block too small");
+    }
+    memcpy(&n_points, block.data(), sizeof(n_points));
+  }
+
+  [[nodiscard]] uint32_t size() const {
+    return n_points;
+  }
+
+  /// \return false once every point was decoded.
+  bool next(uint64_t& timestamp, double& value) {
+    if (n_decoded == n_points) {
+      return false;
+    }
+    if (n_decoded == 0) {
+      previous_timestamp = bits.read(64);
+      previous_value = bits.read(64);
+    } else {
+      previous_delta += read_dod();
+      previous_timestamp += previous_delta;
+      previous_value ^= read_xor();
+    }
+    n_decoded++;
+    timestamp = previous_timestamp;
+    memcpy(&value, &previous_value, sizeof(value));
+    return true;
+  }
+
+ private:
+  BitReader bits;
+  uint32_t n_points{0};
+  uint32_t n_decoded{0};
+  uint64_t previous_timestamp{0};
+  int64_t previous_delta{0};
+  uint64_t previous_value{0};
+  unsigned previous_leading{0};
+  unsigned previous_trailing{0};
+
+  static int64_t sign_extend(uint64_t value, unsigned n_bits) {
+    auto shift = 64 - n_bits;
+    return (int64_t)(value << shift) >> shift;
+  }
+
+  int64_t read_dod() {
+    if (!bits.read_bit()) {
+      return 0;
+    }
+    if (!bits.read_bit()) {
+      return sign_extend(bits.read(7), 7);
+    }
+    if (!bits.read_bit()) {
+      return sign_extend(bits.read(9), 9);
+    }
+    if (!bits.read_bit()) {
+      return sign_extend(bits.read(12), 12);
+    }
+    return (int64_t)bits.read(64);
+  }
+
+  uint64_t read_xor() {
+    if (!bits.read_bit()) {
+      return 0;
+    }
+    if (bits.read_bit()) {
+      previous_leading = bits.read(5);
+      auto meaningful = (unsigned)bits.read(6);
+      if (meaningful == 0) {
+        meaningful = 64;
+      }
+      if (previous_leading + meaningful > 64) {
+        throw CorruptedDataError("Bad XOR window");
+      }
+      previous_trailing = 64 - previous_leading - meaningful;
+    }
+    return bits.read(64 - previous_leading - previous_trailing) << previous_trailing;
+  }
+};
+}  // namespace tsdb
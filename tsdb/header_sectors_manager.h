@@ -2,13 +2,18 @@
 // Created by wuyua on 2023/1/16.
 //
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <memory>
+#include <optional>
+#include <span>
 #include <vector>
 
 #include "crc.h"
 #include "exception.h"
+#include "io.h"
 #include "sector_defs.h"
 //#define TSDB_DEBUG
 #ifdef TSDB_DEBUG
@@ -21,19 +26,47 @@
 namespace tsdb {
 template <typename IO, typename CRC = CRCDefault, typename ClockType = std::chrono::system_clock>
 struct HeaderSectorsManager {
+  // The layout follows the sector size of the IO.
+  constexpr static uint32_t sector_size = IO::sector_size;
+  using HeaderSector = BasicHeaderSector<sector_size>;
+  using CheckpointSector = BasicCheckpointSector<sector_size>;
+
   explicit HeaderSectorsManager(
       IO& io,
       uint32_t begin_sector_addr,
       uint32_t n_header_sectors,
-      uint32_t n_total_sectors)
+      uint32_t n_total_sectors,
+      bool use_checkpoint = false)
       : io(io),
         begin_sector_addr(begin_sector_addr),
         n_header_sectors(n_header_sectors),
-        n_total_sectors(n_total_sectors) {
-    assert(n_header_sectors < n_total_sectors);
+        n_total_sectors(n_total_sectors),
+        use_checkpoint(use_checkpoint) {
+    assert(n_header_sectors + use_checkpoint < n_total_sectors);
     init();
   }
 
+  HeaderSectorsManager(const HeaderSectorsManager&) = delete;
+  HeaderSectorsManager& operator=(const HeaderSectorsManager&) = delete;
+
+  /// A clean shutdown saves the checkpoint of the last header write, if it was not written yet.
+  ~HeaderSectorsManager() {
+    if (!use_checkpoint || n_unsaved_checkpoints == 0) {
+      return;
+    }
+    try {
+      io.write_sectors(checkpoint.get(), checkpoint_sector_addr(), 1);
+      io.flush();
+    } catch (...) {
+      // The next start falls back to the scan.
+    }
+  }
+
+  /// Header writes between two checkpoint writes, sync_current_sector() included. Keeps the checkpoint sector from
+  /// wearing out faster than the header sectors when every insert is synced; a restart after a sync that left the
+  /// checkpoint stale falls back to the scan, and a clean shutdown writes it anyway.
+  constexpr static uint32_t checkpoint_interval = 16;
+
  private:
   IO& io;
 
@@ -41,84 +74,218 @@ struct HeaderSectorsManager {
   const uint32_t begin_sector_addr;
   const uint32_t n_header_sectors;
   const uint32_t n_total_sectors;
-  const uint32_t n_data_sectors{n_total_sectors - n_header_sectors};
+  // The last sector of the partition holds a CheckpointSector.
+  const bool use_checkpoint;
+  const uint32_t n_data_sectors{n_total_sectors - n_header_sectors - use_checkpoint};
 
   std::unique_ptr<HeaderSector> current_header_sector{std::make_unique<HeaderSector>()};
+  // With checkpoints, the next header sector is read before the current one is written, see advance_header_sector.
+  std::unique_ptr<HeaderSector> next_header_sector;
+  // Describes the state of the last header write; only written to the device every checkpoint_interval header writes.
+  std::unique_ptr<CheckpointSector> checkpoint;
+  uint32_t n_unsaved_checkpoints{0};
   uint32_t current_header_sector_idx{0};
   uint32_t current_slot_idx{0};
 
   // Offset from the first data sector
   uint32_t current_data_sector_offset{0};
+  // Data sectors handed out since construction, including the ones skipped at the end of the ring. Only grows, and is
+  // the one member read without the owner's lock, see allocated_sectors().
+  std::atomic<uint64_t> n_allocated_sectors{0};
 
   uint64_t previous_timestamp{0};
 
+  std::vector<WriteSegment> write_batch;
+  size_t n_header_writes{0};
+
+  // In-RAM copy of the live entries, oldest first, so reads never touch the header sectors on the device.
+  // A ring with one slot per header slot: it is sized once, when first built, and never reallocates.
+  std::vector<LogEntry> index;
+  size_t index_begin{0};
+  size_t index_size{0};
+  // A restart from a checkpoint leaves the index to the first get_entries.
+  bool index_loaded{false};
+
  protected:
+  /// Reads all header sectors in one request, then checks their CRC and locates the write head in a single pass.
+  /// The index is built from the same copy, so startup costs one device read plus a write per corrupted sector.
+  /// On a read only IO the repairs and the checkpoint stay in RAM.
   void init() {
-    TSDB_LOG("Checking CRC");
-    // Check crc of each header sector. If bad, clear the sector
-    for (int i = 0; i < n_header_sectors; ++i) {
-      load_header_sector(i);
-      if (!current_header_sector->check_crc<CRC>()) {
-        TSDB_LOG("Sector {} CRC error!", i);
-        current_header_sector->clear();
-        sync_current_sector();
+    if (use_checkpoint) {
+      next_header_sector = std::make_unique<HeaderSector>();
+      checkpoint = std::make_unique<CheckpointSector>();
+      if (load_checkpoint()) {
+        return;
       }
+      TSDB_LOG("Checkpoint is stale or corrupted, scanning the header sectors");
     }
 
+    std::vector<HeaderSector> sectors(n_header_sectors);
+    io.read_sectors(sectors.data(), begin_sector_addr, n_header_sectors);
+
+    bool repaired = false;
+    int head_sector = -1;
     uint64_t monotonic_sectors_least_timestamp = UINT64_MAX;
     int least_timestamp_sector = -1;
 
-    // Search through header sectors, find the available slot (last written one + 1 or the first slot)
     for (int i = 0; i < n_header_sectors; ++i) {
-      load_header_sector(i);
-      auto slot = current_header_sector->find_empty_slot();
-      TSDB_LOG("Empty slot at sector {} = {}", current_header_sector_idx, slot);
+      auto& sector = sectors[i];
+      // Check crc of each header sector. If bad, clear the sector
+      if (!sector.template check_crc<CRC>()) {
+        TSDB_LOG("Sector {} CRC error!", i);
+        sector.clear();
+        sector.write_count++;
+        sector.template update_crc<CRC>();
+        if (!io.read_only()) {
+          io.write_sectors(&sector, begin_sector_addr + i, 1);
+          repaired = true;
+        }
+      }
+      if (head_sector != -1) {
+        continue;
+      }
+
+      // Find the available slot (last written one + 1 or the first slot)
+      auto slot = sector.find_empty_slot();
+      TSDB_LOG("Empty slot at sector {} = {}", i, slot);
       if (slot == -1) {
         // No more slot in this sector, check next.
-        current_data_sector_offset = current_header_sector->entries[HeaderSector::n_entries - 1].end_sector_addr() + 1;
+        current_data_sector_offset = sector.entries[HeaderSector::n_entries - 1].template end_sector_addr<sector_size>() + 1;
         TSDB_LOG("current_data_sector_offset = {}; ", current_data_sector_offset);
 
         // Note in this case, if all sectors are monotonic, it means the last saved state was just at full sector.
         // Then we need to locate the sector starts with the least timestamp. (Monotonic sectors)
-        auto this_timestamp = current_header_sector->entries[0].timestamp;
+        auto this_timestamp = sector.entries[0].timestamp;
         if (this_timestamp < monotonic_sectors_least_timestamp) {
           TSDB_LOG("least timestamp sector updated = {}; timestamp = {} ", i, this_timestamp);
           least_timestamp_sector = i;
           monotonic_sectors_least_timestamp = this_timestamp;
         }
-        continue;
       } else {
         // Found available slot.
         if (slot == 0) {
           // In this case we will use the data sector offset of the previous sector, hence not updating it here.
         } else {
-          current_data_sector_offset = current_header_sector->entries[slot - 1].end_sector_addr() + 1;
+          current_data_sector_offset = sector.entries[slot - 1].template end_sector_addr<sector_size>() + 1;
           TSDB_LOG("current_data_sector_offset = {}", current_data_sector_offset);
         }
         current_slot_idx = slot;
-        return;
+        head_sector = i;
       }
     }
+    if (repaired) {
+      io.flush();
+    }
 
-    // If reach here, this is Monotonic sectors case. We will use the sector with least timestmap;
-    assert(least_timestamp_sector != -1);
+    if (head_sector == -1) {
+      // This is Monotonic sectors case. We will use the sector with least timestmap;
+      assert(least_timestamp_sector != -1);
 
-    // set the current data sector offset to the previous last one;
-    {
+      // set the current data sector offset to the previous last one;
       auto last_prev_sector = least_timestamp_sector - 1;
       if (last_prev_sector < 0) {
         last_prev_sector = n_header_sectors - 1;
       }
-      load_header_sector(last_prev_sector);
-      current_data_sector_offset =
-          current_header_sector->entries[HeaderSector::n_entries - 1].begin_sector_offset +
-          min_sector_for_size(current_header_sector->entries[HeaderSector::n_entries - 1].size);
+      auto& last_entry = sectors[last_prev_sector].entries[HeaderSector::n_entries - 1];
+      current_data_sector_offset = last_entry.begin_sector_offset + min_sector_for_size<sector_size>(last_entry.size);
+
+      head_sector = least_timestamp_sector;
+      current_slot_idx = 0;
+      TSDB_LOG("Monotonic sectors case. use sector {}", head_sector);
     }
 
-    load_header_sector(least_timestamp_sector);
-    current_slot_idx = 0;
+    current_header_sector_idx = head_sector;
+    memcpy(current_header_sector.get(), &sectors[head_sector], sizeof(HeaderSector));
+    build_index(sectors);
+    if (index_size) {
+      // Keep inserts after a restart monotonic, the range lookups rely on it.
+      previous_timestamp = indexed(index_size - 1).timestamp;
+    }
 
-    TSDB_LOG("Monotonic sectors case. use sector {}", current_header_sector_idx);
+    if (use_checkpoint && !io.read_only()) {
+      write_checkpoint();
+    }
+  }
+
+  [[nodiscard]] uint32_t checkpoint_sector_addr() const {
+    return begin_sector_addr + n_total_sectors - 1;
+  }
+
+  /// Restores the write head from the checkpoint sector: one read for the checkpoint, one for the head sector.
+  /// \return false if the checkpoint is corrupted, was written for another layout or is older than the head sector.
+  bool load_checkpoint() {
+    io.read_sectors(checkpoint.get(), checkpoint_sector_addr(), 1);
+    auto& cp = *checkpoint;
+    if (cp.magic != CheckpointSector::magic_value || !cp.template check_crc<CRC>() || cp.n_header_sectors != n_header_sectors ||
+        cp.head_sector_idx >= n_header_sectors || cp.slot_idx >= HeaderSector::n_entries ||
+        cp.data_sector_offset > n_data_sectors) {
+      return false;
+    }
+
+    load_header_sector(cp.head_sector_idx);
+    // Any header write after the checkpoint either rewrote the head sector or advanced past it, which rewrites it too.
+    if (!current_header_sector->template check_crc<CRC>() || current_header_sector->write_count != cp.head_write_count) {
+      return false;
+    }
+
+    current_slot_idx = cp.slot_idx;
+    current_data_sector_offset = cp.data_sector_offset;
+    previous_timestamp = cp.previous_timestamp;
+    TSDB_LOG("Restored from checkpoint {}: sector {} slot {}", (uint64_t)cp.generation, (uint32_t)cp.head_sector_idx, (uint32_t)cp.slot_idx);
+    return true;
+  }
+
+  void fill_checkpoint(uint32_t head_sector_idx, uint32_t head_write_count, uint32_t slot_idx) {
+    auto& cp = *checkpoint;
+    cp.magic = CheckpointSector::magic_value;
+    cp.generation++;
+    cp.n_header_sectors = n_header_sectors;
+    cp.head_sector_idx = head_sector_idx;
+    cp.head_write_count = head_write_count;
+    cp.slot_idx = slot_idx;
+    cp.data_sector_offset = current_data_sector_offset;
+    cp.previous_timestamp = previous_timestamp;
+    cp.template update_crc<CRC>();
+  }
+
+  /// Checkpoints the state as it is on the device, without writing a header sector.
+  void write_checkpoint() {
+    fill_checkpoint(current_header_sector_idx, current_header_sector->write_count, current_slot_idx);
+    io.write_sectors(checkpoint.get(), checkpoint_sector_addr(), 1);
+    io.flush();
+    n_unsaved_checkpoints = 0;
+  }
+
+  /// Writes `pending`, the current header sector and, if enabled and due, a checkpoint pointing at the given head in
+  /// one batch. A checkpoint left behind by later header writes is stale, which load_checkpoint() detects.
+  void write_header_batch(std::span<const WriteSegment> pending, uint32_t head_sector_idx, const HeaderSector& head, uint32_t slot_idx) {
+    current_header_sector->write_count++;
+    current_header_sector->template update_crc<CRC>();
+
+    bool with_checkpoint = false;
+    if (use_checkpoint) {
+      fill_checkpoint(head_sector_idx, head.write_count, slot_idx);
+      with_checkpoint = ++n_unsaved_checkpoints >= checkpoint_interval;
+      if (with_checkpoint) {
+        n_unsaved_checkpoints = 0;
+      }
+    }
+
+    WriteSegment header{current_header_sector.get(), begin_sector_addr + current_header_sector_idx, 1};
+    if (pending.empty() && !with_checkpoint) {
+      io.write_sectors(header.in, header.begin_sector, header.n_sector);
+    } else {
+      // Reused to keep the batch free of allocations once warmed up.
+      write_batch.assign(pending.begin(), pending.end());
+      write_batch.push_back(header);
+      if (with_checkpoint) {
+        write_batch.push_back({checkpoint.get(), checkpoint_sector_addr(), 1});
+      }
+      io.writev_sectors(write_batch);
+    }
+    io.order_last_writes(with_checkpoint ? 2 : 1);
+    io.flush();
+    n_header_writes++;
   }
 
   void load_header_sector(size_t sector_idx) {
@@ -127,44 +294,158 @@ struct HeaderSectorsManager {
   }
 
   /// This function only go backward along the header sectors. No check performed on the validity of the entries.
-  /// \param sector_mem mutable memory. will be loaded to the previous sector mem. For first iteration, load with the current cache.
-  /// \param sector_idx mutable idx, will be set to the previous idx if load occurs.
+  /// \param sectors all header sectors.
+  /// \param sector_idx mutable idx, will be set to the previous idx when stepping over a sector boundary.
   /// \param slot_idx mutable idx. will be set to the idx after step backward.
   /// \return ref to the previous entry.
-  LogEntry& previous_log_entry(std::unique_ptr<HeaderSector>& sector_mem, uint32_t& sector_idx, uint32_t& slot_idx) const {
+  const LogEntry& previous_log_entry(std::span<const HeaderSector> sectors, uint32_t& sector_idx, uint32_t& slot_idx) const {
     if (slot_idx == 0) {
-      if (n_header_sectors == 1) {
-        // single sector and its pointing to 0 = go back to the last entry
-        slot_idx = HeaderSector::n_entries - 1;
-        return sector_mem->entries[slot_idx];
-      }
-      // The last one is in the previous page (may round back to the last)
-      [[maybe_unused]] auto original_sector_idx = sector_idx;
+      // The last one is in the previous sector (may round back to the last, or to this one if there is only one)
       sector_idx = sector_idx == 0 ? n_header_sectors - 1 : sector_idx - 1;
-      TSDB_LOG("sector idx {}->{}", original_sector_idx, sector_idx);
-      io.read_sectors(sector_mem.get(), begin_sector_addr + sector_idx, 1);
       slot_idx = HeaderSector::n_entries - 1;
-      return sector_mem->entries[slot_idx];
     } else {
       slot_idx = slot_idx - 1;
-      return sector_mem->entries[slot_idx];
     }
+    return sectors[sector_idx].entries[slot_idx];
   }
 
-  void advance_header_sector() {
-    // Save the current sector.
-    sync_current_sector();
+  /// Walks the header ring backwards from the newest entry and loads the live entries into the index.
+  void build_index(std::span<const HeaderSector> sectors) {
+    index.resize((size_t)n_header_sectors * HeaderSector::n_entries);
+    index_begin = 0;
+    index_size = 0;
+    index_loaded = true;
 
-    // load the next sector
-    load_header_sector((current_header_sector_idx + 1) % n_header_sectors);
+    uint32_t slot_idx = current_slot_idx;
+    uint32_t sector_idx = current_header_sector_idx;
+
+    // Rules when iterating backward:
+    // 1. If timestamp is zero, the slot was never used.
+    // 2. If the timestamp is no longer monotonically decreasing, the inflecting point is the terminating point (tail reaching head)
+    // 3. If the entry holds the data sectors the newest entry was written over.
+    auto last = previous_log_entry(sectors, sector_idx, slot_idx);
+    TSDB_LOG("last timestamp={}", (uint64_t)last.timestamp);
+    if (last.timestamp == 0) {
+      return;
+    }
+    index_push_front(last);
+
+    uint64_t decreasing_timestamp = last.timestamp;
+    while (index_size < index.size()) {
+      auto& prev = previous_log_entry(sectors, sector_idx, slot_idx);
+      if (prev.timestamp == 0) {
+        TSDB_LOG("Complete with condition 1");
+        break;
+      }
+      if (prev.timestamp > decreasing_timestamp) {
+        TSDB_LOG("Complete with condition 2");
+        break;
+      }
+      decreasing_timestamp = prev.timestamp;
+      if (prev.begin_sector_offset <= last.template end_sector_addr<sector_size>() && prev.template end_sector_addr<sector_size>() >= last.template end_sector_addr<sector_size>()) {
+        TSDB_LOG("Complete with condition 3");
+        break;
+      }
+      index_push_front(prev);
+    }
+    TSDB_LOG("index size = {}", index_size);
+  }
+
+  /// Builds the index from the header sectors on the device, with the cached head sector in place of its stored copy.
+  void load_index() {
+    std::vector<HeaderSector> sectors(n_header_sectors);
+    io.read_sectors(sectors.data(), begin_sector_addr, n_header_sectors);
+    memcpy(&sectors[current_header_sector_idx], current_header_sector.get(), sizeof(HeaderSector));
+    build_index(sectors);
+  }
+
+  [[nodiscard]] const LogEntry& indexed(size_t i) const {
+    return index[(index_begin + i) % index.size()];
+  }
+
+  /// Timestamps never decrease from the oldest entry to the newest, so the index is searched by bisection.
+  /// \return position of the first indexed entry with timestamp >= `timestamp`, index_size if there is none.
+  [[nodiscard]] size_t index_lower_bound(uint64_t timestamp) const {
+    size_t lo = 0;
+    size_t hi = index_size;
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      if (indexed(mid).timestamp < timestamp) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  void index_push_front(const LogEntry& entry) {
+    assert(index_size < index.size());
+    index_begin = (index_begin + index.size() - 1) % index.size();
+    index[index_begin] = entry;
+    index_size++;
+  }
+
+  void index_push_back(const LogEntry& entry) {
+    assert(index_size < index.size());
+    index[(index_begin + index_size) % index.size()] = entry;
+    index_size++;
+  }
+
+  void index_pop_front() {
+    index_begin = (index_begin + 1) % index.size();
+    index_size--;
+  }
+
+  /// Drops the indexed entries whose data sectors `entry` is written over. When the data allocation wrapped to the head,
+  /// the entries left at the tail (begin >= wrapped_from) are older than the ones being overwritten, so they are
+  /// dropped as well. The entry whose header slot is taken is dropped by fill_slot().
+  void evict_overwritten(const LogEntry& entry, uint32_t wrapped_from) {
+    while (index_size && indexed(0).begin_sector_offset >= wrapped_from) {
+      index_pop_front();
+    }
+    while (index_size && indexed(0).begin_sector_offset <= entry.template end_sector_addr<sector_size>() &&
+           indexed(0).template end_sector_addr<sector_size>() >= entry.begin_sector_offset) {
+      index_pop_front();
+    }
+  }
+
+  void advance_header_sector(std::span<const WriteSegment> pending = {}) {
+    auto next_idx = (current_header_sector_idx + 1) % n_header_sectors;
+    if (!use_checkpoint || next_idx == current_header_sector_idx) {
+      // Save the current sector. (A single header sector is its own successor, the checkpoint points back at it.)
+      write_header_batch(pending, next_idx, *current_header_sector, 0);
+
+      // load the next sector
+      load_header_sector(next_idx);
+      return;
+    }
+
+    // Read the next sector first, so the checkpoint written along with this one can already point at it.
+    io.read_sectors(next_header_sector.get(), begin_sector_addr + next_idx, 1);
+    write_header_batch(pending, next_idx, *next_header_sector, 0);
+    std::swap(current_header_sector, next_header_sector);
+    current_header_sector_idx = next_idx;
   }
 
  public:
+  /// Data sectors reserved for an entry by allocate_data().
+  struct DataAllocation {
+    uint32_t begin_sector_offset;
+    uint64_t timestamp;
+  };
+
   /// This method is used when the checksum of the file is not yet known.
   /// The reference to the entry is returned for updating the checksum
   /// After done, call advance_slot().
   /// \return
   LogEntry& add_log_partial(uint32_t data_size, uint64_t timestamp, uint32_t attr = 0) {
+    return fill_slot(allocate_data(data_size, timestamp), data_size, attr);
+  }
+
+  /// Reserve the data sectors of an entry whose header slot is filled later, with fill_slot(). Allocations must be
+  /// given their slots in the order they were made, which keeps the timestamps monotonic.
+  DataAllocation allocate_data(uint32_t data_size, uint64_t timestamp) {
     if (timestamp < previous_timestamp) {
       // This is a bit dangerous?
       timestamp = previous_timestamp + 1;
@@ -175,26 +456,61 @@ struct HeaderSectorsManager {
       throw Error("zero data size");
     }
 
-    size_t required_sectors = min_sector_for_size(data_size);
+    size_t required_sectors = min_sector_for_size<sector_size>(data_size);
     if (required_sectors > n_data_sectors) {
       throw Error("data size too big");
     }
 
+    uint32_t wrapped_from = UINT32_MAX;
+    auto allocated = required_sectors;
     if (required_sectors > n_data_sectors - current_data_sector_offset) {
       // No space on the tail of the data sectors, start from head
+      wrapped_from = current_data_sector_offset;
+      allocated += n_data_sectors - current_data_sector_offset;
       current_data_sector_offset = 0;
     }
+    // Published before the data is written, so a reader that sees overwritten data also sees the count.
+    n_allocated_sectors.fetch_add(allocated);
 
+    DataAllocation allocation{current_data_sector_offset, timestamp};
+    current_data_sector_offset += required_sectors;
+    if (index_loaded) {
+      LogEntry entry{};
+      entry.size = data_size;
+      entry.begin_sector_offset = allocation.begin_sector_offset;
+      evict_overwritten(entry, wrapped_from);
+    }
+    return allocation;
+  }
+
+  /// Sectors allocate_data() would take for `data_size` now, including the tail it skips when it wraps.
+  [[nodiscard]] uint64_t sectors_to_allocate(uint32_t data_size) const {
+    uint64_t required_sectors = min_sector_for_size<sector_size>(data_size);
+    if (required_sectors > n_data_sectors - current_data_sector_offset) {
+      return required_sectors + n_data_sectors - current_data_sector_offset;
+    }
+    return required_sectors;
+  }
+
+  /// Put an allocation in the current header slot. After done, call advance_slot().
+  LogEntry& fill_slot(const DataAllocation& allocation, uint32_t data_size, uint32_t attr = 0) {
+    if (index_loaded && index_size == index.size()) {
+      // The entry whose slot this is.
+      index_pop_front();
+    }
     auto& entry = current_header_sector->entries[current_slot_idx];
-    entry.timestamp = timestamp;
+    entry.timestamp = allocation.timestamp;
     entry.size = data_size;
     entry.checksum = 0;
-    entry.begin_sector_offset = current_data_sector_offset;
+    entry.begin_sector_offset = allocation.begin_sector_offset;
     entry.attr = attr;
-    current_data_sector_offset += required_sectors;
     return entry;
   }
 
+  [[nodiscard]] uint32_t data_sector_count() const {
+    return n_data_sectors;
+  }
+
   /// returns the *relative* begin sector address for this entry
   RelativeSectorAddress add_log(uint32_t data_size, uint32_t checksum, uint64_t timestamp, uint32_t attr = 0) {
     auto& entry = add_log_partial(data_size, timestamp, attr);
@@ -205,18 +521,50 @@ struct HeaderSectorsManager {
     return ret;
   }
 
-  void advance_slot() {
+  /// \param pending data sectors of the entry being committed. They are written in the same batch as the header
+  /// sector when this advance flushes it, or on their own otherwise.
+  void advance_slot(std::span<const WriteSegment> pending = {}) {
+    if (index_loaded) {
+      index_push_back(current_header_sector->entries[current_slot_idx]);
+    }
     if (++current_slot_idx >= HeaderSector::n_entries) {
-      advance_header_sector();
+      advance_header_sector(pending);
       current_slot_idx = 0;
+    } else if (!pending.empty()) {
+      io.writev_sectors(pending);
     }
   }
 
-  void sync_current_sector() {
-    current_header_sector->write_count++;
-    current_header_sector->update_crc<CRC>();
+  /// True when the next advance_slot() fills the header sector and writes it.
+  [[nodiscard]] bool advance_writes_header() const {
+    return current_slot_idx + 1 >= HeaderSector::n_entries;
+  }
+
+  /// \param pending segments written in the same batch, ahead of the header sector.
+  void sync_current_sector(std::span<const WriteSegment> pending = {}) {
+    write_header_batch(pending, current_header_sector_idx, *current_header_sector, current_slot_idx);
+  }
+
+  /// Safe to call without the lock that guards this object. A reader that copied an entry can compare it with
+  /// expiry() after reading the entry's data: if it is not greater, the data read was not overwritten meanwhile.
+  [[nodiscard]] uint64_t allocated_sectors() const {
+    return n_allocated_sectors.load();
+  }
 
-    io.write_sectors(current_header_sector.get(), begin_sector_addr + current_header_sector_idx, 1);
+  /// \return the allocated_sectors() value past which the data of `entry`, a live entry, is overwritten.
+  [[nodiscard]] uint64_t expiry(const LogEntry& entry) const {
+    // Sectors from the entry's first sector to the write head, going forward around the ring. The oldest entry may
+    // begin right at the head, one whole ring behind it.
+    auto distance = (current_data_sector_offset + n_data_sectors - entry.begin_sector_offset) % n_data_sectors;
+    if (distance == 0) {
+      distance = n_data_sectors;
+    }
+    return n_allocated_sectors + n_data_sectors - distance;
+  }
+
+  /// Number of header sector writes so far. Each one makes every entry added before it durable.
+  [[nodiscard]] size_t header_write_count() const {
+    return n_header_writes;
   }
 
   [[nodiscard]] const HeaderSector& header_sector_cache() const {
@@ -227,93 +575,68 @@ struct HeaderSectorsManager {
     return addr + n_header_sectors + begin_sector_addr;
   }
 
+  /// Served from the in-RAM index, which is loaded here on first use after a restart from a checkpoint.
+  /// The time range is located by binary search, so the cost is O(log n + result).
   /// \param after inclusive
   /// \param before exclusive
   /// \return
   std::vector<LogEntry> get_entries(bool descending = true, uint64_t after = 0, uint64_t before = 0) {
-    sync_current_sector();
-    std::vector<LogEntry> entries;
-
-    auto tmp_header_sector = std::make_unique<HeaderSector>();
-    memcpy(tmp_header_sector.get(), current_header_sector.get(), sizeof(HeaderSector));
-
-    // Recording which slot of the tmp_header_sector is currently pointing to;
-    uint32_t tmp_slot_idx = current_slot_idx;
-    uint32_t tmp_sector_idx = current_header_sector_idx;
-    TSDB_LOG("tmp_slot_idx={}, tmp_sector_idx={}, n_header_sectors={}", tmp_slot_idx, tmp_sector_idx, n_header_sectors);
-
-    // Rules when iterating backward:
-    // 1. if timestamp is zero (not set)
-    // 1. If the timestamp is no longer monotonically decreasing, the inflecting point is the terminating point (tail reaching head)
-    // 2. respecting the before and after. if they are zero, ignore.
-    // 3. If the adjacent entries has overlapping data sectors
-
-    uint64_t decreasing_timestamp = UINT64_MAX;
-
-    auto last = previous_log_entry(tmp_header_sector, tmp_sector_idx, tmp_slot_idx);
-    TSDB_LOG("last timestamp={}", (uint64_t)last.timestamp);
-
-    // check condition 3 for 'last'
-    if ((last.timestamp != 0) && (before == 0 || last.timestamp < before) && (after == 0 || last.timestamp >= after)) {
-      entries.push_back(last);
+    if (!index_loaded) {
+      load_index();
     }
+    auto first = after ? index_lower_bound(after) : 0;
+    auto last = before ? index_lower_bound(before) : index_size;
 
-    while (true) {
-      // Load the previous one.
-      auto& prev = previous_log_entry(tmp_header_sector, tmp_sector_idx, tmp_slot_idx);
-      TSDB_LOG("[slot={}] prev timestamp={}", tmp_slot_idx, (uint64_t)prev.timestamp);
-      // Condition 1
-      if (prev.timestamp == 0) {
-        TSDB_LOG("Complete with condition 1");
-        break;
-      }
-
-      // Condition 2
-      if (prev.timestamp > decreasing_timestamp) {
-        TSDB_LOG("Complete with condition 2");
-        break;
-      } else {
-        decreasing_timestamp = prev.timestamp;
-      }
-
-      // Condition 3
-      if ((before > 0 && prev.timestamp >= before) || (after > 0 && prev.timestamp < after)) {
-        TSDB_LOG("Filter with condition 3");
-        continue;
-      }
-
-      // Condition 4
-      if (prev.begin_sector_offset <= last.end_sector_addr() && prev.end_sector_addr() >= last.end_sector_addr()) {
-        TSDB_LOG("Complete with condition 4. prev.begin_sector_offset={}; prev.end_sector_addr={}; last.end_sector_addr={}",
-                 (int)prev.begin_sector_offset,
-                 (int)prev.end_sector_addr(),
-                 (int)last.end_sector_addr());
-        break;
+    std::vector<LogEntry> entries;
+    if (first < last) {
+      entries.reserve(last - first);
+      for (auto i = first; i < last; ++i) {
+        entries.push_back(indexed(descending ? last - 1 - (i - first) : i));
       }
-
-      entries.push_back(prev);
-    }
-
-    if (!descending) {
-      std::reverse(entries.begin(), entries.end());
     }
     TSDB_LOG("entries.size() = {}", entries.size());
     return entries;
   }
 
+  /// \return the newest entry older than `timestamp`, if any.
+  std::optional<LogEntry> entry_before(uint64_t timestamp) {
+    if (!index_loaded) {
+      load_index();
+    }
+    auto i = index_lower_bound(timestamp);
+    if (i == 0) {
+      return {};
+    }
+    return indexed(i - 1);
+  }
+
   /// Remove all entries
   void clear() {
     for (int i = 0; i < n_header_sectors; ++i) {
       load_header_sector(i);
       current_header_sector->clear();
-      sync_current_sector();
+      // No checkpoint per sector: the one written below replaces them all.
+      current_header_sector->write_count++;
+      current_header_sector->template update_crc<CRC>();
+      io.write_sectors(current_header_sector.get(), begin_sector_addr + i, 1);
+      n_header_writes++;
     }
+    io.flush();
 
     // Load initial state
     load_header_sector(0);
     current_slot_idx = 0;
+    // Every entry copied before is gone.
+    n_allocated_sectors.fetch_add(n_data_sectors);
     current_data_sector_offset = 0;
     previous_timestamp = 0;
+    index.resize((size_t)n_header_sectors * HeaderSector::n_entries);
+    index_begin = 0;
+    index_size = 0;
+    index_loaded = true;
+    if (use_checkpoint) {
+      write_checkpoint();
+    }
   }
 };
 }  // namespace tsdb
\ No newline at end of file
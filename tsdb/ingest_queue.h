@@ -0,0 +1,299 @@
+//
+// Bounded lock-free queue of records drained into a Series by a dedicated writer thread.
+//
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "exception.h"
+#include "series.h"
+
+namespace tsdb {
+
+enum class BackPressure {
+  // Discard the oldest queued record to make room for the new one.
+  drop_oldest,
+  // Discard the new record.
+  drop_newest,
+  // Wait for the writer to free a slot. Spins with yield, never takes a mutex.
+  block,
+};
+
+struct IngestQueueConfig {
+  // Number of slots, rounded up to a power of two.
+  uint32_t capacity{1024};
+  // Largest record accepted. Every slot reserves this much, so the queue never allocates after construction.
+  uint32_t max_record_size{256};
+  BackPressure policy{BackPressure::block};
+  // Records the writer hands to Series::insert_batch at once, at most.
+  uint32_t max_batch{64};
+};
+
+struct IngestStats {
+  // Records queued and not taken by the writer yet.
+  size_t depth{0};
+  size_t pushed{0};
+  size_t written{0};
+  size_t dropped_oldest{0};
+  size_t dropped_newest{0};
+};
+
+/// Many producers push() records without locking or touching the device; a writer thread started by the constructor
+/// drains them into `series` with insert_batch(). The ring is the bounded MPMC queue of D. Vyukov: each slot carries a
+/// sequence number telling whether it is free for the producer at that position or ready for the consumer. Producers
+/// with BackPressure::drop_oldest consume too, to evict the head. Records are not durable until sync(). The destructor
+/// writes the records still queued before joining the writer.
+template <typename TSeries>
+struct IngestQueue {
+  explicit IngestQueue(TSeries& series, const IngestQueueConfig& cfg = {})
+      : series(series),
+        cfg(cfg),
+        mask(std::bit_ceil(std::max(cfg.capacity, 2u)) - 1),
+        slots(std::make_unique<Slot[]>(mask + 1)),
+        slot_data(std::make_unique<uint8_t[]>((size_t)(mask + 1) * cfg.max_record_size)),
+        batch_data(std::make_unique<uint8_t[]>((size_t)cfg.max_batch * cfg.max_record_size)) {
+    assert(cfg.max_record_size > 0);
+    assert(cfg.max_batch > 0);
+    for (size_t i = 0; i <= mask; ++i) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    batch.reserve(cfg.max_batch);
+    writer = std::thread([this] { run_writer(); });
+  }
+
+  IngestQueue(const IngestQueue&) = delete;
+  IngestQueue& operator=(const IngestQueue&) = delete;
+
+  ~IngestQueue() {
+    stopping = true;
+    wake_writer();
+    writer.join();
+  }
+
+  /// Queue a copy of the record. Never blocks unless the policy is BackPressure::block and the queue is full.
+  /// \param timestamp 0 for the time of the push
+  /// \return false if the record was dropped
+  /// \throw Error if the record is too big, or attr has bits of LogEntry::attr_reserved
+  bool push(const void* buffer, uint32_t len, uint32_t attr = 0, uint64_t timestamp = 0) {
+    assert(buffer);
+    assert(len);
+    if (len > cfg.max_record_size) {
+      throw Error("record too big for the ingest queue");
+    }
+    // Rejected here rather than by the writer thread, where it would stop the queue.
+    if (attr & LogEntry::attr_reserved) {
+      throw Error("attr bits reserved for the engine");
+    }
+    if (timestamp == 0) {
+      timestamp = duration_cast<std::chrono::microseconds>(TSeries::Clock::now().time_since_epoch()).count();
+    }
+
+    while (!try_push(buffer, len, attr, timestamp)) {
+      switch (cfg.policy) {
+        case BackPressure::drop_newest:
+          n_dropped_newest.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        case BackPressure::drop_oldest:
+          if (try_pop(nullptr)) {
+            n_dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+            n_done.fetch_add(1);
+          }
+          break;
+        case BackPressure::block:
+          std::this_thread::yield();
+          break;
+      }
+    }
+    n_pushed.fetch_add(1, std::memory_order_relaxed);
+
+    // Pairs with the fence in run_writer(): either the writer sees the record, or we see it going to sleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_sleeping.load(std::memory_order_relaxed)) {
+      wake_writer();
+    }
+    return true;
+  }
+
+  /// Wait until the records pushed so far are written to the series, or dropped.
+  /// \throw the error that stopped the writer, if any
+  void flush() {
+    auto target = n_pushed.load();
+    wake_writer();
+    for (auto done = n_done.load(); done < target && !failed; done = n_done.load()) {
+      n_done.wait(done);
+    }
+    if (failed) {
+      std::rethrow_exception(writer_error);
+    }
+  }
+
+  void sync() {
+    flush();
+    series.sync();
+  }
+
+  /// Records queued and not taken by the writer yet. Approximate while producers are running.
+  [[nodiscard]] size_t depth() const {
+    auto tail = dequeue_pos.load(std::memory_order_relaxed);
+    auto head = enqueue_pos.load(std::memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+  }
+
+  [[nodiscard]] IngestStats stats() const {
+    return {depth(),
+            n_pushed.load(std::memory_order_relaxed),
+            n_written.load(std::memory_order_relaxed),
+            n_dropped_oldest.load(std::memory_order_relaxed),
+            n_dropped_newest.load(std::memory_order_relaxed)};
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    uint32_t len;
+    uint32_t attr;
+    uint64_t timestamp;
+  };
+
+  TSeries& series;
+  const IngestQueueConfig cfg;
+  const size_t mask;
+  std::unique_ptr<Slot[]> slots;
+  std::unique_ptr<uint8_t[]> slot_data;
+
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+  alignas(64) std::atomic<size_t> n_pushed{0};
+  std::atomic<size_t> n_dropped_newest{0};
+  std::atomic<size_t> n_dropped_oldest{0};
+  std::atomic<size_t> n_written{0};
+  // Written or dropped_oldest; flush() waits on it.
+  std::atomic<size_t> n_done{0};
+
+  std::atomic<bool> writer_sleeping{false};
+  std::atomic<uint32_t> wakeups{0};
+  std::atomic<bool> stopping{false};
+  // Once the series throws, the writer keeps draining the queue but discards the records.
+  std::atomic<bool> failed{false};
+  std::exception_ptr writer_error;
+
+  // Owned by the writer thread: records are copied out of their slots so the slots are free during the write.
+  std::unique_ptr<uint8_t[]> batch_data;
+  std::vector<Record> batch;
+  std::thread writer;
+
+  uint8_t* data_of(size_t pos) {
+    return slot_data.get() + (pos & mask) * cfg.max_record_size;
+  }
+
+  bool try_push(const void* buffer, uint32_t len, uint32_t attr, uint64_t timestamp) {
+    auto pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      auto& slot = slots[pos & mask];
+      auto sequence = slot.sequence.load(std::memory_order_acquire);
+      auto diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          memcpy(data_of(pos), buffer, len);
+          slot.len = len;
+          slot.attr = attr;
+          slot.timestamp = timestamp;
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        // The slot still holds the record of the previous lap: full.
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// \param out receives the record, data copied to `batch_data`; nullptr to discard it
+  bool try_pop(Record* out) {
+    auto pos = dequeue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      auto& slot = slots[pos & mask];
+      auto sequence = slot.sequence.load(std::memory_order_acquire);
+      auto diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          if (out) {
+            auto dest = batch_data.get() + batch.size() * cfg.max_record_size;
+            memcpy(dest, data_of(pos), slot.len);
+            *out = {dest, slot.len, slot.attr, slot.timestamp};
+          }
+          slot.sequence.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void wake_writer() {
+    wakeups.fetch_add(1);
+    wakeups.notify_one();
+  }
+
+  void run_writer() {
+    for (;;) {
+      batch.clear();
+      Record record{};
+      while (batch.size() < cfg.max_batch && try_pop(&record)) {
+        batch.push_back(record);
+      }
+
+      if (!batch.empty()) {
+        if (!failed) {
+          try {
+            series.insert_batch(batch);
+            n_written.fetch_add(batch.size(), std::memory_order_relaxed);
+          } catch (...) {
+            writer_error = std::current_exception();
+            failed = true;
+          }
+        }
+        n_done.fetch_add(batch.size());
+        n_done.notify_all();
+        continue;
+      }
+
+      writer_sleeping = true;
+      // Pairs with the fence in push().
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto observed = wakeups.load();
+      if (slot_ready()) {
+        writer_sleeping = false;
+        continue;
+      }
+      // A slot claimed but not published yet is followed by a wake up from its producer.
+      if (stopping && dequeue_pos.load() == enqueue_pos.load()) {
+        return;
+      }
+      wakeups.wait(observed);
+      writer_sleeping = false;
+    }
+  }
+
+  [[nodiscard]] bool slot_ready() const {
+    auto pos = dequeue_pos.load(std::memory_order_relaxed);
+    return slots[pos & mask].sequence.load(std::memory_order_acquire) == pos + 1;
+  }
+};
+}  // namespace tsdb
@@ -6,15 +6,60 @@
 #include <array>
 #include <vector>
 #include <cassert>
+#include <concepts>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <cstring>
+#include <exception>
+#include <functional>
 #include "common.h"
 #include "exception.h"
 
 namespace tsdb {
 
+/// One contiguous run of sectors in a scatter/gather write.
+struct WriteSegment {
+  const void* in;
+  uint32_t begin_sector;
+  uint32_t n_sector;
+};
+
+/// One contiguous run of sectors in a scatter/gather read.
+struct ReadSegment {
+  void* out;
+  uint32_t begin_sector;
+  uint32_t n_sector;
+};
+
+/// Completion of an asynchronous request. Receives the failure, or a null exception_ptr on success.
+using IOCompletion = std::function<void(std::exception_ptr)>;
+
+enum class SyncPolicy {
+  // Leave write back to the OS.
+  never,
+  // Sync when the engine reaches a durability point (header sector written).
+  on_flush,
+  // Sync after every write call.
+  every_write,
+};
+
+/// IO backends that can hand out a direct view of device sectors (e.g. a memory mapping).
 template <typename T>
+concept MappedIO = requires(T& io, uint32_t sector) {
+  { io.map_sectors(sector, sector) } -> std::same_as<std::span<const uint8_t>>;
+};
+
+/// \tparam SectorSize unit of every request, and of the on-disk layout of the series using this IO. 512 fits SD cards;
+/// eMMC and NVMe devices usually prefer 4096.
+template <typename T, uint32_t SectorSize = sector_size>
 struct IO {
+  constexpr static uint32_t sector_size = SectorSize;
+  /// Whether async_* requests complete later, from submit() / wait_all() or the backend's own polling, rather than
+  /// synchronously. Coroutine awaitables suspend on the request for such backends and offload the blocking call to a
+  /// worker thread otherwise.
+  constexpr static bool native_async = false;
+
   void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
     static_cast<T*>(this)->write_sectors(in, begin_sector, n_sector);
   }
@@ -23,82 +68,246 @@ struct IO {
     static_cast<T*>(this)->read_sectors(out, begin_sector, n_sector);
   }
 
+  /// Submit several sector runs as one batch. Implementations that can do better than one call per segment
+  /// (single lock, pwritev, ...) should provide their own writev_sectors.
+  void writev_sectors(std::span<const WriteSegment> segments) {
+    for (auto& s : segments) {
+      static_cast<T*>(this)->write_sectors(s.in, s.begin_sector, s.n_sector);
+    }
+  }
+
+  void readv_sectors(std::span<const ReadSegment> segments) {
+    for (auto& s : segments) {
+      static_cast<T*>(this)->read_sectors(s.out, s.begin_sector, s.n_sector);
+    }
+  }
+
   uint32_t n_sectors() { return static_cast<T*>(this)->n_sectors(); }
 
-  void write_bytes_to_sectors(void* buffer, uint32_t len, uint32_t sector_addr) {
-    auto n_sectors = min_sector_for_size(len);
+  /// Durability hook, called after a header sector is written. Nothing to do for volatile backends.
+  void flush() {}
+
+  /// Called right before flush() with the writes of the header sector (and checkpoint) last: they commit the writes
+  /// queued before them and must not reach the device first. Only backends that may reorder queued writes act on it.
+  void order_last_writes(uint32_t) {}
+
+  /// True if every write throws. Opening a series then repairs and checkpoints nothing, so it can be read.
+  [[nodiscard]] bool read_only() const {
+    return false;
+  }
+
+  /// Asynchronous interface. The buffer must stay valid until `done` runs. Requests may be queued until submit();
+  /// wait_all() submits and blocks until every request has completed and its callback has run.
+  /// Backends without a native asynchronous path complete the request synchronously, before returning.
+  void async_write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector, IOCompletion done) {
+    run_synchronously([&] { static_cast<T*>(this)->write_sectors(in, begin_sector, n_sector); }, done);
+  }
+
+  void async_read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector, IOCompletion done) {
+    run_synchronously([&] { static_cast<T*>(this)->read_sectors(out, begin_sector, n_sector); }, done);
+  }
+
+  void submit() {}
+
+  void wait_all() {}
+
+  /// Describe writing len bytes from buffer as at most two segments: the full sectors taken from the buffer,
+  /// and the last partial sector copied and zero padded into tail_sector.
+  /// \return number of segments filled
+  static size_t bytes_to_write_segments(const void* buffer, uint32_t len, uint32_t sector_addr, void* tail_sector, WriteSegment* segments) {
+    auto n_sectors = (uint32_t)min_sector_for_size<sector_size>(len);
     auto partial_size = len % sector_size;
-    auto error = IOError("Failed to write sectors");
     if (partial_size == 0) {
       // no partial
-      write_sectors(buffer, sector_addr, n_sectors);
-    } else {
-      // If there is full sector, write full sector
-      if (n_sectors > 1) {
-        write_sectors(buffer, sector_addr, n_sectors - 1);
-      }
+      segments[0] = {buffer, sector_addr, n_sectors};
+      return 1;
+    }
+
+    size_t n_segments = 0;
+    // If there is full sector, write full sector
+    if (n_sectors > 1) {
+      segments[n_segments++] = {buffer, sector_addr, n_sectors - 1};
+    }
+
+    // Write partial sectors
+    memcpy(tail_sector, (const uint8_t*)buffer + sector_size * (n_sectors - 1), partial_size);
+    memset((uint8_t*)tail_sector + partial_size, 0, sector_size - partial_size);
+    segments[n_segments++] = {tail_sector, sector_addr + n_sectors - 1, 1};
+    return n_segments;
+  }
+
+  /// Scratch sector for padding partial sectors, sector aligned. Per thread since one IO is shared by several series.
+  /// Only valid until the next call that uses it on the same thread.
+  static uint8_t* bounce_sector() {
+    alignas(sector_size) static thread_local uint8_t sector[sector_size];
+    return sector;
+  }
 
-      // Write partial sectors
-      auto tmp = std::make_unique<uint8_t[]>(sector_size);
-      memcpy(tmp.get(), (uint8_t*)buffer + sector_size * (n_sectors - 1), partial_size);
-      memset(tmp.get() + partial_size, 0, sector_size - partial_size);
-      write_sectors(tmp.get(), sector_addr + n_sectors - 1, 1);
+  void write_bytes_to_sectors(void* buffer, uint32_t len, uint32_t sector_addr) {
+    WriteSegment segments[2];
+    auto n_segments = bytes_to_write_segments(buffer, len, sector_addr, bounce_sector(), segments);
+    static_cast<T*>(this)->writev_sectors({segments, n_segments});
+  }
+
+  template <typename TFcn>
+  static void run_synchronously(const TFcn& fcn, const IOCompletion& done) {
+    std::exception_ptr error;
+    try {
+      fcn();
+    } catch (...) {
+      error = std::current_exception();
     }
+    done(error);
   }
 
   void read_bytes_from_sectors(void* buffer, uint32_t len, uint32_t sector_addr) {
-    auto n_sectors = min_sector_for_size(len);
+    auto n_sectors = (uint32_t)min_sector_for_size<sector_size>(len);
     auto partial_size = len % sector_size;
     if (partial_size == 0) {
       // no partial
       read_sectors(buffer, sector_addr, n_sectors);
     } else {
-      // See read_bytes_from_sectors
+      // See write_bytes_to_sectors
+      ReadSegment segments[2];
+      size_t n_segments = 0;
       if (n_sectors > 1) {
-        read_sectors(buffer, sector_addr, n_sectors - 1);
+        segments[n_segments++] = {buffer, sector_addr, n_sectors - 1};
       }
 
-      auto tmp = std::make_unique<uint8_t[]>(sector_size);
-      read_sectors(tmp.get(), sector_addr + n_sectors - 1, 1);
-      memset(tmp.get() + partial_size, 0, sector_size - partial_size);
-      memcpy((uint8_t*)buffer + (n_sectors - 1) * sector_size, tmp.get(), partial_size);
+      auto tmp = bounce_sector();
+      segments[n_segments++] = {tmp, sector_addr + n_sectors - 1, 1};
+      static_cast<T*>(this)->readv_sectors({segments, n_segments});
+      memcpy((uint8_t*)buffer + (n_sectors - 1) * sector_size, tmp, partial_size);
     }
   }
 };
 
-struct SectorMemoryIO : IO<SectorMemoryIO> {
+/// In-memory sectors. Locking is striped by sector range: series sharing one IO write disjoint partitions, so they
+/// take different stripes and do not serialize against each other.
+template <uint32_t SectorSize = sector_size>
+struct BasicSectorMemoryIO : IO<BasicSectorMemoryIO<SectorSize>, SectorSize> {
+  constexpr static uint32_t sector_size = SectorSize;
   using SectorType = std::array<uint8_t, sector_size>;
+  constexpr static uint32_t n_stripes = 64;
+  constexpr static uint32_t sectors_per_stripe = 64;
 
-  explicit SectorMemoryIO(uint32_t n_sectors) { mem.resize(n_sectors); }
+  explicit BasicSectorMemoryIO(uint32_t n_sectors) { mem.resize(n_sectors); }
 
   std::vector<SectorType> mem;
-  std::mutex lock;
 
   void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
-    std::lock_guard g(lock);
     assert(in);
     assert(n_sector);
 
     if (begin_sector + n_sector > mem.size()) {
       throw IOError("Failed to write sectors");
     }
+    StripeGuard g(*this, stripe_mask(begin_sector, n_sector));
     for (int i = 0; i < n_sector; ++i) {
       memcpy(mem[begin_sector + i].data(), (uint8_t*)in + i * sector_size, sector_size);
     }
   }
 
   void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
-    std::lock_guard g(lock);
     assert(n_sector);
 
     if (begin_sector + n_sector > mem.size()) {
       throw IOError("Failed to read sectors");
     }
+    StripeGuard g(*this, stripe_mask(begin_sector, n_sector));
     for (int i = 0; i < n_sector; ++i) {
       memcpy((uint8_t*)out + i * sector_size, mem[begin_sector + i].data(), sector_size);
     }
   }
 
+  void writev_sectors(std::span<const WriteSegment> segments) {
+    // Validate the whole batch first so that a bad segment does not leave it half applied.
+    uint64_t mask = 0;
+    for (auto& s : segments) {
+      assert(s.in);
+      assert(s.n_sector);
+      if (s.begin_sector + s.n_sector > mem.size()) {
+        throw IOError("Failed to write sectors");
+      }
+      mask |= stripe_mask(s.begin_sector, s.n_sector);
+    }
+    StripeGuard g(*this, mask);
+    for (auto& s : segments) {
+      for (int i = 0; i < s.n_sector; ++i) {
+        memcpy(mem[s.begin_sector + i].data(), (uint8_t*)s.in + i * sector_size, sector_size);
+      }
+    }
+  }
+
+  void readv_sectors(std::span<const ReadSegment> segments) {
+    uint64_t mask = 0;
+    for (auto& s : segments) {
+      assert(s.n_sector);
+      if (s.begin_sector + s.n_sector > mem.size()) {
+        throw IOError("Failed to read sectors");
+      }
+      mask |= stripe_mask(s.begin_sector, s.n_sector);
+    }
+    StripeGuard g(*this, mask);
+    for (auto& s : segments) {
+      for (int i = 0; i < s.n_sector; ++i) {
+        memcpy((uint8_t*)s.out + i * sector_size, mem[s.begin_sector + i].data(), sector_size);
+      }
+    }
+  }
+
   uint32_t n_sectors() { return mem.size(); }
+
+ private:
+  static_assert(n_stripes <= 64, "stripe set is a 64 bit mask");
+  std::array<std::mutex, n_stripes> stripes;
+
+  static uint64_t stripe_mask(uint32_t begin_sector, uint32_t n_sector) {
+    auto first = begin_sector / sectors_per_stripe;
+    auto last = (begin_sector + n_sector - 1) / sectors_per_stripe;
+    if (last - first + 1 >= n_stripes) {
+      return UINT64_MAX >> (64 - n_stripes);
+    }
+    uint64_t mask = 0;
+    for (auto i = first; i <= last; ++i) {
+      mask |= 1ull << stripe_of(i);
+    }
+    return mask;
+  }
+
+  /// Folds the higher bits of the block number in: with the block number modulo n_stripes alone, partitions whose
+  /// starts differ by a multiple of n_stripes * sectors_per_stripe sectors would put their header sectors on one stripe.
+  /// Consecutive blocks below the same higher bits still get distinct stripes.
+  static uint32_t stripe_of(uint32_t block) {
+    uint32_t folded = 0;
+    for (; block; block /= n_stripes) {
+      folded ^= block;
+    }
+    return folded % n_stripes;
+  }
+
+  /// Locks a set of stripes in ascending order, so overlapping requests cannot deadlock.
+  struct StripeGuard {
+    StripeGuard(BasicSectorMemoryIO& io, uint64_t mask) : io(io), mask(mask) {
+      for (uint32_t i = 0; i < n_stripes; ++i) {
+        if (mask & (1ull << i)) {
+          io.stripes[i].lock();
+        }
+      }
+    }
+
+    ~StripeGuard() {
+      for (uint32_t i = 0; i < n_stripes; ++i) {
+        if (mask & (1ull << i)) {
+          io.stripes[i].unlock();
+        }
+      }
+    }
+
+    BasicSectorMemoryIO& io;
+    uint64_t mask;
+  };
 };
+
+using SectorMemoryIO = BasicSectorMemoryIO<>;
 }  // namespace tsdb
\ No newline at end of file
@@ -0,0 +1,274 @@
+//
+// LZ4 style block compression with a streaming decoder.
+//
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+
+#include "exception.h"
+
+namespace tsdb {
+
+/// A block is a list of sequences: a token (literal length in the high nibble, match length - 4 in the low one),
+/// literal length extension bytes, the literals, then a 16 bit little endian match offset and match length extension
+/// bytes. A nibble of 15 is extended by the following bytes, each adding up to 255. The last sequence has literals only.
+namespace lz {
+constexpr size_t min_match = 4;
+constexpr size_t max_offset = UINT16_MAX;
+// The tail of the input is always stored as literals.
+constexpr size_t end_literals = 5;
+
+namespace detail {
+inline uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> 20;
+}
+
+inline bool write_length(uint8_t*& op, const uint8_t* end, size_t len) {
+  while (len >= 255) {
+    if (op == end) {
+      return false;
+    }
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op == end) {
+    return false;
+  }
+  *op++ = (uint8_t)len;
+  return true;
+}
+
+inline bool write_sequence(uint8_t*& op, const uint8_t* end, const uint8_t* literals, size_t n_literals, size_t offset, size_t match_len) {
+  if (op == end) {
+    return false;
+  }
+  auto& token = *op++;
+  token = (uint8_t)(std::min<size_t>(n_literals, 15) << 4);
+  if (n_literals >= 15 && !write_length(op, end, n_literals - 15)) {
+    return false;
+  }
+  if ((size_t)(end - op) < n_literals) {
+    return false;
+  }
+  memcpy(op, literals, n_literals);
+  op += n_literals;
+  if (match_len == 0) {
+    return true;
+  }
+
+  if (end - op < 2) {
+    return false;
+  }
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+  auto ml = match_len - min_match;
+  token |= (uint8_t)std::min<size_t>(ml, 15);
+  return ml < 15 || write_length(op, end, ml - 15);
+}
+}  // namespace detail
+
+/// Match finder state of compress(): 16 KiB, too big for the stack of small targets.
+struct CompressScratch {
+  // Positions + 1 of the last occurrence of each hashed 4 byte sequence, 0 for none.
+  std::array<uint32_t, 1 << 12> table;
+};
+
+/// \param scratch reset by the call, any content will do
+/// \return compressed size, or 0 if the output does not fit `capacity`.
+inline size_t compress(const void* in, size_t len, void* out, size_t capacity, CompressScratch& scratch) {
+  using namespace detail;
+  auto src = (const uint8_t*)in;
+  auto op = (uint8_t*)out;
+  auto end = op + capacity;
+
+  auto& table = scratch.table;
+  table.fill(0);
+  size_t anchor = 0;
+  size_t ip = 0;
+  if (len > min_match + end_literals) {
+    auto match_limit = len - end_literals;
+    while (ip + min_match <= match_limit) {
+      auto sequence = read32(src + ip);
+      auto& slot = table[hash(sequence)];
+      auto candidate = (size_t)slot;
+      slot = (uint32_t)(ip + 1);
+      if (candidate == 0 || ip - (candidate - 1) > max_offset || read32(src + candidate - 1) != sequence) {
+        ip++;
+        continue;
+      }
+
+      auto ref = candidate - 1;
+      auto match_len = min_match;
+      while (ip + match_len < match_limit && src[ref + match_len] == src[ip + match_len]) {
+        match_len++;
+      }
+      if (!write_sequence(op, end, src + anchor, ip - anchor, ip - ref, match_len)) {
+        return 0;
+      }
+      ip += match_len;
+      anchor = ip;
+    }
+  }
+  if (!write_sequence(op, end, src + anchor, len - anchor, 0, 0)) {
+    return 0;
+  }
+  return op - (uint8_t*)out;
+}
+
+/// compress() with a scratch allocated once per thread.
+inline size_t compress(const void* in, size_t len, void* out, size_t capacity) {
+  static thread_local std::unique_ptr<CompressScratch> scratch{std::make_unique<CompressScratch>()};
+  return compress(in, len, out, capacity, *scratch);
+}
+
+/// Decodes a block fed in arbitrary pieces into output buffers of arbitrary size. Keeps the last max_offset + 1 bytes of
+/// output as history, so memory does not grow with the block. reset() starts the next block without reallocating it.
+struct StreamDecoder {
+  /// \param size decompressed size of the block
+  explicit StreamDecoder(size_t size) : remaining(size) {}
+
+  /// Start decoding a new block, reusing the history buffer.
+  /// \param size decompressed size of the block
+  void reset(size_t size) {
+    state = State::token;
+    remaining = size;
+    length = 0;
+    match_nibble = 0;
+    offset = 0;
+    history_size = 0;
+  }
+
+  /// Consume from `in` and produce up to `out_len` bytes.
+  /// \return bytes written to out. Less than out_len only when `in` is exhausted or the block is complete.
+  size_t decode(std::span<const uint8_t>& in, uint8_t* out, size_t out_len) {
+    size_t produced = 0;
+    auto take = [&] {
+      auto b = in[0];
+      in = in.subspan(1);
+      return b;
+    };
+
+    while (produced < out_len && remaining) {
+      switch (state) {
+        case State::token: {
+          if (in.empty()) {
+            return produced;
+          }
+          auto token = take();
+          length = token >> 4;
+          match_nibble = token & 15;
+          state = length == 15 ? State::literal_length : State::literals;
+          break;
+        }
+        case State::literal_length:
+        case State::match_length: {
+          if (in.empty()) {
+            return produced;
+          }
+          auto b = take();
+          length += b;
+          if (b != 255) {
+            state = state == State::literal_length ? State::literals : State::match;
+          }
+          break;
+        }
+        case State::literals: {
+          auto n = std::min({length, in.size(), out_len - produced, remaining});
+          for (size_t i = 0; i < n; ++i) {
+            emit(out[produced + i] = in[i]);
+          }
+          in = in.subspan(n);
+          produced += n;
+          remaining -= n;
+          length -= n;
+          if (length == 0) {
+            state = State::offset_low;
+          } else if (in.empty() || produced == out_len) {
+            return produced;
+          } else if (remaining == 0) {
+            throw CorruptedDataError("Compressed block longer than its size");
+          }
+          break;
+        }
+        case State::offset_low:
+        case State::offset_high: {
+          if (in.empty()) {
+            return produced;
+          }
+          if (state == State::offset_low) {
+            offset = take();
+            state = State::offset_high;
+            break;
+          }
+          offset |= (size_t)take() << 8;
+          if (offset == 0 || offset > history_size) {
+            throw CorruptedDataError("Bad match offset");
+          }
+          length = match_nibble + min_match;
+          state = match_nibble == 15 ? State::match_length : State::match;
+          break;
+        }
+        case State::match: {
+          if (length > remaining) {
+            throw CorruptedDataError("Compressed block longer than its size");
+          }
+          auto n = std::min(length, out_len - produced);
+          for (size_t i = 0; i < n; ++i) {
+            emit(out[produced + i] = history[(history_size - offset) & history_mask]);
+          }
+          produced += n;
+          remaining -= n;
+          length -= n;
+          if (length == 0) {
+            state = State::token;
+          }
+          break;
+        }
+      }
+    }
+    return produced;
+  }
+
+  [[nodiscard]] bool done() const {
+    return remaining == 0;
+  }
+
+ private:
+  enum class State { token, literal_length, literals, offset_low, offset_high, match_length, match };
+  constexpr static size_t history_mask = 0xffff;
+
+  State state{State::token};
+  size_t remaining;
+  size_t length{0};
+  size_t match_nibble{0};
+  size_t offset{0};
+  // Total bytes produced; the write position in the history ring.
+  size_t history_size{0};
+  std::unique_ptr<uint8_t[]> history{std::make_unique<uint8_t[]>(history_mask + 1)};
+
+  void emit(uint8_t b) {
+    history[history_size++ & history_mask] = b;
+  }
+};
+
+/// One shot decode of a whole block.
+inline void decompress(std::span<const uint8_t> in, void* out, size_t size) {
+  StreamDecoder decoder(size);
+  if (decoder.decode(in, (uint8_t*)out, size) != size || !in.empty()) {
+    throw CorruptedDataError("Compressed block does not match its size");
+  }
+}
+}  // namespace lz
+}  // namespace tsdb
@@ -0,0 +1,217 @@
+//
+// Sector IO through a shared memory mapping of a file or block device.
+//
+
+#pragma once
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "io.h"
+
+namespace tsdb {
+
+struct MmapSectorIOConfig {
+  // Map read only, e.g. for analytics over captured card images. Writes throw IOError.
+  bool read_only{false};
+  // Grow a regular file to this many sectors when it is smaller. 0 keeps the current size.
+  uint32_t n_sectors{0};
+  // Prefault the whole mapping.
+  bool populate{false};
+};
+
+/// Reads are plain copies out of the mapping, and map_sectors() exposes it directly for zero-copy access.
+/// Writes go into the mapping; the runs of sectors written since are msync'ed on flush(), i.e. whenever a header sector
+/// is synced. Runs are kept apart so the clean pages between a data write and the header sector are not synced too.
+template <uint32_t SectorSize = sector_size>
+struct BasicMmapSectorIO : IO<BasicMmapSectorIO<SectorSize>, SectorSize> {
+  constexpr static uint32_t sector_size = SectorSize;
+
+  explicit BasicMmapSectorIO(const std::string& path, const MmapSectorIOConfig& cfg = {}) : cfg(cfg) {
+    dirty.reserve(max_dirty_runs + 1);
+    int fd = ::open(path.c_str(), (cfg.read_only ? O_RDONLY : O_RDWR | O_CREAT) | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw_errno("Failed to open " + path);
+    }
+
+    struct stat st {};
+    uint64_t size = 0;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+      size = st.st_size;
+      if (S_ISBLK(st.st_mode)) {
+        ok = ioctl(fd, BLKGETSIZE64, &size) == 0;
+      } else if (!cfg.read_only && size < (uint64_t)cfg.n_sectors * sector_size) {
+        size = (uint64_t)cfg.n_sectors * sector_size;
+        ok = ftruncate(fd, size) == 0;
+      }
+    }
+    if (ok && size >= sector_size) {
+      total_sectors = size / sector_size;
+      auto prot = PROT_READ | (cfg.read_only ? 0 : PROT_WRITE);
+      auto p = mmap(nullptr, mapped_size(), prot, MAP_SHARED | (cfg.populate ? MAP_POPULATE : 0), fd, 0);
+      ok = p != MAP_FAILED;
+      base = ok ? (uint8_t*)p : nullptr;
+    } else if (ok) {
+      errno = EINVAL;
+      ok = false;
+    }
+
+    // The mapping keeps its own reference to the file.
+    auto err = errno;
+    ::close(fd);
+    if (!ok) {
+      errno = err;
+      throw_errno("Failed to map " + path);
+    }
+  }
+
+  BasicMmapSectorIO(const BasicMmapSectorIO&) = delete;
+  BasicMmapSectorIO& operator=(const BasicMmapSectorIO&) = delete;
+
+  ~BasicMmapSectorIO() {
+    if (base) {
+      if (!cfg.read_only) {
+        msync(base, mapped_size(), MS_SYNC);
+      }
+      munmap(base, mapped_size());
+    }
+  }
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    assert(in);
+    assert(n_sector);
+    if (cfg.read_only || (uint64_t)begin_sector + n_sector > total_sectors) {
+      throw IOError("Failed to write sectors");
+    }
+    memcpy(base + (size_t)begin_sector * sector_size, in, (size_t)n_sector * sector_size);
+    mark_dirty(begin_sector, begin_sector + n_sector);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    assert(n_sector);
+    if ((uint64_t)begin_sector + n_sector > total_sectors) {
+      throw IOError("Failed to read sectors");
+    }
+    memcpy(out, base + (size_t)begin_sector * sector_size, (size_t)n_sector * sector_size);
+  }
+
+  uint32_t n_sectors() { return total_sectors; }
+
+  [[nodiscard]] bool read_only() const {
+    return cfg.read_only;
+  }
+
+  /// Direct view of sectors in the mapping.
+  std::span<const uint8_t> map_sectors(uint32_t begin_sector, uint32_t n_sector) const {
+    if ((uint64_t)begin_sector + n_sector > total_sectors) {
+      throw IOError("Failed to map sectors");
+    }
+    return {base + (size_t)begin_sector * sector_size, (size_t)n_sector * sector_size};
+  }
+
+  /// msync the pages written since the last flush. The runs that fail to sync stay dirty for the next one.
+  void flush() {
+    std::array<DirtyRun, max_dirty_runs> runs;
+    size_t n_runs;
+    {
+      std::lock_guard g(dirty_lock);
+      if (dirty.empty()) {
+        return;
+      }
+      n_runs = dirty.size();
+      std::copy(dirty.begin(), dirty.end(), runs.begin());
+      dirty.clear();
+    }
+
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < n_runs; ++i) {
+      auto from = (size_t)runs[i].begin * sector_size / page_size * page_size;
+      auto to = std::min((size_t)runs[i].end * sector_size, mapped_size());
+      if (msync(base + from, to - from, MS_SYNC) != 0) {
+        auto err = errno;
+        {
+          std::lock_guard g(dirty_lock);
+          for (; i < n_runs; ++i) {
+            merge_dirty(runs[i].begin, runs[i].end);
+          }
+        }
+        errno = err;
+        throw_errno("Failed to sync mapping");
+      }
+    }
+    n_syncs++;
+  }
+
+  [[nodiscard]] size_t sync_count() const {
+    return n_syncs;
+  }
+
+ private:
+  MmapSectorIOConfig cfg;
+  uint8_t* base{nullptr};
+  uint32_t total_sectors{0};
+
+  /// Sectors [begin, end) written since the last flush.
+  struct DirtyRun {
+    uint32_t begin;
+    uint32_t end;
+  };
+  /// Past this many runs, the two closest are merged, syncing the clean sectors between them.
+  constexpr static size_t max_dirty_runs = 8;
+
+  std::mutex dirty_lock;
+  // Sorted and disjoint.
+  std::vector<DirtyRun> dirty;
+  std::atomic<size_t> n_syncs{0};
+
+  [[noreturn]] static void throw_errno(const std::string& msg) {
+    throw IOError(msg + ": " + strerror(errno));
+  }
+
+  [[nodiscard]] size_t mapped_size() const {
+    return (size_t)total_sectors * sector_size;
+  }
+
+  void mark_dirty(uint32_t begin, uint32_t end) {
+    std::lock_guard g(dirty_lock);
+    merge_dirty(begin, end);
+  }
+
+  /// Called with dirty_lock held.
+  void merge_dirty(uint32_t begin, uint32_t end) {
+    auto first = std::find_if(dirty.begin(), dirty.end(), [&](const DirtyRun& r) { return r.end >= begin; });
+    auto last = first;
+    for (; last != dirty.end() && last->begin <= end; ++last) {
+      begin = std::min(begin, last->begin);
+      end = std::max(end, last->end);
+    }
+    dirty.insert(dirty.erase(first, last), {begin, end});
+
+    if (dirty.size() > max_dirty_runs) {
+      size_t closest = 0;
+      for (size_t i = 1; i + 1 < dirty.size(); ++i) {
+        if (dirty[i + 1].begin - dirty[i].end < dirty[closest + 1].begin - dirty[closest].end) {
+          closest = i;
+        }
+      }
+      dirty[closest].end = dirty[closest + 1].end;
+      dirty.erase(dirty.begin() + closest + 1);
+    }
+  }
+};
+
+using MmapSectorIO = BasicMmapSectorIO<>;
+}  // namespace tsdb
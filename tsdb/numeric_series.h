@@ -0,0 +1,136 @@
+//
+// Typed layer over Series for numeric telemetry: points are buffered and written as Gorilla compressed blocks.
+//
+
+#pragma once
+#include <cassert>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "exception.h"
+#include "gorilla.h"
+#include "sector_defs.h"
+
+namespace tsdb {
+
+/// Buffers (timestamp, value) points and writes them to `series` as one entry per block, flagged
+/// LogEntry::attr_numeric. Points are neither durable nor visible to iterate() until their block is written: when it
+/// reaches max_file_size, or on flush() / sync(). Other entries of the series are skipped by iterate().
+template <typename TSeries>
+struct NumericSeries {
+  explicit NumericSeries(TSeries& series) : series(series), block_capacity(series.get_series_config().max_file_size) {
+    assert(block_capacity > sizeof(uint32_t) + GorillaEncoder::max_point_bytes);
+    block.reserve(block_capacity);
+  }
+
+  NumericSeries(const NumericSeries&) = delete;
+  NumericSeries& operator=(const NumericSeries&) = delete;
+
+  void append(uint64_t timestamp, double value) {
+    std::lock_guard g(lock);
+    if (encoder.bytes() + GorillaEncoder::max_point_bytes > block_capacity) {
+      flush_locked();
+    }
+    if (encoder.size() == 0) {
+      first_timestamp = timestamp;
+    }
+    encoder.append(timestamp, value);
+  }
+
+  /// Write the buffered points, if any.
+  void flush() {
+    std::lock_guard g(lock);
+    flush_locked();
+  }
+
+  void sync() {
+    flush();
+    series.sync();
+  }
+
+  /// Reads from a snapshot of the written blocks, like Series::iterate, without holding the lock of this object:
+  /// fcn may append, and appends from other threads proceed meanwhile.
+  /// \param after inclusive
+  /// \param before exclusive
+  /// \return number of blocks skipped because the writer overwrote them meanwhile, see Series::iterate
+  template <typename TCb>
+    requires std::is_invocable_r_v<bool, TCb, uint64_t, double>
+  size_t iterate(const TCb& fcn, bool descending = true, uint64_t after = 0, uint64_t before = 0) {
+    // Entries are looked up by the timestamp of their first point, so the block holding `after` may begin before it.
+    auto first_entry = after;
+    if (after) {
+      if (auto previous = series.entry_before(after)) {
+        first_entry = previous->timestamp;
+      }
+    }
+
+    // Per call, so concurrent iterations do not share them.
+    std::vector<uint8_t> read_buffer;
+    std::vector<std::pair<uint64_t, double>> points;
+    return series.iterate(
+        [&](auto& data_log_entry) {
+          auto& entry = data_log_entry.log_entry;
+          if (!(entry.attr & LogEntry::attr_numeric)) {
+            return true;
+          }
+          auto size = data_log_entry.size();
+          read_buffer.resize(size);
+          data_log_entry.read(read_buffer.data(), size);
+          if (data_log_entry.get_accumulated_crc() != entry.checksum) {
+            throw CorruptedDataError("Numeric block checksum mismatch");
+          }
+
+          GorillaDecoder decoder(read_buffer);
+          points.clear();
+          uint64_t timestamp;
+          double value;
+          while (decoder.next(timestamp, value)) {
+            if ((after && timestamp < after) || (before && timestamp >= before)) {
+              continue;
+            }
+            if (!descending && !fcn(timestamp, value)) {
+              return false;
+            }
+            if (descending) {
+              points.push_back({timestamp, value});
+            }
+          }
+          // The bit stream only decodes forward.
+          for (auto it = points.rbegin(); it != points.rend(); ++it) {
+            if (!fcn(it->first, it->second)) {
+              return false;
+            }
+          }
+          return true;
+        },
+        descending,
+        first_entry,
+        before);
+  }
+
+  /// Bytes of points buffered so far, encoded.
+  [[nodiscard]] size_t pending_bytes() {
+    std::lock_guard g(lock);
+    return encoder.size() ? encoder.bytes() : 0;
+  }
+
+ private:
+  TSeries& series;
+  const uint32_t block_capacity;
+
+  std::mutex lock;
+  std::vector<uint8_t> block;
+  GorillaEncoder encoder{block};
+  uint64_t first_timestamp{0};
+
+  void flush_locked() {
+    if (encoder.size() == 0) {
+      return;
+    }
+    series.insert_entry(block.data(), block.size(), LogEntry::attr_numeric, first_timestamp);
+    encoder.reset();
+  }
+};
+}  // namespace tsdb
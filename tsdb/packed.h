@@ -0,0 +1,151 @@
+//
+// Packed blocks: many small records stored in the payload of a single entry.
+//
+
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "exception.h"
+#include "sector_defs.h"
+
+namespace tsdb {
+
+/// Payload layout: PackedBlockHeader, n_records PackedRecordSlot, then the record bytes.
+struct PackedBlockHeader {
+  uint64_t base_timestamp;
+  uint32_t n_records;
+  uint32_t reserved{0};
+} __attribute__((packed));
+
+struct PackedRecordSlot {
+  // Relative to PackedBlockHeader::base_timestamp
+  uint32_t timestamp_delta;
+  // Relative to the beginning of the payload
+  uint16_t offset;
+  uint16_t size;
+} __attribute__((packed));
+
+/// A record as read back from a packed block.
+struct PackedRecord {
+  uint64_t timestamp;
+  std::span<const uint8_t> data;
+};
+
+/// Accumulates records in RAM until the block is written as one entry. Buffers are reserved up front, so adding
+/// records does not allocate.
+struct PackedBlockBuilder {
+  /// Offsets in the slot table are 16 bits wide, which bounds the block size.
+  constexpr static uint32_t max_capacity = UINT16_MAX;
+
+  explicit PackedBlockBuilder(uint32_t capacity) : capacity(std::min(capacity, max_capacity)) {
+    assert(this->capacity > sizeof(PackedBlockHeader) + sizeof(PackedRecordSlot));
+    slots.reserve((this->capacity - sizeof(PackedBlockHeader)) / sizeof(PackedRecordSlot));
+    data.reserve(this->capacity);
+    block.reserve(this->capacity);
+  }
+
+  [[nodiscard]] bool empty() const {
+    return slots.empty();
+  }
+
+  [[nodiscard]] size_t size() const {
+    return slots.size();
+  }
+
+  /// Serialized size of the block.
+  [[nodiscard]] size_t bytes() const {
+    return sizeof(PackedBlockHeader) + slots.size() * sizeof(PackedRecordSlot) + data.size();
+  }
+
+  /// Largest record that fits an empty block.
+  [[nodiscard]] uint32_t max_record_size() const {
+    return capacity - sizeof(PackedBlockHeader) - sizeof(PackedRecordSlot);
+  }
+
+  /// \return true if the record can be added without writing the block first.
+  [[nodiscard]] bool fits(uint32_t len, uint64_t timestamp) const {
+    if (empty()) {
+      return len <= max_record_size();
+    }
+    return bytes() + sizeof(PackedRecordSlot) + len <= capacity && timestamp - base_timestamp <= UINT32_MAX;
+  }
+
+  void add(const void* record, uint16_t len, uint64_t timestamp) {
+    assert(fits(len, timestamp));
+    if (empty()) {
+      base_timestamp = timestamp;
+    }
+    // Offsets are fixed in finish(), once the size of the slot table is known.
+    slots.push_back({(uint32_t)(timestamp - base_timestamp), (uint16_t)data.size(), len});
+    data.insert(data.end(), (const uint8_t*)record, (const uint8_t*)record + len);
+  }
+
+  [[nodiscard]] uint64_t first_timestamp() const {
+    return base_timestamp;
+  }
+
+  /// Serializes the block. The returned view is valid until the next call to clear().
+  std::span<const uint8_t> finish() {
+    auto data_offset = sizeof(PackedBlockHeader) + slots.size() * sizeof(PackedRecordSlot);
+    for (auto& slot : slots) {
+      slot.offset += data_offset;
+    }
+
+    block.resize(bytes());
+    PackedBlockHeader header{base_timestamp, (uint32_t)slots.size()};
+    memcpy(block.data(), &header, sizeof(header));
+    memcpy(block.data() + sizeof(header), slots.data(), slots.size() * sizeof(PackedRecordSlot));
+    memcpy(block.data() + data_offset, data.data(), data.size());
+    return block;
+  }
+
+  void clear() {
+    slots.clear();
+    data.clear();
+    block.clear();
+  }
+
+ private:
+  uint32_t capacity;
+  uint64_t base_timestamp{0};
+  std::vector<PackedRecordSlot> slots;
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> block;
+};
+
+/// Random access to the records of a packed block payload.
+struct PackedBlockReader {
+  explicit PackedBlockReader(std::span<const uint8_t> payload) : payload(payload) {
+    if (payload.size() < sizeof(PackedBlockHeader)) {
+      throw CorruptedDataError("Packed block too small");
+    }
+    memcpy(&header, payload.data(), sizeof(header));
+    if (sizeof(PackedBlockHeader) + (size_t)header.n_records * sizeof(PackedRecordSlot) > payload.size()) {
+      throw CorruptedDataError("Packed block slot table out of range");
+    }
+  }
+
+  [[nodiscard]] size_t size() const {
+    return header.n_records;
+  }
+
+  [[nodiscard]] PackedRecord operator[](size_t i) const {
+    assert(i < size());
+    PackedRecordSlot slot{};
+    memcpy(&slot, payload.data() + sizeof(PackedBlockHeader) + i * sizeof(PackedRecordSlot), sizeof(slot));
+    if ((size_t)slot.offset + slot.size > payload.size()) {
+      throw CorruptedDataError("Packed record out of range");
+    }
+    return {header.base_timestamp + slot.timestamp_delta, payload.subspan(slot.offset, slot.size)};
+  }
+
+ private:
+  std::span<const uint8_t> payload;
+  PackedBlockHeader header{};
+};
+}  // namespace tsdb
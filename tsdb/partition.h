@@ -5,6 +5,8 @@
 #pragma once
 
 #include <cassert>
+
+#include "common.h"
 namespace tsdb {
 
 namespace literals {
@@ -43,9 +45,10 @@ struct Partition {
     return {begin_sector_addr, end_sector_addr - begin_sector_addr};
   }
 
+  template <uint32_t SectorSize = sector_size>
   static Partition create_with_size(uint32_t begin_sector_addr, uint32_t size) {
-    assert(size % sector_size == 0);
-    return {begin_sector_addr, size / sector_size};
+    assert(size % SectorSize == 0);
+    return {begin_sector_addr, size / SectorSize};
   }
 };
 
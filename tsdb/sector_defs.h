@@ -3,29 +3,46 @@
 //
 
 #pragma once
+#include <cstddef>
+#include <cstring>
+
 #include "common.h"
 namespace tsdb {
 
 struct LogEntry {
+  // attr bits owned by the engine; the rest are free for the user.
+  // The payload is a packed block of small records, see packed.h
+  constexpr static uint32_t attr_packed = 1u << 31;
+  // The payload is a block of Gorilla encoded (timestamp, double) points, see gorilla.h
+  constexpr static uint32_t attr_numeric = 1u << 30;
+  // The payload is LZ compressed: uint32 uncompressed size, then an lz.h block. checksum covers the uncompressed data.
+  constexpr static uint32_t attr_compressed = 1u << 29;
+  constexpr static uint32_t attr_reserved = attr_packed | attr_numeric | attr_compressed;
+
   uint64_t timestamp;
   uint32_t checksum;
   uint32_t begin_sector_offset;
   uint32_t size;
   uint32_t attr{0};
 
+  template <uint32_t SectorSize = sector_size>
   inline size_t end_sector_addr() const {
-    return begin_sector_offset + min_sector_for_size(size) - 1;
+    return begin_sector_offset + min_sector_for_size<SectorSize>(size) - 1;
   }
 
   bool operator==(LogEntry const&) const = default;
 
 } __attribute__((packed));
 
-struct HeaderSector {
+/// Header sectors hold as many entries as fit: 21 in 512 bytes, 170 in 4096.
+template <uint32_t SectorSize>
+struct BasicHeaderSector {
   uint32_t crc;
   uint32_t write_count;
-  constexpr static uint32_t n_entries = 21;
+  constexpr static uint32_t n_entries = (SectorSize - 8) / sizeof(LogEntry);
   LogEntry entries[n_entries];
+  // Empty for 512 byte sectors.
+  uint8_t reserved[SectorSize - 8 - n_entries * sizeof(LogEntry)];
 
   /// This function scan through each entries and gives the index of usable slot.
   /// If there is an entry with timestamp == 0 (this entry is not used), return this entry's index.
@@ -55,8 +72,8 @@ struct HeaderSector {
   template <typename CRC>
   uint32_t compute_crc() {
     CRC crc_computer;
-    auto offset = offsetof(HeaderSector, entries);
-    crc_computer.update((uint8_t*)this + offset, sector_size - offset);
+    auto offset = offsetof(BasicHeaderSector, entries);
+    crc_computer.update((uint8_t*)this + offset, SectorSize - offset);
     return crc_computer.get();
   }
 
@@ -75,10 +92,54 @@ struct HeaderSector {
     if (clear_stats) {
       write_count = 0;
     }
-    auto offset = offsetof(HeaderSector, entries);
-    memset((uint8_t*)this + offset, 0, sector_size - offset);
+    auto offset = offsetof(BasicHeaderSector, entries);
+    memset((uint8_t*)this + offset, 0, SectorSize - offset);
   }
 
 } __attribute__((packed));
+using HeaderSector = BasicHeaderSector<sector_size>;
 static_assert(sizeof(HeaderSector) == sector_size);
+static_assert(HeaderSector::n_entries == 21);
+static_assert(sizeof(BasicHeaderSector<4096>) == 4096);
+
+/// Snapshot of the write head, stored in the last sector of a partition when checkpoints are enabled.
+/// It is rewritten every few header sector writes and on a clean shutdown. It is valid only while the head sector still
+/// has the recorded write_count.
+template <uint32_t SectorSize>
+struct BasicCheckpointSector {
+  constexpr static uint32_t magic_value = 0x5453434b;  // "TSCK"
+
+  uint32_t crc;
+  uint32_t magic;
+  uint64_t generation;
+  uint32_t n_header_sectors;
+  uint32_t head_sector_idx;
+  uint32_t head_write_count;
+  uint32_t slot_idx;
+  uint32_t data_sector_offset;
+  uint64_t previous_timestamp;
+  uint8_t reserved[SectorSize - 44];
+
+  template <typename CRC>
+  uint32_t compute_crc() {
+    CRC crc_computer;
+    auto offset = offsetof(BasicCheckpointSector, magic);
+    crc_computer.update((uint8_t*)this + offset, SectorSize - offset);
+    return crc_computer.get();
+  }
+
+  template <typename CRC>
+  uint32_t update_crc() {
+    crc = compute_crc<CRC>();
+    return crc;
+  }
+
+  template <typename CRC>
+  bool check_crc() {
+    return compute_crc<CRC>() == crc;
+  }
+
+} __attribute__((packed));
+using CheckpointSector = BasicCheckpointSector<sector_size>;
+static_assert(sizeof(CheckpointSector) == sector_size);
 }  // namespace tsdb
\ No newline at end of file
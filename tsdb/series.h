@@ -3,14 +3,30 @@
 //
 
 #pragma once
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
 
+#include "async.h"
 #include "common.h"
 #include "exception.h"
 #include "header_sectors_manager.h"
 #include "io.h"
+#include "lz.h"
+#include "packed.h"
 #include "partition.h"
 #include "sector_defs.h"
+#include "work_stealing.h"
 
 namespace tsdb {
 
@@ -18,11 +34,63 @@ struct SeriesConfig {
   // Used to determine how many header sector is required. Will be round up to the sector's capacity
   uint32_t max_entries;
   uint32_t max_file_size;
+  // Reserve the last sector of the partition for a checkpoint of the write head, so a clean restart reads two
+  // sectors instead of scanning all header sectors. Changes the layout: pick it when the partition is created.
+  bool checkpoint{false};
+  // Group commit: concurrent sync() calls coalesce into one header write. The first caller waits up to this long
+  // for others to join, bounding how late an insert becomes durable. 0 writes the header sector on every sync().
+  std::chrono::microseconds group_commit_window{0};
+  // End the group commit window early once this many inserts are waiting to be made durable. 0 for no limit.
+  uint32_t group_commit_max_inserts{0};
+  // Size of the blocks insert_packed() fills before writing them as one entry. Capped by max_file_size.
+  uint32_t packed_block_size{4096};
+  // LZ compress payloads written by insert() and packed blocks, whenever that saves at least one sector. Reading is
+  // transparent either way; insert_batch() and transactions always write uncompressed.
+  bool compress{false};
 };
 
+/// One entry of Series::insert_batch, or one record yielded by Series::iterate_records.
+struct Record {
+  const void* data;
+  uint32_t len;
+  uint32_t attr{0};
+  // 0 for the current time
+  uint64_t timestamp{0};
+};
+
+struct SyncStats {
+  size_t sync_calls{0};
+  // Header writes issued by sync(). A sync() that finds its inserts already durable does not write.
+  size_t header_writes{0};
+
+  [[nodiscard]] size_t writes_saved() const {
+    return sync_calls - header_writes;
+  }
+};
+
+struct ParallelIterateOptions {
+  // Deliver entries one at a time in iterate() order instead of concurrently as they are read.
+  bool ordered{false};
+  bool descending{true};
+  // Ordered delivery: entries read ahead of the next one to deliver, at most.
+  uint32_t max_pending{64};
+  // Entries per chunk dealt to the workers; the unit of stealing.
+  uint32_t chunk_size{16};
+};
+
+template <typename TSeries>
+struct NumericSeries;
+
 template <typename IO, typename CRC = CRCDefault, typename ClockType = std::chrono::system_clock>
 struct Series {
+  // Writes its blocks with the reserved LogEntry::attr_numeric.
+  template <typename TSeries>
+  friend struct NumericSeries;
+
   using HeaderSectorsManagerType = HeaderSectorsManager<IO, CRC, ClockType>;
+  using Clock = ClockType;
+  constexpr static uint32_t sector_size = IO::sector_size;
+  using HeaderSector = typename HeaderSectorsManagerType::HeaderSector;
   explicit Series(IO& io, const Partition& partition, const SeriesConfig& cfg)
       : io(io), cfg(cfg), partition(partition) {
     assert(n_header_sectors > 0);
@@ -41,10 +109,55 @@ struct Series {
   uint32_t n_header_sectors{cfg.max_entries / HeaderSector::n_entries + 1};
   uint32_t n_total_sectors{partition.n_sectors};
 
-  HeaderSectorsManagerType header_sectors_manager{io, partition.begin_sector_addr, n_header_sectors, n_total_sectors};
+  HeaderSectorsManagerType header_sectors_manager{io, partition.begin_sector_addr, n_header_sectors, n_total_sectors, cfg.checkpoint};
 
   std::mutex lock{};
 
+  // Group commit state. n_inserted and n_durable only change with `lock` held.
+  std::atomic<uint64_t> n_inserted{0};
+  std::atomic<uint64_t> n_durable{0};
+  std::mutex commit_lock;
+  std::condition_variable commit_cv;
+  bool committing{false};
+  SyncStats stats;
+
+  // insert_batch scratch, kept to avoid allocating on every batch.
+  struct alignas(sector_size) TailSector {
+    uint8_t data[sector_size];
+  };
+  std::vector<TailSector> batch_tails;
+  std::vector<WriteSegment> batch_segments;
+
+  // Reading a compressed entry: the chunk of compressed sectors and the decoder, whose history takes 64 KiB. Passed
+  // from one entry to the next by iterations, see Snapshot::data_log_entry().
+  struct DecompressionState {
+    uint32_t size{0};
+    lz::StreamDecoder decoder{0};
+    std::vector<TailSector> chunk;
+    std::span<const uint8_t> pending;
+  };
+
+  // Records of insert_packed() not written yet, and the timestamp of the last one.
+  PackedBlockBuilder packed_block{std::min(cfg.packed_block_size, cfg.max_file_size)};
+  uint64_t previous_packed_timestamp{0};
+  // Compressed packed block, written from within the lock.
+  std::vector<uint8_t> compressed_packed_block;
+
+  // Entries whose data sectors are reserved but which are not in the header sectors yet: open transactions, and the
+  // inserts made behind them. Published in order, as the front ones are committed.
+  struct Reservation {
+    typename HeaderSectorsManagerType::DataAllocation allocation;
+    // allocated_sectors() right after the allocation
+    uint64_t allocated_until;
+    uint32_t size;
+    uint32_t attr;
+    uint32_t checksum{0};
+    bool committed{false};
+  };
+  std::deque<Reservation> reservations;
+  // Id of reservations.front(). Also read by sync() under commit_lock only, hence atomic.
+  std::atomic<uint64_t> first_reservation{0};
+
  public:
   const Partition& get_partition() {
     return partition;
@@ -55,45 +168,152 @@ struct Series {
   }
 
   /// Insert whole buffer at once
+  /// \throw Error if attr has bits of LogEntry::attr_reserved
   void insert(const void* buffer, uint32_t len, uint32_t attr = 0, uint64_t timestamp = 0) {
+    check_user_attr(attr);
+    insert_entry(buffer, len, attr, timestamp);
+  }
+
+  /// Awaitable insert(). The write path of the series is synchronous on every backend, so the insert runs on the
+  /// OffloadPool and the coroutine resumes there. `buffer` must stay valid until then.
+  auto async_insert(const void* buffer, uint32_t len, uint32_t attr = 0, uint64_t timestamp = 0) {
+    return offload([=, this] { insert(buffer, len, attr, timestamp); });
+  }
+
+  /// Insert whole buffer at once, the checksum is computed by n_workers threads before taking the lock.
+  /// Worth it for large entries only; small buffers are checksummed on the calling thread.
+  void insert_parallel(const void* buffer, uint32_t len, unsigned n_workers, uint32_t attr = 0, uint64_t timestamp = 0) {
+    check_user_attr(attr);
     assert(buffer);
     assert(len);
     assert(len <= cfg.max_file_size);
 
+    insert_maybe_compressed(buffer, len, parallel_checksum<CRC>(buffer, len, n_workers), attr, timestamp);
+  }
+
+  /// Insert several records under one lock. Checksums are computed before taking the lock. The data of consecutive
+  /// records is laid out back to back in the data ring and written with one vectored write, together with the header
+  /// sector whenever a record fills it. Each record still gets its own header slot.
+  void insert_batch(std::span<const Record> records) {
+    if (records.empty()) {
+      return;
+    }
+
+    for (auto& record : records) {
+      check_user_attr(record.attr);
+    }
+
+    // Per thread, so it can be filled before taking the lock.
+    static thread_local std::vector<uint32_t> checksums;
+    checksums.resize(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+      assert(records[i].data);
+      assert(records[i].len);
+      assert(records[i].len <= cfg.max_file_size);
+      CRC crc_computer;
+      crc_computer.update(records[i].data, records[i].len);
+      checksums[i] = crc_computer.get();
+    }
+
     std::lock_guard g(lock);
+    flush_packed_locked();
+    if (!reservations.empty()) {
+      for (size_t i = 0; i < records.size(); ++i) {
+        insert_locked(records[i].data, records[i].len, checksums[i], records[i].attr, records[i].timestamp);
+      }
+      return;
+    }
 
+    if (batch_tails.size() < records.size()) {
+      batch_tails.resize(records.size());
+    }
+    batch_segments.clear();
+    auto now = duration_cast<std::chrono::microseconds>(ClockType::now().time_since_epoch()).count();
+
+    for (size_t i = 0; i < records.size(); ++i) {
+      auto& record = records[i];
+      auto& entry = header_sectors_manager.add_log_partial(record.len, record.timestamp ? record.timestamp : now, record.attr);
+      entry.checksum = checksums[i];
+
+      WriteSegment segments[2];
+      auto n_segments = IO::bytes_to_write_segments(
+          record.data, record.len, header_sectors_manager.sector_addr_r2a(entry.begin_sector_offset), batch_tails[i].data, segments);
+      batch_segments.insert(batch_segments.end(), segments, segments + n_segments);
+
+      auto header_writes = header_sectors_manager.header_write_count();
+      if (header_sectors_manager.advance_writes_header()) {
+        // The data written so far goes out with the header sector that commits it.
+        header_sectors_manager.advance_slot(batch_segments);
+        batch_segments.clear();
+      } else {
+        header_sectors_manager.advance_slot();
+      }
+      on_committed(header_writes);
+    }
+
+    if (!batch_segments.empty()) {
+      io.writev_sectors(batch_segments);
+    }
+  }
+
+  /// Append a small record to the current packed block. Blocks are written as a single entry flagged
+  /// LogEntry::attr_packed once full, or on flush_packed() / sync(); until then the records are neither durable nor
+  /// visible to iterate_records(). Timestamps of packed records are kept monotonic.
+  /// \throw Error if the record does not fit an empty block
+  void insert_packed(const void* buffer, uint32_t len, uint64_t timestamp = 0) {
+    assert(buffer);
+    assert(len);
+    if (len > packed_block.max_record_size()) {
+      throw Error("record too big for a packed block");
+    }
+
+    std::lock_guard g(lock);
     if (timestamp == 0) {
       timestamp = duration_cast<std::chrono::microseconds>(ClockType::now().time_since_epoch()).count();
     }
+    timestamp = std::max(timestamp, previous_packed_timestamp);
+    previous_packed_timestamp = timestamp;
 
-    CRC crc_computer;
-    crc_computer.update(buffer, len);
-    auto checksum = crc_computer.get();
-
-    RelativeSectorAddress relative_sector_address = header_sectors_manager.add_log(len, checksum, timestamp, attr);
-    AbsoluteSectorAddress absolute_sector_address = header_sectors_manager.sector_addr_r2a(relative_sector_address);
+    if (!packed_block.fits(len, timestamp)) {
+      flush_packed_locked();
+    }
+    // max_record_size() is below UINT16_MAX.
+    packed_block.add(buffer, (uint16_t)len, timestamp);
+  }
 
-    write_data_sectors(buffer, len, absolute_sector_address);
+  /// Write the records of the current packed block, if any.
+  void flush_packed() {
+    std::lock_guard g(lock);
+    flush_packed_locked();
   }
 
+  /// Streams one entry whose checksum is computed as it is written. The data sectors and the entry's place in the header
+  /// sectors are reserved by begin_insert_transaction() under the series lock; write() goes to the device without it,
+  /// so several transactions, inserts and reads proceed meanwhile. finalize() publishes the entry. Entries are published
+  /// in reservation order: an entry inserted while a transaction is open is written right away, but only becomes
+  /// visible once the transactions reserved before it are finalized; sync() waits for them.
   struct InsertTransaction {
-    InsertTransaction(IO& io, HeaderSectorsManagerType& header_sectors_manager, LogEntry& entry, std::mutex& lock) : entry(entry), io(io), header_sectors_manager(header_sectors_manager), lock(lock) {}
+    InsertTransaction(Series& series, uint64_t reservation, uint32_t size, AbsoluteSectorAddress begin_sector_addr)
+        : series(series), reservation(reservation), size(size), begin_sector_addr(begin_sector_addr) {}
+
+    InsertTransaction(const InsertTransaction&) = delete;
+    InsertTransaction& operator=(const InsertTransaction&) = delete;
 
     void write(void* buf, uint32_t len) {
       if (is_finalized) {
         throw Error("Overflow");
       }
-      assert(len % sector_size == 0);
-      assert(written_length + len <= entry.size);
       crc_computer.update(buf, len);
-      size_t required_sectors = min_sector_for_size(len);
-      io.write_sectors(buf, header_sectors_manager.sector_addr_r2a(entry.begin_sector_offset) + write_sector_idx, required_sectors);
-      write_sector_idx += required_sectors;
+      write_chunk(buf, len);
+    }
 
-      written_length += len;
-      if (written_length == entry.size) {
-        finalize();
+    /// Write a chunk whose checksum was already computed (e.g. on a worker thread); it is merged with CRC::combine.
+    void write(void* buf, uint32_t len, uint32_t chunk_crc) {
+      if (is_finalized) {
+        throw Error("Overflow");
       }
+      crc_computer.append(chunk_crc, len);
+      write_chunk(buf, len);
     }
 
     virtual ~InsertTransaction() {
@@ -101,12 +321,26 @@ struct Series {
     }
 
    private:
-    IO& io;
-    HeaderSectorsManagerType& header_sectors_manager;
+    /// The device write of a chunk already added to crc_computer.
+    void write_chunk(void* buf, uint32_t len) {
+      assert(len % sector_size == 0);
+      assert(written_length + len <= size);
+      size_t required_sectors = min_sector_for_size<sector_size>(len);
+      series.io.write_sectors(buf, begin_sector_addr + write_sector_idx, required_sectors);
+      write_sector_idx += required_sectors;
+
+      written_length += len;
+      if (written_length == size) {
+        finalize();
+      }
+    }
+
+    Series& series;
+    const uint64_t reservation;
+    const uint32_t size;
+    const AbsoluteSectorAddress begin_sector_addr;
     CRC crc_computer;
-    std::mutex& lock;
 
-    LogEntry& entry;
     uint32_t write_sector_idx{0};
     uint32_t written_length{0};
 
@@ -116,95 +350,942 @@ struct Series {
       if (is_finalized) {
         return;
       }
-      entry.checksum = crc_computer.get();
-      header_sectors_manager.advance_slot();
-      lock.unlock();
       is_finalized = true;
+      std::lock_guard g(series.lock);
+      series.commit_locked(reservation, crc_computer.get());
     }
   };
 
-  InsertTransaction begin_insert_transaction(uint32_t len, uint32_t timestamp = 0) {
+  /// \throw Error if attr has bits of LogEntry::attr_reserved
+  InsertTransaction begin_insert_transaction(uint32_t len, uint64_t timestamp = 0, uint32_t attr = 0) {
+    check_user_attr(attr);
     assert(len);
     assert(len <= cfg.max_file_size);
 
-    lock.lock();
-
-    if (timestamp == 0) {
-      timestamp = duration_cast<std::chrono::microseconds>(ClockType::now().time_since_epoch()).count();
-    }
-
-    auto& entry = header_sectors_manager.add_log_partial(len, timestamp);
-    return {io, header_sectors_manager, entry, lock};
+    std::lock_guard g(lock);
+    flush_packed_locked();
+    auto reservation = reserve_locked(len, timestamp, attr);
+    return {*this, reservation, len, header_sectors_manager.sector_addr_r2a(reserved(reservation).allocation.begin_sector_offset)};
   }
 
+  struct EntryReader;
+
   struct DataLogEntry {
+    friend struct EntryReader;
+
    public:
-    DataLogEntry(const LogEntry& log_entry, uint32_t data_sector_begin_addr, IO& io) : log_entry(log_entry), data_sector_begin_addr(data_sector_begin_addr), io(io) {}
+    /// \param allocator with `expiry`, for entries read without the series lock: every read checks that the writer did
+    /// not overwrite the data meanwhile, and throws EntryOverwrittenError if it may have.
+    /// \param recycled decompression buffers to use, and where to leave them once the entry is destroyed
+    DataLogEntry(const LogEntry& log_entry, uint32_t data_sector_begin_addr, IO& io, const HeaderSectorsManagerType* allocator = nullptr, uint64_t expiry = UINT64_MAX, std::unique_ptr<DecompressionState>* recycled = nullptr)
+        : log_entry(log_entry), data_sector_begin_addr(data_sector_begin_addr), io(io), allocator(allocator), expiry(expiry), recycled_decompression(recycled) {
+      if (recycled) {
+        decompression = std::move(*recycled);
+      }
+    }
+
+    DataLogEntry(DataLogEntry&&) = default;
+
+    ~DataLogEntry() {
+      if (recycled_decompression && decompression) {
+        *recycled_decompression = std::move(decompression);
+      }
+    }
 
    public:
     const LogEntry log_entry;
 
     CRC crc_computer;
 
-    ///
+    /// Size of the payload as inserted. For compressed entries this reads the first sector on the first call.
+    uint32_t size() {
+      if (!(log_entry.attr & LogEntry::attr_compressed)) {
+        return log_entry.size;
+      }
+      return decompression_state().size;
+    }
+
+    /// Compressed entries are decompressed on the fly, reading a few sectors at a time, so the same chunked reads work
+    /// for both and the accumulated crc is always over the uncompressed payload.
     /// \param out
     /// \param len
     /// \return read bytes
     uint32_t read(void* out, uint32_t len) {
+      if (log_entry.attr & LogEntry::attr_compressed) {
+        return read_compressed(out, len);
+      }
       assert(len % sector_size == 0 || len + sector_size * idx == log_entry.size);
 
-      if (idx > min_sector_for_size(log_entry.size)) {
-        return 0;
-      }
-      if (log_entry.size > sector_size * idx) {
-        len = std::min(len, log_entry.size - sector_size * idx);
-      } else {
+      len = next_read_size(len);
+      if (len == 0) {
         return 0;
       }
 
       io.read_bytes_from_sectors(out, len, data_sector_begin_addr + log_entry.begin_sector_offset + idx);
+      check_overwritten();
       crc_computer.update(out, len);
-      idx += min_sector_for_size(len);
+      idx += min_sector_for_size<sector_size>(len);
+      return len;
+    }
+
+    struct AsyncRead;
+
+    /// Awaitable read(), same contract. The entry and `out` must stay valid until it completes.
+    /// With an IO::native_async backend the sectors are requested with async_read_sectors and the coroutine resumes
+    /// from their completion, i.e. from whoever drives the IO (wait_all(), poll(), ...). Otherwise, and for compressed
+    /// entries, read() runs on the OffloadPool.
+    AsyncRead async_read(void* out, uint32_t len) {
+      return {*this, out, len};
+    }
+
+    struct AsyncRead {
+      AsyncRead(DataLogEntry& entry, void* out, uint32_t len) : entry(entry), out(out), len(len) {}
+
+      bool await_ready() {
+        if (!requests_sectors()) {
+          return false;
+        }
+        assert(len % sector_size == 0 || len + sector_size * entry.idx == entry.log_entry.size);
+        len = entry.next_read_size(len);
+        return len == 0;
+      }
+
+      bool await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        if (!requests_sectors()) {
+          OffloadPool::shared().post([this] {
+            try {
+              len = entry.read(out, len);
+            } catch (...) {
+              error = std::current_exception();
+            }
+            waiter.resume();
+          });
+          return true;
+        }
+
+        auto addr = entry.data_sector_begin_addr + entry.log_entry.begin_sector_offset + entry.idx;
+        auto n_sectors = (uint32_t)min_sector_for_size<sector_size>(len);
+        auto n_full = len % sector_size ? n_sectors - 1 : n_sectors;
+        // One count stays ours until both requests are queued, in case they complete before async_read_sectors returns.
+        pending = 1 + (n_full > 0) + (n_full < n_sectors);
+        auto done = [this](std::exception_ptr e) { complete(e); };
+        if (n_full) {
+          entry.io.async_read_sectors(out, addr, n_full, done);
+        }
+        if (n_full < n_sectors) {
+          if (!entry.async_tail) {
+            entry.async_tail = std::make_unique<TailSector>();
+          }
+          entry.io.async_read_sectors(entry.async_tail->data, addr + n_full, 1, done);
+        }
+        entry.io.submit();
+        // Resume right away if everything completed already.
+        return pending.fetch_sub(1) != 1;
+      }
+
+      uint32_t await_resume() {
+        if (error) {
+          std::rethrow_exception(error);
+        }
+        if (!requests_sectors() || len == 0) {
+          return len;
+        }
+        auto n_sectors = (uint32_t)min_sector_for_size<sector_size>(len);
+        if (auto partial = len % sector_size) {
+          memcpy((uint8_t*)out + (n_sectors - 1) * sector_size, entry.async_tail->data, partial);
+        }
+        entry.check_overwritten();
+        entry.crc_computer.update(out, len);
+        entry.idx += n_sectors;
+        return len;
+      }
+
+     private:
+      DataLogEntry& entry;
+      void* out;
+      uint32_t len;
+      std::coroutine_handle<> waiter;
+      std::atomic<uint32_t> pending{0};
+      std::atomic<bool> failed{false};
+      std::exception_ptr error;
+
+      [[nodiscard]] bool requests_sectors() const {
+        return IO::native_async && !(entry.log_entry.attr & LogEntry::attr_compressed);
+      }
+
+      void complete(std::exception_ptr e) {
+        if (e && !failed.exchange(true)) {
+          error = e;
+        }
+        if (pending.fetch_sub(1) == 1) {
+          waiter.resume();
+        }
+      }
+    };
+
+    /// Random access read that leaves the sequential position and accumulated crc untouched, so several threads
+    /// can read different parts of the entry. Verify by merging the chunk checksums in order with CRC::combine.
+    /// \param offset byte offset in the entry, must be sector aligned
+    /// \return read bytes
+    uint32_t read_at(void* out, uint32_t len, uint32_t offset) const {
+      if (log_entry.attr & LogEntry::attr_compressed) {
+        throw Error("Random access to a compressed entry");
+      }
+      assert(offset % sector_size == 0);
+      assert(len % sector_size == 0 || len + offset == log_entry.size);
+
+      if (offset >= log_entry.size) {
+        return 0;
+      }
+      len = std::min(len, log_entry.size - offset);
+      io.read_bytes_from_sectors(out, len, data_sector_begin_addr + log_entry.begin_sector_offset + offset / sector_size);
+      check_overwritten();
       return len;
     }
 
+    /// The whole payload as stored on the device, without copying. Only for IO backends that map the device.
+    /// The crc is not accumulated; compare log_entry.checksum yourself if needed. The view is live: check
+    /// overwritten() once done with it.
+    std::span<const uint8_t> view() const
+      requires MappedIO<IO>
+    {
+      if (log_entry.attr & LogEntry::attr_compressed) {
+        throw Error("Compressed entries can not be viewed in place");
+      }
+      return io.map_sectors(data_sector_begin_addr + log_entry.begin_sector_offset, min_sector_for_size<sector_size>(log_entry.size)).first(log_entry.size);
+    }
+
     uint32_t get_accumulated_crc() {
       return crc_computer.get();
     }
 
+    /// True if the writer may have overwritten the data since the entry was listed.
+    [[nodiscard]] bool overwritten() const {
+      return allocator && allocator->allocated_sectors() > expiry;
+    }
+
    protected:
     uint32_t data_sector_begin_addr{};
     uint32_t idx{0};
     IO& io;
+    const HeaderSectorsManagerType* allocator;
+    uint64_t expiry;
+
+    void check_overwritten() const {
+      if (overwritten()) {
+        throw EntryOverwrittenError("Entry overwritten while reading");
+      }
+    }
+
+    /// Bytes the next sequential read of up to `len` returns, 0 at the end of the entry.
+    [[nodiscard]] uint32_t next_read_size(uint32_t len) const {
+      if (log_entry.size <= sector_size * idx) {
+        return 0;
+      }
+      return std::min(len, log_entry.size - sector_size * idx);
+    }
+
+    // Partial last sector of async_read()
+    std::unique_ptr<TailSector> async_tail;
+
+    // Compressed sectors read per IO request.
+    constexpr static uint32_t decompression_chunk_sectors = 8;
+
+    // Buffers left by a previous entry until decompression_state() starts on this one.
+    std::unique_ptr<DecompressionState> decompression;
+    bool decompression_started{false};
+    std::unique_ptr<DecompressionState>* recycled_decompression;
+
+    /// Read the next chunk of compressed sectors into the state, at sector `idx` of the entry.
+    void read_compressed_chunk(DecompressionState& state) {
+      auto n_sectors = (uint32_t)min_sector_for_size<sector_size>(log_entry.size);
+      if (idx >= n_sectors) {
+        throw CorruptedDataError("Compressed entry truncated");
+      }
+      auto n = std::min(decompression_chunk_sectors, n_sectors - idx);
+      auto bytes = std::min(n * sector_size, log_entry.size - idx * sector_size);
+      state.chunk.resize(n);
+      io.read_bytes_from_sectors(state.chunk.data(), bytes, data_sector_begin_addr + log_entry.begin_sector_offset + idx);
+      check_overwritten();
+      state.pending = {(const uint8_t*)state.chunk.data(), bytes};
+      idx += n;
+    }
+
+    DecompressionState& decompression_state() {
+      if (!decompression_started) {
+        if (!decompression) {
+          decompression = std::make_unique<DecompressionState>();
+        }
+        auto& state = *decompression;
+        read_compressed_chunk(state);
+        if (state.pending.size() < sizeof(uint32_t)) {
+          throw CorruptedDataError("Compressed entry too small");
+        }
+        memcpy(&state.size, state.pending.data(), sizeof(uint32_t));
+        state.pending = state.pending.subspan(sizeof(uint32_t));
+        state.decoder.reset(state.size);
+        decompression_started = true;
+      }
+      return *decompression;
+    }
+
+    uint32_t read_compressed(void* out, uint32_t len) {
+      auto& state = decompression_state();
+      uint32_t produced = 0;
+      while (produced < len && !state.decoder.done()) {
+        if (state.pending.empty()) {
+          read_compressed_chunk(state);
+        }
+        produced += state.decoder.decode(state.pending, (uint8_t*)out + produced, len - produced);
+      }
+      crc_computer.update(out, produced);
+      return produced;
+    }
   };
 
+  /// Buffered sequential reader over a DataLogEntry, for reads of any size and alignment. The entry is fetched in
+  /// windows of `window_sectors` sectors, two at a time: while the caller consumes one window the next one is already
+  /// requested with the asynchronous IO interface, so backends with a native asynchronous path overlap the device
+  /// with the caller. The crc is accumulated into the entry; do not mix with DataLogEntry::read on the same entry.
+  /// Compressed entries are decompressed through DataLogEntry::read, without read-ahead.
+  struct EntryReader {
+    explicit EntryReader(DataLogEntry& entry, uint32_t window_sectors = 64) : entry(entry), window_sectors(window_sectors) {
+      assert(window_sectors > 0);
+      if (entry.log_entry.attr & LogEntry::attr_compressed) {
+        return;
+      }
+      n_sectors = min_sector_for_size<sector_size>(entry.log_entry.size);
+      for (auto& w : windows) {
+        w.sectors.resize(window_sectors);
+        fetch(w);
+      }
+    }
+
+    EntryReader(const EntryReader&) = delete;
+    EntryReader& operator=(const EntryReader&) = delete;
+
+    ~EntryReader() {
+      // The buffers must outlive the requests.
+      for (auto& w : windows) {
+        if (w.bytes) {
+          wait(w, false);
+        }
+      }
+    }
+
+    /// \return read bytes, less than len only at the end of the entry.
+    uint32_t read(void* out, uint32_t len) {
+      if (entry.log_entry.attr & LogEntry::attr_compressed) {
+        return entry.read(out, len);
+      }
+
+      uint32_t produced = 0;
+      while (produced < len) {
+        auto& w = windows[current];
+        if (w.bytes == 0) {
+          break;
+        }
+        wait(w, true);
+        entry.check_overwritten();
+        auto n = std::min(len - produced, w.bytes - w.pos);
+        auto data = (const uint8_t*)w.sectors.data() + w.pos;
+        memcpy((uint8_t*)out + produced, data, n);
+        entry.crc_computer.update(data, n);
+        produced += n;
+        w.pos += n;
+        if (w.pos == w.bytes) {
+          fetch(w);
+          current ^= 1;
+        }
+      }
+      return produced;
+    }
+
+    /// Device requests issued so far.
+    [[nodiscard]] size_t request_count() const {
+      return n_requests;
+    }
+
+   private:
+    struct Window {
+      std::vector<TailSector> sectors;
+      // Valid bytes, 0 once the entry is exhausted.
+      uint32_t bytes{0};
+      uint32_t pos{0};
+      // Completions may run on another thread, see IO::wait_all.
+      std::atomic<bool> ready{false};
+      std::exception_ptr error;
+    };
+
+    DataLogEntry& entry;
+    const uint32_t window_sectors;
+    uint32_t n_sectors{0};
+    uint32_t next_sector{0};
+    Window windows[2];
+    uint32_t current{0};
+    size_t n_requests{0};
+
+    void fetch(Window& w) {
+      w.pos = 0;
+      w.bytes = 0;
+      if (next_sector == n_sectors) {
+        return;
+      }
+      auto n = std::min(window_sectors, n_sectors - next_sector);
+      w.bytes = std::min(n * sector_size, entry.log_entry.size - next_sector * sector_size);
+      w.ready = false;
+      w.error = nullptr;
+      auto addr = entry.data_sector_begin_addr + entry.log_entry.begin_sector_offset + next_sector;
+      next_sector += n;
+      n_requests++;
+      entry.io.async_read_sectors(w.sectors.data(), addr, n, [&w](std::exception_ptr error) {
+        w.error = error;
+        w.ready.store(true, std::memory_order_release);
+      });
+      entry.io.submit();
+    }
+
+    void wait(Window& w, bool rethrow) {
+      while (!w.ready.load(std::memory_order_acquire)) {
+        entry.io.wait_all();
+        if (!w.ready.load(std::memory_order_acquire)) {
+          std::this_thread::yield();
+        }
+      }
+      if (w.error && rethrow) {
+        auto error = w.error;
+        // Nothing more to read from this window.
+        w.bytes = 0;
+        std::rethrow_exception(error);
+      }
+    }
+  };
+
+  /// Reads from a snapshot: the matching entries are listed under the lock, which is released before the first
+  /// callback, so inserts proceed during the traversal. An entry whose data the writer overwrites meanwhile (the ring
+  /// wrapped around) is skipped: its reads throw EntryOverwrittenError, which unwinds the callback and is caught here.
+  /// \return number of entries skipped
   template <typename TCb>
     requires std::is_invocable_r_v<bool, TCb, DataLogEntry&>
-  void iterate(const TCb& fcn, bool descending = true, uint64_t after = 0, uint64_t before = 0) {
-    std::lock_guard g(lock);
-    auto entries = header_sectors_manager.get_entries(descending, after, before);
+  size_t iterate(const TCb& fcn, bool descending = true, uint64_t after = 0, uint64_t before = 0) {
+    auto snapshot = take_snapshot(descending, after, before);
+    std::unique_ptr<DecompressionState> decompression_buffers;
+    size_t n_skipped = 0;
+    for (size_t i = 0; i < snapshot.entries.size(); ++i) {
+      auto data_log_entry = snapshot.data_log_entry(i, &decompression_buffers);
+      if (data_log_entry.overwritten()) {
+        n_skipped++;
+        continue;
+      }
+      try {
+        if (!fcn(data_log_entry)) {
+          break;
+        }
+      } catch (const EntryOverwrittenError&) {
+        n_skipped++;
+      }
+    }
+    return n_skipped;
+  }
+
+  /// The entries of iterate() as an async generator: `while (auto* entry = co_await generator.next())`. The snapshot
+  /// is taken on the first next(). Entries already overwritten when reached are skipped; reading one that is
+  /// overwritten later throws EntryOverwrittenError. Use DataLogEntry::async_read to read them without blocking.
+  AsyncGenerator<DataLogEntry> async_iterate(bool descending = true, uint64_t after = 0, uint64_t before = 0) {
+    auto snapshot = take_snapshot(descending, after, before);
+    std::unique_ptr<DecompressionState> decompression_buffers;
+    for (size_t i = 0; i < snapshot.entries.size(); ++i) {
+      auto data_log_entry = snapshot.data_log_entry(i, &decompression_buffers);
+      if (!data_log_entry.overwritten()) {
+        co_yield data_log_entry;
+      }
+    }
+  }
+
+  /// Zero-copy variant for mapped IO: the callback gets the entry and its payload viewed in place. The view may
+  /// change under the callback when the writer wraps around; such entries are counted as skipped afterwards.
+  template <typename TCb>
+    requires MappedIO<IO> && std::is_invocable_r_v<bool, TCb, const LogEntry&, std::span<const uint8_t>>
+  size_t iterate(const TCb& fcn, bool descending = true, uint64_t after = 0, uint64_t before = 0) {
+    return iterate(
+        [&](DataLogEntry& data_log_entry) {
+          auto keep_going = fcn(data_log_entry.log_entry, data_log_entry.view());
+          if (keep_going && data_log_entry.overwritten()) {
+            throw EntryOverwrittenError("Entry overwritten while viewed");
+          }
+          return keep_going;
+        },
+        descending,
+        after,
+        before);
+  }
+
+  /// Record by record iteration: packed blocks are unpacked, other entries are yielded whole.
+  /// The checksum of each entry is verified; the record data is only valid during the callback. Reads from a snapshot
+  /// like iterate(); an entry overwritten before it is read whole is skipped.
+  /// \return number of entries skipped
+  template <typename TCb>
+    requires std::is_invocable_r_v<bool, TCb, const Record&>
+  size_t iterate_records(const TCb& fcn, bool descending = true, uint64_t after = 0, uint64_t before = 0) {
+    // The packed block holding the first records at or after `after` may begin before it.
+    auto snapshot = take_snapshot(descending, after, before, true);
+    std::vector<uint8_t> read_buffer;
+    std::unique_ptr<DecompressionState> decompression_buffers;
+    size_t n_skipped = 0;
+
+    for (size_t entry_idx = 0; entry_idx < snapshot.entries.size(); ++entry_idx) {
+      auto& e = snapshot.entries[entry_idx];
+      auto data_log_entry = snapshot.data_log_entry(entry_idx, &decompression_buffers);
+      try {
+        auto size = data_log_entry.size();
+        read_buffer.resize(size);
+        data_log_entry.read(read_buffer.data(), size);
+      } catch (const EntryOverwrittenError&) {
+        n_skipped++;
+        continue;
+      }
+      if (data_log_entry.get_accumulated_crc() != e.checksum) {
+        throw CorruptedDataError("Entry checksum mismatch");
+      }
+
+      if (!(e.attr & LogEntry::attr_packed)) {
+        if (!fcn(Record{read_buffer.data(), (uint32_t)read_buffer.size(), e.attr & ~LogEntry::attr_compressed, e.timestamp})) {
+          return n_skipped;
+        }
+        continue;
+      }
+
+      PackedBlockReader block(read_buffer);
+      for (size_t i = 0; i < block.size(); ++i) {
+        auto record = block[descending ? block.size() - 1 - i : i];
+        if ((after && record.timestamp < after) || (before && record.timestamp >= before)) {
+          continue;
+        }
+        if (!fcn(Record{record.data.data(), (uint32_t)record.data.size(), 0, record.timestamp})) {
+          return n_skipped;
+        }
+      }
+    }
+    return n_skipped;
+  }
+
+  /// iterate() with the entries read and checksummed by n_threads workers (the calling thread is one of them), for
+  /// exports and verification of whole partitions. The matching entries are dealt to the workers, which steal from
+  /// each other when they run dry. fcn gets each payload whole, only valid during the call; a checksum mismatch throws
+  /// CorruptedDataError. Unordered, fcn runs concurrently on the workers and must be thread safe. Ordered, entries
+  /// pass through a reorder buffer and fcn is called one at a time, in iterate() order. Returning false stops the
+  /// traversal. Reads from a snapshot like iterate(); entries overwritten meanwhile are skipped.
+  /// \return number of entries skipped
+  template <typename TCb>
+    requires std::is_invocable_r_v<bool, TCb, const LogEntry&, std::span<const uint8_t>>
+  size_t parallel_iterate(const TCb& fcn, unsigned n_threads, uint64_t after = 0, uint64_t before = 0, const ParallelIterateOptions& options = {}) {
+    assert(options.max_pending > 0);
+    assert(options.chunk_size > 0);
+    auto snapshot = take_snapshot(options.descending, after, before);
+    auto& entries = snapshot.entries;
+    if (entries.empty()) {
+      return 0;
+    }
+    n_threads = std::max(1u, std::min<unsigned>(n_threads, entries.size()));
+    WorkStealingQueues queues(entries.size(), n_threads, options.chunk_size);
+
+    std::mutex delivery_lock;
+    std::condition_variable delivered_cv;
+    // Ordered delivery: payloads read but not delivered yet, by entry index, and the next index to deliver.
+    // Skipped entries hold no payload.
+    std::map<size_t, std::optional<std::vector<uint8_t>>> reorder_buffer;
+    std::atomic<size_t> next_to_deliver{0};
+    bool delivering = false;
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> n_skipped{0};
+
+    auto deliver_in_order = [&](size_t i, std::vector<uint8_t>& payload, bool skipped) {
+      std::unique_lock d(delivery_lock);
+      if (skipped) {
+        reorder_buffer.emplace(i, std::nullopt);
+      } else {
+        reorder_buffer.emplace(i, std::move(payload));
+      }
+      // A single thread delivers; whoever holds the next entry takes over when nobody does.
+      if (delivering) {
+        return;
+      }
+      delivering = true;
+      while (!stop && !reorder_buffer.empty() && reorder_buffer.begin()->first == next_to_deliver) {
+        auto node = reorder_buffer.extract(reorder_buffer.begin());
+        if (!node.mapped()) {
+          next_to_deliver++;
+          delivered_cv.notify_all();
+          continue;
+        }
+        d.unlock();
+        bool keep_going;
+        try {
+          keep_going = fcn(entries[node.key()], std::span<const uint8_t>(*node.mapped()));
+        } catch (...) {
+          d.lock();
+          delivering = false;
+          throw;
+        }
+        d.lock();
+        if (!keep_going) {
+          stop = true;
+        }
+        next_to_deliver++;
+        // Keep the buffer for the next entry this thread reads.
+        payload = std::move(*node.mapped());
+        delivered_cv.notify_all();
+      }
+      delivering = false;
+    };
+
+    auto worker = [&](unsigned worker_idx) {
+      std::vector<uint8_t> payload;
+      std::unique_ptr<DecompressionState> decompression_buffers;
+      try {
+        while (!stop) {
+          auto limit = options.ordered ? next_to_deliver + options.max_pending : WorkStealingQueues::none;
+          auto i = queues.pop(worker_idx, limit);
+          if (i == WorkStealingQueues::none) {
+            if (!options.ordered || queues.empty()) {
+              return;
+            }
+            std::unique_lock d(delivery_lock);
+            delivered_cv.wait(d, [&] { return stop || next_to_deliver + options.max_pending != limit; });
+            continue;
+          }
 
-    for (auto& e : entries) {
-      DataLogEntry data_log_entry(e, header_sectors_manager.sector_addr_r2a(0), io);
-      if (!fcn(data_log_entry)) {
-        break;
+          auto& e = entries[i];
+          auto data_log_entry = snapshot.data_log_entry(i, &decompression_buffers);
+          bool skipped = false;
+          try {
+            auto size = data_log_entry.size();
+            payload.resize(size);
+            data_log_entry.read(payload.data(), size);
+          } catch (const EntryOverwrittenError&) {
+            skipped = true;
+            n_skipped++;
+          }
+          if (!skipped && data_log_entry.get_accumulated_crc() != e.checksum) {
+            throw CorruptedDataError("Entry checksum mismatch");
+          }
+
+          if (options.ordered) {
+            deliver_in_order(i, payload, skipped);
+          } else if (!skipped && !fcn(e, std::span<const uint8_t>(payload))) {
+            stop = true;
+          }
+        }
+      } catch (...) {
+        {
+          std::lock_guard d(delivery_lock);
+          stop = true;
+        }
+        delivered_cv.notify_all();
+        throw;
+      }
+    };
+
+    std::vector<std::future<void>> workers;
+    for (unsigned w = 1; w < n_threads; ++w) {
+      workers.push_back(std::async(std::launch::async, worker, w));
+    }
+    std::exception_ptr error;
+    try {
+      worker(0);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    for (auto& w : workers) {
+      try {
+        w.get();
+      } catch (...) {
+        if (!error) {
+          error = std::current_exception();
+        }
       }
     }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return n_skipped;
+  }
+
+  /// \return the newest entry older than `timestamp`, if any. Lets readers of blocks that span a time range find the
+  /// block straddling the start of a query.
+  std::optional<LogEntry> entry_before(uint64_t timestamp) {
+    std::lock_guard g(lock);
+    return header_sectors_manager.entry_before(timestamp);
   }
 
   void clear() {
     std::lock_guard g(lock);
+    if (!reservations.empty()) {
+      throw Error("clear with open insert transactions");
+    }
+    packed_block.clear();
+    previous_packed_timestamp = 0;
     header_sectors_manager.clear();
+    n_durable = n_inserted.load();
   }
 
+  /// Makes every insert that completed before the call durable. With a group commit window, concurrent callers share
+  /// one header write: the first becomes the leader, waits for the window (or group_commit_max_inserts) and writes for
+  /// everyone who joined meanwhile.
+  /// An insert made while a transaction is open is only published once the transactions reserved before it are
+  /// finalized, so sync() first waits for them: do not call it from a thread holding an open InsertTransaction.
   void sync() {
-    std::lock_guard g(lock);
-    header_sectors_manager.sync_current_sector();
+    wait_for_reservations();
+    if (cfg.group_commit_window.count() == 0) {
+      {
+        std::lock_guard g(lock);
+        flush_packed_locked();
+        header_sectors_manager.sync_current_sector();
+        n_durable = n_inserted.load();
+      }
+      std::lock_guard c(commit_lock);
+      stats.sync_calls++;
+      stats.header_writes++;
+      return;
+    }
+
+    std::unique_lock c(commit_lock);
+    stats.sync_calls++;
+    auto target = n_inserted.load();
+    while (n_durable < target) {
+      if (committing) {
+        commit_cv.wait(c);
+        continue;
+      }
+
+      committing = true;
+      commit_cv.wait_for(c, cfg.group_commit_window, [&] {
+        return n_durable >= target || (cfg.group_commit_max_inserts && n_inserted - n_durable >= cfg.group_commit_max_inserts);
+      });
+      if (n_durable < target) {
+        c.unlock();
+        try {
+          std::lock_guard g(lock);
+          header_sectors_manager.sync_current_sector();
+          n_durable = n_inserted.load();
+        } catch (...) {
+          c.lock();
+          committing = false;
+          commit_cv.notify_all();
+          throw;
+        }
+        c.lock();
+        stats.header_writes++;
+      }
+      committing = false;
+      commit_cv.notify_all();
+    }
+  }
+
+  [[nodiscard]] SyncStats sync_stats() {
+    std::lock_guard c(commit_lock);
+    return stats;
   }
 
  protected:
-  void write_data_sectors(const void* buffer, uint32_t len, AbsoluteSectorAddress begin_sector_addr) {
-    io.write_sectors(buffer, begin_sector_addr, min_sector_for_size(len));
+  /// Entries listed under the lock, to be read without it.
+  struct Snapshot {
+    std::vector<LogEntry> entries;
+    // HeaderSectorsManager::expiry of each entry
+    std::vector<uint64_t> expiries;
+    const HeaderSectorsManagerType& allocator;
+    uint32_t data_sector_begin_addr;
+    IO& io;
+
+    /// \param decompression_buffers kept by the caller across the entries it reads one after the other, so compressed
+    /// entries do not each allocate their buffers
+    DataLogEntry data_log_entry(size_t i, std::unique_ptr<DecompressionState>* decompression_buffers = nullptr) const {
+      return {entries[i], data_sector_begin_addr, io, &allocator, expiries[i], decompression_buffers};
+    }
+  };
+
+  /// \param with_packed_before also list the entry before `after` if it is a packed block, see iterate_records()
+  Snapshot take_snapshot(bool descending, uint64_t after, uint64_t before, bool with_packed_before = false) {
+    std::lock_guard g(lock);
+    Snapshot snapshot{header_sectors_manager.get_entries(descending, after, before), {}, header_sectors_manager, header_sectors_manager.sector_addr_r2a(0), io};
+    if (with_packed_before && after) {
+      auto previous = header_sectors_manager.entry_before(after);
+      if (previous && (previous->attr & LogEntry::attr_packed)) {
+        snapshot.entries.insert(descending ? snapshot.entries.end() : snapshot.entries.begin(), *previous);
+      }
+    }
+    snapshot.expiries.reserve(snapshot.entries.size());
+    for (auto& e : snapshot.entries) {
+      snapshot.expiries.push_back(header_sectors_manager.expiry(e));
+    }
+    return snapshot;
+  }
+
+  /// Compress `buffer` into `out` as an attr_compressed payload, if that takes fewer sectors than the raw data.
+  /// \return the compressed payload size, 0 if not worth it.
+  static uint32_t compress_payload(const void* buffer, uint32_t len, std::vector<uint8_t>& out) {
+    auto n_sectors = min_sector_for_size<sector_size>(len);
+    if (n_sectors < 2) {
+      return 0;
+    }
+    // Give up as soon as the output would not save a sector.
+    auto capacity = (n_sectors - 1) * sector_size;
+    out.resize(capacity);
+    auto compressed = lz::compress(buffer, len, out.data() + sizeof(uint32_t), capacity - sizeof(uint32_t));
+    if (compressed == 0) {
+      return 0;
+    }
+    memcpy(out.data(), &len, sizeof(len));
+    return sizeof(uint32_t) + compressed;
+  }
+
+  static void check_user_attr(uint32_t attr) {
+    if (attr & LogEntry::attr_reserved) {
+      throw Error("attr bits reserved for the engine");
+    }
+  }
+
+  void insert_entry(const void* buffer, uint32_t len, uint32_t attr, uint64_t timestamp) {
+    assert(buffer);
+    assert(len);
+    assert(len <= cfg.max_file_size);
+
+    CRC crc_computer;
+    crc_computer.update(buffer, len);
+    insert_maybe_compressed(buffer, len, crc_computer.get(), attr, timestamp);
+  }
+
+  void insert_maybe_compressed(const void* buffer, uint32_t len, uint32_t checksum, uint32_t attr, uint64_t timestamp) {
+    // Numeric blocks are already compressed.
+    if (cfg.compress && !(attr & LogEntry::attr_numeric)) {
+      // Per thread, so compression runs before taking the lock.
+      static thread_local std::vector<uint8_t> compressed;
+      if (auto compressed_len = compress_payload(buffer, len, compressed)) {
+        insert_with_checksum(compressed.data(), compressed_len, checksum, attr | LogEntry::attr_compressed, timestamp);
+        return;
+      }
+    }
+    insert_with_checksum(buffer, len, checksum, attr, timestamp);
+  }
+
+  void insert_with_checksum(const void* buffer, uint32_t len, uint32_t checksum, uint32_t attr, uint64_t timestamp) {
+    std::lock_guard g(lock);
+    // Pending packed records are older, keep the entries in time order.
+    flush_packed_locked();
+    insert_locked(buffer, len, checksum, attr, timestamp);
+  }
+
+  void insert_locked(const void* buffer, uint32_t len, uint32_t checksum, uint32_t attr, uint64_t timestamp) {
+    if (!reservations.empty()) {
+      // Behind an open transaction: the data goes out now, the entry is published once the transactions ahead commit.
+      auto id = reserve_locked(len, timestamp, attr);
+      io.write_bytes_to_sectors(const_cast<void*>(buffer), len, header_sectors_manager.sector_addr_r2a(reserved(id).allocation.begin_sector_offset));
+      commit_locked(id, checksum);
+      return;
+    }
+    if (timestamp == 0) {
+      timestamp = duration_cast<std::chrono::microseconds>(ClockType::now().time_since_epoch()).count();
+    }
+
+    auto& entry = header_sectors_manager.add_log_partial(len, timestamp, attr);
+    entry.checksum = checksum;
+    AbsoluteSectorAddress absolute_sector_address = header_sectors_manager.sector_addr_r2a(entry.begin_sector_offset);
+
+    // Data and, when the slot fills the header sector, the header sector itself go out in one batch.
+    WriteSegment segments[2];
+    auto n_segments = IO::bytes_to_write_segments(buffer, len, absolute_sector_address, IO::bounce_sector(), segments);
+    auto header_writes = header_sectors_manager.header_write_count();
+    header_sectors_manager.advance_slot({segments, n_segments});
+    on_committed(header_writes);
+  }
+
+  void flush_packed_locked() {
+    if (packed_block.empty()) {
+      return;
+    }
+    auto block = packed_block.finish();
+    CRC crc_computer;
+    crc_computer.update(block.data(), block.size());
+    uint32_t compressed_len = cfg.compress ? compress_payload(block.data(), block.size(), compressed_packed_block) : 0;
+    if (compressed_len) {
+      insert_locked(compressed_packed_block.data(), compressed_len, crc_computer.get(), LogEntry::attr_packed | LogEntry::attr_compressed, packed_block.first_timestamp());
+    } else {
+      insert_locked(block.data(), block.size(), crc_computer.get(), LogEntry::attr_packed, packed_block.first_timestamp());
+    }
+    packed_block.clear();
+  }
+
+  /// Publish the pending packed records, then wait until every entry reserved so far is in the header sector cache.
+  void wait_for_reservations() {
+    uint64_t target;
+    {
+      std::lock_guard g(lock);
+      flush_packed_locked();
+      target = first_reservation + reservations.size();
+    }
+    std::unique_lock c(commit_lock);
+    commit_cv.wait(c, [&] { return first_reservation >= target; });
+  }
+
+  /// \return id of the reservation
+  uint64_t reserve_locked(uint32_t len, uint64_t timestamp, uint32_t attr) {
+    if (timestamp == 0) {
+      timestamp = duration_cast<std::chrono::microseconds>(ClockType::now().time_since_epoch()).count();
+    }
+    if (!reservations.empty()) {
+      // The ring must not wrap onto the data of an entry still being written. Positions are in allocated_sectors()
+      // units, which do not wrap.
+      auto& oldest = reservations.front();
+      auto oldest_begin = oldest.allocated_until - min_sector_for_size<sector_size>(oldest.size);
+      auto end = header_sectors_manager.allocated_sectors() + header_sectors_manager.sectors_to_allocate(len);
+      if (end - oldest_begin > header_sectors_manager.data_sector_count()) {
+        throw Error("data sectors taken by open transactions");
+      }
+    }
+    auto allocation = header_sectors_manager.allocate_data(len, timestamp);
+    reservations.push_back({allocation, header_sectors_manager.allocated_sectors(), len, attr});
+    return first_reservation + reservations.size() - 1;
+  }
+
+  Reservation& reserved(uint64_t id) {
+    assert(id >= first_reservation && id - first_reservation < reservations.size());
+    return reservations[id - first_reservation];
+  }
+
+  void commit_locked(uint64_t id, uint32_t checksum) {
+    auto& r = reserved(id);
+    r.checksum = checksum;
+    r.committed = true;
+    if (&r != &reservations.front()) {
+      return;
+    }
+    while (!reservations.empty() && reservations.front().committed) {
+      auto& front = reservations.front();
+      auto& entry = header_sectors_manager.fill_slot(front.allocation, front.size, front.attr);
+      entry.checksum = front.checksum;
+      auto header_writes = header_sectors_manager.header_write_count();
+      header_sectors_manager.advance_slot();
+      on_committed(header_writes);
+      reservations.pop_front();
+      first_reservation++;
+    }
+    // Wake sync() callers waiting in wait_for_reservations(). Taking the lock orders this with their predicate check.
+    { std::lock_guard c(commit_lock); }
+    commit_cv.notify_all();
+  }
+
+  /// Called with `lock` held once an entry is committed to the header sector cache.
+  /// \param header_writes header_write_count() before the commit; if the commit wrote the header, it is durable.
+  void on_committed(size_t header_writes) {
+    auto inserted = ++n_inserted;
+    if (header_sectors_manager.header_write_count() != header_writes) {
+      n_durable = inserted;
+    } else if (cfg.group_commit_max_inserts && inserted - n_durable == cfg.group_commit_max_inserts) {
+      // Wake the group commit leader. Taking the lock orders this with its predicate check.
+      { std::lock_guard c(commit_lock); }
+      commit_cv.notify_all();
+    }
   }
 };
 }  // namespace tsdb
\ No newline at end of file
@@ -0,0 +1,559 @@
+//
+// Sector IO on a file or block device through io_uring, using the raw system calls (no liburing).
+//
+
+#pragma once
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io.h"
+
+namespace tsdb {
+
+struct IoUringSectorIOConfig {
+  // Number of submission queue entries, also the maximum number of requests in flight.
+  uint32_t queue_depth{64};
+  SyncPolicy sync_policy{SyncPolicy::on_flush};
+  // Grow a regular file to this many sectors when it is smaller. 0 keeps the current size.
+  uint32_t n_sectors{0};
+};
+
+/// write_sectors()/writev_sectors() copy the data and only queue it (write-behind); the queue is handed to the kernel
+/// in one io_uring_enter when it is full or on flush(), which the engine calls after writing a header sector. So the
+/// data of many inserts and the header sector that commits them are submitted together. order_last_writes() marks the
+/// first write of the header batch IOSQE_IO_DRAIN so the header sector is not written before the data it points to.
+/// Reads, synchronous or not, drain the writes queued or in flight. Errors of write-behind requests are thrown by the
+/// next flush() or read.
+/// The async_* calls do not copy, the buffer must stay valid until the completion runs.
+template <uint32_t SectorSize = sector_size>
+struct BasicIoUringSectorIO : IO<BasicIoUringSectorIO<SectorSize>, SectorSize> {
+  constexpr static uint32_t sector_size = SectorSize;
+  constexpr static bool native_async = true;
+
+  explicit BasicIoUringSectorIO(const std::string& path, const IoUringSectorIOConfig& cfg = {}) : cfg(cfg) {
+    assert(cfg.queue_depth > 0);
+    open_file(path);
+    try {
+      setup_ring();
+    } catch (...) {
+      release();
+      throw;
+    }
+    requests.resize(sq_entries);
+    for (uint32_t i = 0; i < sq_entries; ++i) {
+      free_requests.push_back(sq_entries - 1 - i);
+    }
+  }
+
+  BasicIoUringSectorIO(const BasicIoUringSectorIO&) = delete;
+  BasicIoUringSectorIO& operator=(const BasicIoUringSectorIO&) = delete;
+
+  ~BasicIoUringSectorIO() {
+    try {
+      wait_all();
+    } catch (...) {
+      // Nothing sensible to do with a failed write-behind here.
+    }
+    release();
+  }
+
+  void write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    assert(in);
+    assert(n_sector);
+    check_range(begin_sector, n_sector, "Failed to write sectors");
+    std::unique_lock g(lock);
+    queue_write_behind(g, in, begin_sector, n_sector);
+    after_write(g);
+  }
+
+  void writev_sectors(std::span<const WriteSegment> segments) {
+    for (auto& s : segments) {
+      check_range(s.begin_sector, s.n_sector, "Failed to write sectors");
+    }
+    std::unique_lock g(lock);
+    // Room for the whole batch, so none of it is submitted before order_last_writes() can mark it.
+    while (segments.size() <= sq_entries && in_flight + segments.size() > sq_entries) {
+      submit_locked();
+      reap_locked(g, true);
+    }
+    for (auto& s : segments) {
+      queue_write_behind(g, s.in, s.begin_sector, s.n_sector);
+    }
+    after_write(g);
+  }
+
+  void read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector) {
+    assert(n_sector);
+    check_range(begin_sector, n_sector, "Failed to read sectors");
+
+    std::exception_ptr error;
+    std::atomic<bool> done{false};
+    {
+      std::unique_lock g(lock);
+      // Drain: the read must not overtake queued writes.
+      queue(g, out, begin_sector, n_sector, false, IOSQE_IO_DRAIN, [&](std::exception_ptr e) {
+        error = e;
+        done = true;
+      });
+      submit_locked();
+      wait_until(g, [&] { return done.load(); });
+      rethrow_deferred_error();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  void readv_sectors(std::span<const ReadSegment> segments) {
+    for (auto& s : segments) {
+      check_range(s.begin_sector, s.n_sector, "Failed to read sectors");
+    }
+
+    std::mutex error_lock;
+    std::exception_ptr error;
+    std::atomic<size_t> remaining{segments.size()};
+    {
+      std::unique_lock g(lock);
+      uint8_t flags = IOSQE_IO_DRAIN;
+      for (auto& s : segments) {
+        queue(g, s.out, s.begin_sector, s.n_sector, false, flags, [&](std::exception_ptr e) {
+          if (e) {
+            std::lock_guard eg(error_lock);
+            error = error ? error : e;
+          }
+          remaining--;
+        });
+        flags = 0;
+      }
+      submit_locked();
+      wait_until(g, [&] { return remaining == 0; });
+      rethrow_deferred_error();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  uint32_t n_sectors() { return total_sectors; }
+
+  /// The last `n` writes commit the ones queued before them: the first of them is marked IOSQE_IO_DRAIN, so it starts
+  /// once every earlier request completed, and the later ones start after it.
+  void order_last_writes(uint32_t n) {
+    std::unique_lock g(lock);
+    if (n == 0 || n > recent_writes.size()) {
+      return;
+    }
+    auto position = recent_writes[(n_recent_writes - n) % recent_writes.size()];
+    // Not submitted yet: a full ring only submits before a batch, see writev_sectors().
+    if (position - (sq_local_tail - to_submit) < to_submit) {
+      sqes[position & sq_mask].flags |= IOSQE_IO_DRAIN;
+    }
+  }
+
+  /// Submit everything queued in one io_uring_enter, wait for completion and sync according to the policy.
+  void flush() {
+    {
+      std::unique_lock g(lock);
+      submit_locked();
+      wait_until(g, [&] { return in_flight == 0; });
+      rethrow_deferred_error();
+    }
+    if (cfg.sync_policy == SyncPolicy::on_flush) {
+      sync();
+    }
+  }
+
+  /// Unconditional fdatasync.
+  void sync() {
+    if (fdatasync(fd) != 0) {
+      throw_errno("Failed to sync");
+    }
+  }
+
+  void async_write_sectors(const void* in, uint32_t begin_sector, uint32_t n_sector, IOCompletion done) {
+    check_range(begin_sector, n_sector, "Failed to write sectors");
+    std::unique_lock g(lock);
+    queue(g, const_cast<void*>(in), begin_sector, n_sector, true, 0, std::move(done));
+  }
+
+  void async_read_sectors(void* out, uint32_t begin_sector, uint32_t n_sector, IOCompletion done) {
+    check_range(begin_sector, n_sector, "Failed to read sectors");
+    std::unique_lock g(lock);
+    // Like read_sectors(): the read must not overtake the writes queued before it.
+    queue(g, out, begin_sector, n_sector, false, n_writes ? IOSQE_IO_DRAIN : 0, std::move(done));
+  }
+
+  void submit() {
+    std::unique_lock g(lock);
+    submit_locked();
+  }
+
+  /// Run the callbacks of requests that already completed, without blocking.
+  void poll() {
+    std::unique_lock g(lock);
+    reap_locked(g, false);
+  }
+
+  void wait_all() {
+    std::unique_lock g(lock);
+    submit_locked();
+    wait_until(g, [&] { return in_flight == 0; });
+  }
+
+  /// Number of io_uring_enter calls that handed requests to the kernel.
+  [[nodiscard]] size_t submit_count() const {
+    return n_submits;
+  }
+
+  [[nodiscard]] uint32_t queue_depth() const {
+    return sq_entries;
+  }
+
+ private:
+  struct Request {
+    uint8_t* buffer;
+    uint32_t len;
+    uint64_t offset;
+    bool write;
+    IOCompletion done;
+    // Copy of the data for write-behind requests, which have no completion callback.
+    std::vector<uint8_t> staging;
+  };
+
+  IoUringSectorIOConfig cfg;
+  int fd{-1};
+  uint32_t total_sectors{0};
+
+  int ring_fd{-1};
+  void* sq_ptr{nullptr};
+  size_t sq_ptr_size{0};
+  void* cq_ptr{nullptr};
+  size_t cq_ptr_size{0};
+  io_uring_sqe* sqes{nullptr};
+  size_t sqes_size{0};
+
+  uint32_t sq_entries{0};
+  uint32_t sq_mask{0};
+  uint32_t* sq_head{nullptr};
+  uint32_t* sq_tail{nullptr};
+  uint32_t* sq_array{nullptr};
+  uint32_t sq_local_tail{0};
+
+  uint32_t cq_mask{0};
+  uint32_t* cq_head{nullptr};
+  uint32_t* cq_tail{nullptr};
+  io_uring_cqe* cqes{nullptr};
+
+  std::mutex lock;
+  std::vector<Request> requests;
+  std::vector<uint32_t> free_requests;
+  // Staging buffers of completed write-behind requests, reused.
+  std::vector<std::vector<uint8_t>> staging_pool;
+  uint32_t in_flight{0};
+  // Writes queued or in flight.
+  uint32_t n_writes{0};
+  uint32_t to_submit{0};
+  // Submission queue positions of the last write-behind requests, for order_last_writes().
+  std::array<uint32_t, 4> recent_writes{};
+  uint32_t n_recent_writes{0};
+  size_t n_submits{0};
+  std::exception_ptr deferred_error;
+
+  [[noreturn]] static void throw_errno(const std::string& msg) {
+    throw IOError(msg + ": " + strerror(errno));
+  }
+
+  void open_file(const std::string& path) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw_errno("Failed to open " + path);
+    }
+
+    struct stat st {};
+    uint64_t size = 0;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+      size = st.st_size;
+      if (S_ISBLK(st.st_mode)) {
+        ok = ioctl(fd, BLKGETSIZE64, &size) == 0;
+      } else if (size < (uint64_t)cfg.n_sectors * sector_size) {
+        size = (uint64_t)cfg.n_sectors * sector_size;
+        ok = ftruncate(fd, size) == 0;
+      }
+    }
+    if (!ok) {
+      auto err = errno;
+      ::close(fd);
+      errno = err;
+      throw_errno("Failed to size " + path);
+    }
+    total_sectors = size / sector_size;
+  }
+
+  void setup_ring() {
+    io_uring_params params{};
+    ring_fd = (int)syscall(__NR_io_uring_setup, cfg.queue_depth, &params);
+    if (ring_fd < 0) {
+      throw_errno("Failed to set up io_uring");
+    }
+
+    sq_ptr_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ptr_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ptr_size = cq_ptr_size = std::max(sq_ptr_size, cq_ptr_size);
+    }
+
+    sq_ptr = mmap(nullptr, sq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+      sq_ptr = nullptr;
+      throw_errno("Failed to map io_uring submission queue");
+    }
+    if (single_mmap) {
+      cq_ptr = sq_ptr;
+    } else {
+      cq_ptr = mmap(nullptr, cq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+      if (cq_ptr == MAP_FAILED) {
+        cq_ptr = nullptr;
+        throw_errno("Failed to map io_uring completion queue");
+      }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    auto p = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (p == MAP_FAILED) {
+      throw_errno("Failed to map io_uring submission entries");
+    }
+    sqes = (io_uring_sqe*)p;
+
+    auto sq = (uint8_t*)sq_ptr;
+    sq_entries = params.sq_entries;
+    sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    sq_head = (uint32_t*)(sq + params.sq_off.head);
+    sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    sq_array = (uint32_t*)(sq + params.sq_off.array);
+    sq_local_tail = *sq_tail;
+
+    auto cq = (uint8_t*)cq_ptr;
+    cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    cq_head = (uint32_t*)(cq + params.cq_off.head);
+    cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+  }
+
+  void release() {
+    if (sqes) {
+      munmap(sqes, sqes_size);
+      sqes = nullptr;
+    }
+    if (cq_ptr && cq_ptr != sq_ptr) {
+      munmap(cq_ptr, cq_ptr_size);
+    }
+    cq_ptr = nullptr;
+    if (sq_ptr) {
+      munmap(sq_ptr, sq_ptr_size);
+      sq_ptr = nullptr;
+    }
+    if (ring_fd >= 0) {
+      ::close(ring_fd);
+      ring_fd = -1;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  void check_range(uint32_t begin_sector, uint32_t n_sector, const char* msg) const {
+    if ((uint64_t)begin_sector + n_sector > total_sectors) {
+      throw IOError(msg);
+    }
+  }
+
+  void after_write(std::unique_lock<std::mutex>& g) {
+    if (cfg.sync_policy == SyncPolicy::every_write) {
+      g.unlock();
+      flush_without_policy();
+      sync();
+    }
+  }
+
+  void flush_without_policy() {
+    std::unique_lock g(lock);
+    submit_locked();
+    wait_until(g, [&] { return in_flight == 0; });
+    rethrow_deferred_error();
+  }
+
+  /// Reap until pred holds. Another thread may have reaped our completion and be running its callback unlocked,
+  /// so with nothing in flight just yield instead of waiting for events.
+  template <typename TPred>
+  void wait_until(std::unique_lock<std::mutex>& g, const TPred& pred) {
+    while (!pred()) {
+      if (in_flight) {
+        reap_locked(g, true);
+      } else {
+        g.unlock();
+        std::this_thread::yield();
+        g.lock();
+      }
+    }
+  }
+
+  void rethrow_deferred_error() {
+    if (deferred_error) {
+      auto e = deferred_error;
+      deferred_error = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+  void queue_write_behind(std::unique_lock<std::mutex>& g, const void* in, uint32_t begin_sector, uint32_t n_sector) {
+    std::vector<uint8_t> staging;
+    if (!staging_pool.empty()) {
+      staging = std::move(staging_pool.back());
+      staging_pool.pop_back();
+    }
+    staging.assign((const uint8_t*)in, (const uint8_t*)in + (size_t)n_sector * sector_size);
+    auto idx = queue(g, staging.data(), begin_sector, n_sector, true, 0, nullptr);
+    requests[idx].staging = std::move(staging);
+  }
+
+  /// Fill an SQE. Makes room first when the ring is full, which may submit and reap.
+  /// \return request index
+  uint32_t queue(std::unique_lock<std::mutex>& g, void* buffer, uint32_t begin_sector, uint32_t n_sector, bool write, uint8_t flags, IOCompletion done) {
+    while (in_flight >= sq_entries) {
+      submit_locked();
+      reap_locked(g, true);
+    }
+
+    auto idx = free_requests.back();
+    free_requests.pop_back();
+    auto& r = requests[idx];
+    r.buffer = (uint8_t*)buffer;
+    r.len = n_sector * sector_size;
+    r.offset = (uint64_t)begin_sector * sector_size;
+    r.write = write;
+    r.done = std::move(done);
+    if (write && !r.done) {
+      recent_writes[n_recent_writes++ % recent_writes.size()] = sq_local_tail;
+    }
+    push_sqe(idx, flags);
+    in_flight++;
+    n_writes += write;
+    return idx;
+  }
+
+  void push_sqe(uint32_t idx, uint8_t flags) {
+    auto& r = requests[idx];
+    auto slot = sq_local_tail & sq_mask;
+    auto& sqe = sqes[slot];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.flags = flags;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)r.buffer;
+    sqe.len = r.len;
+    sqe.off = r.offset;
+    sqe.user_data = idx;
+    sq_array[slot] = slot;
+    sq_local_tail++;
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    to_submit++;
+  }
+
+  void enter(uint32_t n_submit, uint32_t min_complete, uint32_t flags) {
+    while (true) {
+      auto ret = syscall(__NR_io_uring_enter, ring_fd, n_submit, min_complete, flags, nullptr, 0);
+      if (ret >= 0) {
+        to_submit -= std::min<uint32_t>(to_submit, ret);
+        if (n_submit) {
+          n_submits++;
+        }
+        return;
+      }
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        throw_errno("io_uring_enter failed");
+      }
+    }
+  }
+
+  void submit_locked() {
+    while (to_submit) {
+      enter(to_submit, 0, 0);
+    }
+  }
+
+  /// Process completions; callbacks run without the lock held.
+  void reap_locked(std::unique_lock<std::mutex>& g, bool block) {
+    auto head = *cq_head;
+    if (block && in_flight && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      enter(to_submit, 1, IORING_ENTER_GETEVENTS);
+    }
+
+    std::vector<std::pair<IOCompletion, std::exception_ptr>> completed;
+    auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      auto& cqe = cqes[head & cq_mask];
+      auto idx = (uint32_t)cqe.user_data;
+      auto& r = requests[idx];
+      auto res = cqe.res;
+      if (res >= 0 && (uint32_t)res < r.len && res > 0) {
+        // Short transfer, queue the rest.
+        r.buffer += res;
+        r.len -= res;
+        r.offset += res;
+        push_sqe(idx, 0);
+        continue;
+      }
+
+      std::exception_ptr error;
+      if (res < 0) {
+        error = std::make_exception_ptr(IOError(std::string(r.write ? "Failed to write sectors: " : "Failed to read sectors: ") + strerror(-res)));
+      } else if (res == 0 && r.len) {
+        error = std::make_exception_ptr(IOError(r.write ? "Failed to write sectors: no progress" : "Failed to read sectors: end of file"));
+      }
+      if (r.done) {
+        completed.emplace_back(std::move(r.done), error);
+        r.done = nullptr;
+      } else if (error && !deferred_error) {
+        // Write-behind request, report on the next flush or read.
+        deferred_error = error;
+      }
+      if (!r.staging.empty()) {
+        staging_pool.push_back(std::move(r.staging));
+        r.staging.clear();
+      }
+      free_requests.push_back(idx);
+      in_flight--;
+      n_writes -= r.write;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    if (!completed.empty()) {
+      g.unlock();
+      for (auto& [done, error] : completed) {
+        done(error);
+      }
+      g.lock();
+    }
+  }
+};
+
+using IoUringSectorIO = BasicIoUringSectorIO<>;
+}  // namespace tsdb
@@ -0,0 +1,108 @@
+//
+// Work stealing distribution of an index range over a fixed set of workers.
+//
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace tsdb {
+
+/// Items [0, n_items) are cut in chunks dealt round robin to one deque per worker, so the lowest items are spread over
+/// every worker. A worker takes items in ascending order from the front of its own deque; once that is empty it steals
+/// the back chunk of another deque, which the owner would have reached last.
+struct WorkStealingQueues {
+  constexpr static size_t none = SIZE_MAX;
+
+  WorkStealingQueues(size_t n_items, unsigned n_workers, size_t chunk_size) : queues(n_workers) {
+    for (auto& q : queues) {
+      q = std::make_unique<Queue>();
+    }
+    for (size_t begin = 0, i = 0; begin < n_items; begin += chunk_size, ++i) {
+      queues[i % n_workers]->chunks.push_back({begin, std::min(begin + chunk_size, n_items)});
+    }
+  }
+
+  /// Claim the next item for `worker`. Only items below `limit` are claimed, which bounds how far workers run ahead of
+  /// a consumer that needs the items in order.
+  /// \return the item, or `none` if no item below `limit` is left
+  size_t pop(unsigned worker, size_t limit = SIZE_MAX) {
+    {
+      auto& own = *queues[worker];
+      std::lock_guard g(own.lock);
+      if (auto item = take_front(own, limit); item != none) {
+        return item;
+      }
+    }
+
+    for (size_t i = 1; i < queues.size(); ++i) {
+      auto& victim = *queues[(worker + i) % queues.size()];
+      Chunk stolen;
+      {
+        std::lock_guard g(victim.lock);
+        if (victim.chunks.empty() || victim.chunks.back().begin >= limit) {
+          continue;
+        }
+        stolen = victim.chunks.back();
+        victim.chunks.pop_back();
+      }
+      n_steals++;
+      if (stolen.end - stolen.begin > 1) {
+        auto& own = *queues[worker];
+        std::lock_guard g(own.lock);
+        own.chunks.push_front({stolen.begin + 1, stolen.end});
+      }
+      return stolen.begin;
+    }
+    return none;
+  }
+
+  /// \return true once every item was claimed.
+  [[nodiscard]] bool empty() {
+    for (auto& q : queues) {
+      std::lock_guard g(q->lock);
+      if (!q->chunks.empty()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Chunks taken from another worker's deque. Approximate while workers are running.
+  [[nodiscard]] size_t steal_count() const {
+    return n_steals;
+  }
+
+ private:
+  struct Chunk {
+    size_t begin;
+    size_t end;
+  };
+
+  struct Queue {
+    std::mutex lock;
+    std::deque<Chunk> chunks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::atomic<size_t> n_steals{0};
+
+  static size_t take_front(Queue& q, size_t limit) {
+    if (q.chunks.empty() || q.chunks.front().begin >= limit) {
+      return none;
+    }
+    auto& chunk = q.chunks.front();
+    auto item = chunk.begin++;
+    if (chunk.begin == chunk.end) {
+      q.chunks.pop_front();
+    }
+    return item;
+  }
+};
+}  // namespace tsdb